@@ -0,0 +1,517 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Output format of the results */
+enum format {JSON, CSV};
+
+static enum format format = JSON;
+static char *diskname;
+/* Size of the file used by the read/write benchmarks */
+static size_t file_size = 16 << 20;
+/* Operations per random I/O, churn and lookup benchmark */
+static size_t num_ops = 2000;
+/* The sync benchmark splits @num_ops over up to that many threads */
+#define MAX_THREADS 8
+static struct fs_mount_opts mount_opts;
+
+/* I/O sizes of the read/write benchmarks */
+static const size_t io_sizes[] = { 512, 4096, 65536, 1 << 20 };
+
+/* Latencies of one benchmark run, in nanoseconds */
+struct samples {
+	uint64_t *ns;
+	size_t count;
+	size_t bytes;
+	uint64_t total_ns;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void samples_init(struct samples *s, size_t count)
+{
+	s->ns = malloc(count * sizeof(uint64_t));
+	if (!s->ns)
+		die("Cannot malloc");
+	s->count = 0;
+	s->bytes = 0;
+	s->total_ns = 0;
+}
+
+static void samples_add(struct samples *s, uint64_t start, size_t bytes)
+{
+	uint64_t ns = now_ns() - start;
+	s->ns[s->count++] = ns;
+	s->total_ns += ns;
+	s->bytes += bytes;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(struct samples *s, double p)
+{
+	if (s->count == 0)
+		return 0;
+	size_t i = (size_t)(p * (s->count - 1) + 0.5);
+	return s->ns[i];
+}
+
+/* Print one result line: @bench run with parameter @param */
+static void report(const char *bench, const char *param, size_t value,
+		   struct samples *s)
+{
+	double secs = s->total_ns / 1e9;
+	double ops = secs > 0 ? s->count / secs : 0;
+	double mbps = secs > 0 ? s->bytes / secs / 1e6 : 0;
+
+	qsort(s->ns, s->count, sizeof(uint64_t), cmp_u64);
+	if (format == JSON)
+		printf("{\"bench\": \"%s\", \"%s\": %zu, \"ops\": %zu, "
+		       "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+		       "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}\n",
+		       bench, param, value, s->count, ops, mbps,
+		       (unsigned long long)percentile(s, 0.50),
+		       (unsigned long long)percentile(s, 0.99),
+		       (unsigned long long)percentile(s, 0.999));
+	else
+		printf("%s,%s,%zu,%zu,%.1f,%.2f,%llu,%llu,%llu\n",
+		       bench, param, value, s->count, ops, mbps,
+		       (unsigned long long)percentile(s, 0.50),
+		       (unsigned long long)percentile(s, 0.99),
+		       (unsigned long long)percentile(s, 0.999));
+	fflush(stdout);
+	free(s->ns);
+}
+
+/* Print a result line from the library counters of @op, over @elapsed ns of
+ wall time */
+static void report_stats(const char *bench, const char *param, size_t value,
+			 const struct fs_op_stats *op, uint64_t elapsed)
+{
+	double secs = elapsed / 1e9;
+	double ops = secs > 0 ? op->calls / secs : 0;
+
+	if (format == JSON)
+		printf("{\"bench\": \"%s\", \"%s\": %zu, \"ops\": %llu, "
+		       "\"ops_per_sec\": %.1f, \"mb_per_sec\": 0.00, "
+		       "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}\n",
+		       bench, param, value, (unsigned long long)op->calls, ops,
+		       (unsigned long long)fs_stats_percentile(op, 50),
+		       (unsigned long long)fs_stats_percentile(op, 99),
+		       (unsigned long long)fs_stats_percentile(op, 99.9));
+	else
+		printf("%s,%s,%zu,%llu,%.1f,0.00,%llu,%llu,%llu\n",
+		       bench, param, value, (unsigned long long)op->calls, ops,
+		       (unsigned long long)fs_stats_percentile(op, 50),
+		       (unsigned long long)fs_stats_percentile(op, 99),
+		       (unsigned long long)fs_stats_percentile(op, 99.9));
+	fflush(stdout);
+}
+
+/* Format a fresh image with @data_blocks data blocks and mount it */
+static void fresh_mount(size_t data_blocks)
+{
+	struct fs_format_opts opts = { .data_blocks = data_blocks };
+
+	if (fs_format(diskname, &opts))
+		die("Cannot format '%s'", diskname);
+	if (fs_mount_opts(diskname, &mount_opts))
+		die("Cannot mount '%s'", diskname);
+}
+
+static void unmount(void)
+{
+	if (fs_umount())
+		die("Cannot unmount '%s'", diskname);
+}
+
+static size_t data_blocks_for(size_t bytes)
+{
+	/* Room for the file plus some slack, within the 16-bit FAT */
+	size_t blocks = bytes / 4096 + 256;
+	return blocks < 65000 ? blocks : 65000;
+}
+
+/* Sequential then random reads and writes of @io_size bytes */
+static void bench_rw(size_t io_size, char *buf)
+{
+	struct samples s;
+	size_t num_io = file_size / io_size;
+	int fd;
+
+	fresh_mount(data_blocks_for(file_size));
+	if (fs_create("bench") || (fd = fs_open("bench")) < 0)
+		die("Cannot create file");
+
+	samples_init(&s, num_io);
+	for (size_t i = 0; i < num_io; i++) {
+		uint64_t start = now_ns();
+		if (fs_write(fd, buf, io_size) != (int)io_size)
+			die("Short write");
+		samples_add(&s, start, io_size);
+	}
+	report("seq_write", "io_size", io_size, &s);
+
+	fs_lseek(fd, 0);
+	samples_init(&s, num_io);
+	for (size_t i = 0; i < num_io; i++) {
+		uint64_t start = now_ns();
+		if (fs_read(fd, buf, io_size) != (int)io_size)
+			die("Short read");
+		samples_add(&s, start, io_size);
+	}
+	report("seq_read", "io_size", io_size, &s);
+
+	samples_init(&s, num_ops);
+	for (size_t i = 0; i < num_ops; i++) {
+		size_t offset = (size_t)(rand() % num_io) * io_size;
+		uint64_t start = now_ns();
+		fs_lseek(fd, offset);
+		if (fs_write(fd, buf, io_size) != (int)io_size)
+			die("Short write");
+		samples_add(&s, start, io_size);
+	}
+	report("rand_write", "io_size", io_size, &s);
+
+	samples_init(&s, num_ops);
+	for (size_t i = 0; i < num_ops; i++) {
+		size_t offset = (size_t)(rand() % num_io) * io_size;
+		uint64_t start = now_ns();
+		fs_lseek(fd, offset);
+		if (fs_read(fd, buf, io_size) != (int)io_size)
+			die("Short read");
+		samples_add(&s, start, io_size);
+	}
+	report("rand_read", "io_size", io_size, &s);
+
+	fs_close(fd);
+	unmount();
+}
+
+/* I/O size of the multi-writer benchmark */
+#define MT_IO_SIZE 65536
+
+/* One thread of the multi-writer benchmark, appending to a file of its own */
+struct writer {
+	pthread_t thread;
+	int fd;
+	char *buf;
+	struct samples s;
+};
+
+static void *writer_run(void *arg)
+{
+	struct writer *w = arg;
+	size_t num_io = file_size / MT_IO_SIZE;
+
+	for (size_t i = 0; i < num_io; i++) {
+		uint64_t start = now_ns();
+		if (fs_write(w->fd, w->buf, MT_IO_SIZE) != MT_IO_SIZE)
+			die("Short write");
+		samples_add(&w->s, start, MT_IO_SIZE);
+	}
+	return NULL;
+}
+
+/* Aggregate append throughput as writer threads are added, each thread
+ writing @file_size bytes to its own file */
+static void bench_mt_write(char *buf)
+{
+	static const size_t threads[] = { 1, 2, 4, 8 };
+	struct writer writers[MAX_THREADS];
+	char name[FS_FILENAME_LEN];
+	size_t num_io = file_size / MT_IO_SIZE;
+
+	for (size_t t = 0; t < ARRAY_SIZE(threads); t++) {
+		size_t n = threads[t];
+		struct samples all;
+		uint64_t start, elapsed;
+
+		fresh_mount(data_blocks_for(n * file_size));
+		for (size_t i = 0; i < n; i++) {
+			snprintf(name, sizeof(name), "writer%u", (unsigned)i);
+			if (fs_create(name) || (writers[i].fd = fs_open(name)) < 0)
+				die("Cannot create file");
+			writers[i].buf = buf;
+			samples_init(&writers[i].s, num_io);
+		}
+
+		start = now_ns();
+		for (size_t i = 0; i < n; i++)
+			pthread_create(&writers[i].thread, NULL, writer_run,
+				       &writers[i]);
+		for (size_t i = 0; i < n; i++)
+			pthread_join(writers[i].thread, NULL);
+		elapsed = now_ns() - start;
+
+		/* Throughput over the wall time, latencies of every write */
+		samples_init(&all, n * num_io);
+		for (size_t i = 0; i < n; i++) {
+			memcpy(all.ns + all.count, writers[i].s.ns,
+			       writers[i].s.count * sizeof(uint64_t));
+			all.count += writers[i].s.count;
+			all.bytes += writers[i].s.bytes;
+			free(writers[i].s.ns);
+			fs_close(writers[i].fd);
+		}
+		all.total_ns = elapsed;
+		report("mt_write", "threads", n, &all);
+		unmount();
+	}
+}
+
+static void *syncer_run(void *arg)
+{
+	struct writer *w = arg;
+
+	for (size_t i = 0; i < w->s.count; i++) {
+		uint64_t start = now_ns();
+		if (fs_write(w->fd, w->buf, 4096) != 4096)
+			die("Short write");
+		if (fs_sync())
+			die("Cannot sync");
+		w->s.ns[i] = now_ns() - start;
+		w->s.total_ns += w->s.ns[i];
+		w->s.bytes += 4096;
+	}
+	return NULL;
+}
+
+/* 4 KiB write + fs_sync() loops as threads are added, @num_ops in total:
+ concurrent syncs share their flushes, the "flush" line counts them */
+static void bench_sync(char *buf)
+{
+	static const size_t threads[] = { 1, 2, 4, 8 };
+	struct writer writers[MAX_THREADS];
+	struct fs_stats stats;
+	char name[FS_FILENAME_LEN];
+
+	for (size_t t = 0; t < ARRAY_SIZE(threads); t++) {
+		size_t n = threads[t], per_thread = num_ops / n;
+		struct samples all;
+		uint64_t start, elapsed;
+
+		fresh_mount(data_blocks_for(num_ops * 4096));
+		for (size_t i = 0; i < n; i++) {
+			snprintf(name, sizeof(name), "syncer%u", (unsigned)i);
+			if (fs_create(name) || (writers[i].fd = fs_open(name)) < 0)
+				die("Cannot create file");
+			writers[i].buf = buf;
+			samples_init(&writers[i].s, per_thread);
+			/* syncer_run() fills the samples itself */
+			writers[i].s.count = per_thread;
+		}
+
+		fs_stats_reset();
+		start = now_ns();
+		for (size_t i = 0; i < n; i++)
+			pthread_create(&writers[i].thread, NULL, syncer_run,
+				       &writers[i]);
+		for (size_t i = 0; i < n; i++)
+			pthread_join(writers[i].thread, NULL);
+		elapsed = now_ns() - start;
+
+		samples_init(&all, n * per_thread);
+		for (size_t i = 0; i < n; i++) {
+			memcpy(all.ns + all.count, writers[i].s.ns,
+			       writers[i].s.count * sizeof(uint64_t));
+			all.count += writers[i].s.count;
+			all.bytes += writers[i].s.bytes;
+			free(writers[i].s.ns);
+			fs_close(writers[i].fd);
+		}
+		all.total_ns = elapsed;
+		report("sync", "threads", n, &all);
+		if (!fs_stats(&stats))
+			report_stats("flush", "threads", n, &stats.flush, elapsed);
+		unmount();
+	}
+}
+
+/* Create, write 4 KiB, close and delete small files, keeping half of the
+ root directory populated */
+static void bench_churn(char *buf)
+{
+	struct samples s;
+	char name[FS_FILENAME_LEN];
+	const size_t live = FS_FILE_MAX_COUNT / 2;
+
+	fresh_mount(4096);
+	samples_init(&s, num_ops);
+	for (size_t i = 0; i < num_ops; i++) {
+		uint64_t start = now_ns();
+		if (i >= live) {
+			snprintf(name, sizeof(name), "churn%u", (unsigned)(i - live));
+			if (fs_delete(name))
+				die("Cannot delete file");
+		}
+		snprintf(name, sizeof(name), "churn%u", (unsigned)i);
+		int fd;
+		if (fs_create(name) || (fd = fs_open(name)) < 0)
+			die("Cannot create file");
+		if (fs_write(fd, buf, 4096) != 4096)
+			die("Short write");
+		fs_close(fd);
+		samples_add(&s, start, 4096);
+	}
+	report("churn", "live_files", live, &s);
+	unmount();
+}
+
+/* fs_open + fs_stat + fs_close of the last file, as the directory fills */
+static void bench_lookup(void)
+{
+	static const size_t fills[] = { 1, 32, 64, FS_FILE_MAX_COUNT };
+	char name[FS_FILENAME_LEN];
+	size_t created = 0;
+
+	fresh_mount(1024);
+	for (size_t f = 0; f < ARRAY_SIZE(fills); f++) {
+		struct samples s;
+
+		for (; created < fills[f]; created++) {
+			snprintf(name, sizeof(name), "file%u", (unsigned)created);
+			if (fs_create(name))
+				die("Cannot create file");
+		}
+
+		samples_init(&s, num_ops);
+		for (size_t i = 0; i < num_ops; i++) {
+			uint64_t start = now_ns();
+			int fd = fs_open(name);
+			if (fd < 0 || fs_stat(fd) < 0)
+				die("Cannot open file");
+			fs_close(fd);
+			samples_add(&s, start, 0);
+		}
+		report("lookup", "files", created, &s);
+	}
+	unmount();
+}
+
+/* Mount and unmount time as a function of the image size */
+static void bench_mount(void)
+{
+	static const size_t sizes[] = { 1024, 8192, 32768, 65000 };
+	const size_t rounds = 50;
+
+	for (size_t i = 0; i < ARRAY_SIZE(sizes); i++) {
+		struct samples mount, umount;
+
+		fresh_mount(sizes[i]);
+		unmount();
+
+		samples_init(&mount, rounds);
+		samples_init(&umount, rounds);
+		for (size_t r = 0; r < rounds; r++) {
+			uint64_t start = now_ns();
+			if (fs_mount_opts(diskname, &mount_opts))
+				die("Cannot mount '%s'", diskname);
+			samples_add(&mount, start, 0);
+
+			start = now_ns();
+			unmount();
+			samples_add(&umount, start, 0);
+		}
+		report("mount", "data_blocks", sizes[i], &mount);
+		report("umount", "data_blocks", sizes[i], &umount);
+	}
+}
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-c] [-d] [-y <mode>] [-s <file MiB>] [-n <ops>] <scratch diskname>\n",
+		program);
+	fprintf(stderr, "\t-c\tCSV output instead of JSON lines\n");
+	fprintf(stderr, "\t-d\tmount with O_DIRECT\n");
+	fprintf(stderr, "\t-y\tdurability: none (default), periodic or close\n");
+	fprintf(stderr, "\t-s\tsize of the read/write benchmark file (default 16)\n");
+	fprintf(stderr, "\t-n\toperations per random, churn and lookup run (default 2000, at least %d)\n",
+		MAX_THREADS);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	char *buf;
+
+	while ((opt = getopt(argc, argv, "cdy:s:n:")) != -1) {
+		switch (opt) {
+		case 'c':
+			format = CSV;
+			break;
+		case 'd':
+			mount_opts.direct = 1;
+			break;
+		case 'y':
+			if (!strcmp(optarg, "none"))
+				mount_opts.durability = FS_DURABLE_NONE;
+			else if (!strcmp(optarg, "periodic"))
+				mount_opts.durability = FS_DURABLE_PERIODIC;
+			else if (!strcmp(optarg, "close"))
+				mount_opts.durability = FS_DURABLE_CLOSE;
+			else
+				usage(argv[0]);
+			break;
+		case 's':
+			file_size = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'n':
+			num_ops = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || file_size < io_sizes[ARRAY_SIZE(io_sizes) - 1] ||
+	    num_ops < MAX_THREADS)
+		usage(argv[0]);
+	diskname = argv[optind];
+
+	buf = malloc(io_sizes[ARRAY_SIZE(io_sizes) - 1]);
+	if (!buf)
+		die("Cannot malloc");
+	memset(buf, 0xA5, io_sizes[ARRAY_SIZE(io_sizes) - 1]);
+	srand(150);
+
+	if (format == CSV)
+		printf("bench,param,value,ops,ops_per_sec,mb_per_sec,p50_ns,p99_ns,p999_ns\n");
+
+	for (size_t i = 0; i < ARRAY_SIZE(io_sizes); i++)
+		bench_rw(io_sizes[i], buf);
+	bench_churn(buf);
+	bench_mt_write(buf);
+	bench_sync(buf);
+	bench_lookup();
+	bench_mount();
+
+	free(buf);
+	return 0;
+}
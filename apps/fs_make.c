@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-r <FAT blocks>] [-b <block size>] [-c] [-p] "
+		"[-u <stripe unit>] <diskname> <data block count> [<member>...]\n",
+		program);
+	fprintf(stderr, "\t-r\treserve extra FAT blocks for holes in sparse files\n");
+	fprintf(stderr, "\t-b\tblock size in bytes, 4096 to 65536 (default 4096)\n");
+	fprintf(stderr, "\t-c\tcreate the data block checksum table\n");
+	fprintf(stderr, "\t-p\tallocate the image now instead of leaving it sparse\n");
+	fprintf(stderr, "\t-u\tstripe unit in bytes (default 65536)\n");
+	fprintf(stderr, "With members, <diskname> is a stripe set file and the "
+		"image is striped across them\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_format_opts opts = { 0 };
+	size_t unit = 65536;
+	int opt, num_members;
+
+	while ((opt = getopt(argc, argv, "r:b:cpu:")) != -1) {
+		switch (opt) {
+		case 'r':
+			opts.fat_reserve = atoi(optarg);
+			break;
+		case 'b':
+			opts.block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			opts.csum = 1;
+			break;
+		case 'p':
+			opts.preallocate = 1;
+			break;
+		case 'u':
+			unit = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2)
+		usage(argv[0]);
+
+	num_members = argc - optind - 2;
+	if (num_members > 0 &&
+	    block_stripe_create(argv[optind], (const char *const *)&argv[optind + 2],
+				num_members, unit)) {
+		fprintf(stderr, "Cannot create stripe set '%s'\n", argv[optind]);
+		return 1;
+	}
+
+	opts.data_blocks = strtoul(argv[optind + 1], NULL, 0);
+	if (fs_format(argv[optind], &opts)) {
+		fprintf(stderr, "Cannot create virtual disk '%s'\n", argv[optind]);
+		return 1;
+	}
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n",
+	       argv[optind], opts.data_blocks);
+	return 0;
+}
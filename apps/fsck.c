@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+/* Exit codes, as for e2fsck */
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNFIXED 4
+#define FSCK_FAILED 8
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-r] [-j <threads>] <diskname>\n", program);
+	fprintf(stderr, "\t-r\trepair the problems found\n");
+	fprintf(stderr, "\t-j\tnumber of checker threads (default: one per CPU)\n");
+	exit(FSCK_FAILED);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_check_report report;
+	int repair = 0;
+	int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	while ((opt = getopt(argc, argv, "rj:")) != -1) {
+		switch (opt) {
+		case 'r':
+			repair = 1;
+			break;
+		case 'j':
+			num_threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if (fs_check(argv[optind], repair, num_threads, &report)) {
+		fprintf(stderr, "Cannot check '%s'\n", argv[optind]);
+		return FSCK_FAILED;
+	}
+
+	printf("%s: %d files, %d used blocks, %d errors",
+	       argv[optind], report.files, report.used_blocks, report.errors);
+	if (repair)
+		printf(", %d fixes", report.repaired);
+	printf("\n");
+
+	if (!report.errors)
+		return FSCK_OK;
+	return repair ? FSCK_FIXED : FSCK_UNFIXED;
+}
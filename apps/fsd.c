@@ -0,0 +1,310 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#include "fsd.h"
+
+/* Keeps a file system mounted and serves test_fs.x requests for it, so that
+ * each command costs a socket round trip instead of a mount and unmount */
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int signum)
+{
+	(void)signum;
+	stopping = 1;
+}
+
+/* A client gets this long to send its request and to take the response,
+ * before the daemon moves on to the next one */
+#define FSD_TIMEOUT_SEC 5
+
+/* Write the output of @func, fs_info_str() or fs_ls_str(), to @out */
+static int format(int (*func)(char *, size_t), FILE *out)
+{
+	int len = func(NULL, 0);
+	char *buf;
+
+	if (len < 0 || !(buf = malloc(len + 1)))
+		return -1;
+	func(buf, len + 1);
+	fputs(buf, out);
+	free(buf);
+	return 0;
+}
+
+/* Open @name and get its size, printing an error to @out on failure */
+static int open_stat(const char *name, int *size, FILE *out)
+{
+	int fs_fd = fs_open(name);
+	if (fs_fd < 0) {
+		fprintf(out, "Cannot open file");
+		return -1;
+	}
+	*size = fs_stat(fs_fd);
+	if (*size < 0) {
+		fs_close(fs_fd);
+		fprintf(out, "Cannot stat file");
+		return -1;
+	}
+	return fs_fd;
+}
+
+/* Carry out one request, with the same output as the local commands. Return
+ * 0 if @out holds the output, 1 if it holds an error message. */
+static int handle(struct fsd_req *req, const char *name, char *data, FILE *out)
+{
+	int fs_fd, size, ret;
+	char *buf;
+
+	switch (req->op) {
+	case FSD_INFO:
+		return format(fs_info_str, out) ? (fprintf(out, "Cannot get info"), 1) : 0;
+
+	case FSD_LS:
+		return format(fs_ls_str, out) ? (fprintf(out, "Cannot list files"), 1) : 0;
+
+	case FSD_STAT:
+		if ((fs_fd = open_stat(name, &size, out)) < 0)
+			return 1;
+		ret = fs_stat_alloc(fs_fd);
+		fs_close(fs_fd);
+		if (!size) {
+			fprintf(out, "Empty file\n");
+			return 0;
+		}
+		fprintf(out, "Size of file '%s' is %d bytes\n", name, size);
+		fprintf(out, "Allocated size of file '%s' is %d bytes\n", name, ret);
+		return 0;
+
+	case FSD_CAT:
+		if ((fs_fd = open_stat(name, &size, out)) < 0)
+			return 1;
+		if (!size) {
+			fs_close(fs_fd);
+			fprintf(out, "Empty file\n");
+			return 0;
+		}
+		buf = malloc(size);
+		if (!buf) {
+			fs_close(fs_fd);
+			fprintf(out, "Cannot malloc");
+			return 1;
+		}
+		ret = fs_read(fs_fd, buf, size);
+		fs_close(fs_fd);
+		if (ret < 0) {
+			free(buf);
+			fprintf(out, "Cannot read file");
+			return 1;
+		}
+		fprintf(out, "Read file '%s' (%d/%d bytes)\n", name, ret, size);
+		fprintf(out, "Content of the file:\n");
+		fwrite(buf, 1, ret, out);
+		free(buf);
+		return 0;
+
+	case FSD_ADD:
+		if (fs_create(name)) {
+			fprintf(out, "Cannot create file");
+			return 1;
+		}
+		if ((fs_fd = fs_open(name)) < 0) {
+			fprintf(out, "Cannot open file");
+			return 1;
+		}
+		ret = fs_write(fs_fd, data, req->data_len);
+		fs_close(fs_fd);
+		if (fs_sync()) {
+			fprintf(out, "Cannot sync");
+			return 1;
+		}
+		fprintf(out, "Wrote file '%s' (%d/%u bytes)\n", name, ret,
+			req->data_len);
+		return 0;
+
+	case FSD_RM:
+		if (fs_delete(name)) {
+			fprintf(out, "Cannot delete file");
+			return 1;
+		}
+		if (fs_sync()) {
+			fprintf(out, "Cannot sync");
+			return 1;
+		}
+		fprintf(out, "Removed file '%s'\n", name);
+		return 0;
+
+	}
+
+	fprintf(out, "Invalid request");
+	return 1;
+}
+
+/* Bytes the free data blocks can hold, as fs_info_str() reports them */
+static size_t free_bytes(void)
+{
+	unsigned long free_blk = 0, blk_size = 0;
+	char buf[512];
+	char *p;
+
+	if (fs_info_str(buf, sizeof(buf)) < 0)
+		return 0;
+	if ((p = strstr(buf, "fat_free_ratio=")))
+		sscanf(p, "fat_free_ratio=%lu", &free_blk);
+	if ((p = strstr(buf, "blk_size=")))
+		sscanf(p, "blk_size=%lu", &blk_size);
+	return free_blk * blk_size;
+}
+
+/* Read and drop @len bytes of @sock */
+static int discard(int sock, size_t len)
+{
+	char buf[4096];
+
+	while (len > 0) {
+		size_t n = len < sizeof(buf) ? len : sizeof(buf);
+		if (fsd_xfer(sock, buf, n, 0))
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+static void serve(int sock)
+{
+	struct fsd_req req;
+	struct fsd_resp resp;
+	char name[256], *data = NULL, *out = NULL;
+	size_t out_len = 0;
+	int too_big;
+	FILE *f;
+
+	if (fsd_xfer(sock, &req, sizeof(req), 0) || req.magic != FSD_MAGIC ||
+	    fsd_xfer(sock, name, req.name_len, 0))
+		return;
+	name[req.name_len] = '\0';
+
+	/* The content is only held in memory if the disk can take it, otherwise
+	 * it is read and dropped so that the client gets the response */
+	too_big = req.data_len > free_bytes();
+	if (too_big) {
+		if (discard(sock, req.data_len))
+			return;
+	} else if (req.data_len) {
+		data = malloc(req.data_len);
+		if (!data || fsd_xfer(sock, data, req.data_len, 0)) {
+			free(data);
+			return;
+		}
+	}
+
+	f = open_memstream(&out, &out_len);
+	if (!f) {
+		free(data);
+		return;
+	}
+	if (too_big) {
+		fprintf(f, "Not enough space for %u bytes", req.data_len);
+		resp.status = 1;
+	} else {
+		resp.status = handle(&req, name, data, f);
+	}
+	fclose(f);
+	resp.len = out_len;
+
+	if (!fsd_xfer(sock, &resp, sizeof(resp), 1))
+		fsd_xfer(sock, out, out_len, 1);
+	free(out);
+	free(data);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	int listener, sock;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <diskname>\n", argv[0]);
+		exit(1);
+	}
+
+	if (fsd_addr(argv[1], &addr)) {
+		fprintf(stderr, "Socket name too long for '%s'\n", argv[1]);
+		exit(1);
+	}
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	/* A socket file left by a daemon that did not stop cleanly is reused,
+	 * one that still answers means the disk is already served */
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr))) {
+		int err = errno;
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (err != EADDRINUSE ||
+		    !connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+			fprintf(stderr, "Cannot serve '%s': %s\n", argv[1],
+				err == EADDRINUSE ? "already served" : strerror(err));
+			exit(1);
+		}
+		close(sock);
+		unlink(addr.sun_path);
+		if (bind(listener, (struct sockaddr *)&addr, sizeof(addr))) {
+			perror("bind");
+			exit(1);
+		}
+	}
+
+	if (fs_mount(argv[1])) {
+		fprintf(stderr, "Cannot mount '%s'\n", argv[1]);
+		unlink(addr.sun_path);
+		exit(1);
+	}
+
+	if (listen(listener, 16)) {
+		perror("listen");
+		fs_umount();
+		unlink(addr.sun_path);
+		exit(1);
+	}
+
+	/* No SA_RESTART, so that a signal gets accept() to return */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("Serving '%s' on '%s'\n", argv[1], addr.sun_path);
+	fflush(stdout);
+
+	while (!stopping) {
+		struct timeval tv = { FSD_TIMEOUT_SEC, 0 };
+
+		sock = accept(listener, NULL, NULL);
+		if (sock < 0)
+			continue;
+		/* A client that stalls must not hold up the others for long */
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		serve(sock);
+		close(sock);
+	}
+
+	close(listener);
+	unlink(addr.sun_path);
+	if (fs_umount()) {
+		fprintf(stderr, "Cannot unmount '%s'\n", argv[1]);
+		exit(1);
+	}
+	return 0;
+}
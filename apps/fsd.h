@@ -0,0 +1,92 @@
+#ifndef _FSD_H
+#define _FSD_H
+
+/*
+ * Request protocol between test_fs.x and the fsd.x daemon, over the Unix
+ * domain socket "<diskname>.sock". Each request is a header followed by
+ * @name_len bytes of file name and @data_len bytes of file content, each
+ * response a header followed by @len bytes of output. A connection carries
+ * one request.
+ *
+ * While a daemon serves a disk, test_fs.x refuses to mount it or to write
+ * it itself.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define FSD_MAGIC 0x31445346 /* "FSD1" */
+
+enum fsd_op {
+	FSD_INFO,
+	FSD_LS,
+	FSD_STAT,
+	FSD_CAT,
+	FSD_ADD,
+	FSD_RM,
+};
+
+struct fsd_req {
+	uint32_t magic;
+	uint8_t op;
+	uint8_t name_len;
+	uint16_t reserved;
+	uint32_t data_len;
+};
+
+struct fsd_resp {
+	/* 0 if the output goes to stdout, 1 if it is an error message */
+	int32_t status;
+	uint32_t len;
+};
+
+/* Transfer exactly @len bytes, -1 on error or early end of stream */
+static inline int fsd_xfer(int sock, void *buf, size_t len, int sending)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t ret = sending ? send(sock, p, len, MSG_NOSIGNAL)
+				      : recv(sock, p, len, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Fill @addr with the socket address of the daemon serving @diskname */
+static inline int fsd_addr(const char *diskname, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if ((size_t)snprintf(addr->sun_path, sizeof(addr->sun_path), "%s.sock",
+			     diskname) >= sizeof(addr->sun_path))
+		return -1;
+	return 0;
+}
+
+/* Whether a daemon answers on the socket of @diskname */
+static inline int fsd_live(const char *diskname)
+{
+	struct sockaddr_un addr;
+	int sock, live;
+
+	if (fsd_addr(diskname, &addr) || access(addr.sun_path, F_OK))
+		return 0;
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return 0;
+	live = !connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+	close(sock);
+	return live;
+}
+
+#endif /* _FSD_H */
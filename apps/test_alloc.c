@@ -0,0 +1,104 @@
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#include "fsd.h"
+
+/*
+ * Counts the heap allocations made by small reads and writes. The program is
+ * linked with --wrap for every allocation function (see the Makefile), so the
+ * calls libfs makes land in the wrappers below whether or not they go through
+ * its own stats_malloc() and friends.
+ */
+
+static unsigned long num_allocs;
+
+#define WRAP(ret, name, params, args)			\
+ret __real_##name params;				\
+ret __wrap_##name params;				\
+ret __wrap_##name params				\
+{							\
+	__atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);	\
+	return __real_##name args;			\
+}
+
+WRAP(void *, malloc, (size_t size), (size))
+WRAP(void *, calloc, (size_t nmemb, size_t size), (nmemb, size))
+WRAP(void *, realloc, (void *ptr, size_t size), (ptr, size))
+WRAP(int, posix_memalign, (void **ptr, size_t align, size_t size),
+     (ptr, align, size))
+WRAP(void *, aligned_alloc, (size_t align, size_t size), (align, size))
+WRAP(void *, memalign, (size_t align, size_t size), (align, size))
+WRAP(void *, valloc, (size_t size), (size))
+WRAP(char *, strdup, (const char *s), (s))
+WRAP(char *, strndup, (const char *s, size_t n), (s, n))
+
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *msg)
+{
+	fprintf(stderr, "%s\n", msg);
+	exit(1);
+}
+
+/* Small unaligned reads and writes at random offsets */
+int main(int argc, char **argv)
+{
+	const size_t file_size = 16 * BLOCK_SIZE, io_size = 100;
+	static char buf[16 * BLOCK_SIZE];
+	unsigned long allocs;
+	size_t num_ops = 1000000;
+	double start, elapsed;
+	int fs_fd;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <diskname> [ops]\n", argv[0]);
+		exit(1);
+	}
+	if (argc > 2)
+		num_ops = strtoul(argv[2], NULL, 0);
+
+	if (fsd_live(argv[1]))
+		die("Disk served by fsd.x, stop it first");
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+	fs_create("hotpath");
+	fs_fd = fs_open("hotpath");
+	if (fs_fd < 0 || fs_write(fs_fd, buf, file_size) != (int)file_size)
+		die("Cannot write file");
+
+	srand(150);
+	allocs = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED);
+	start = get_time();
+	for (size_t i = 0; i < num_ops; i++) {
+		size_t offset = rand() % (file_size - io_size);
+
+		fs_lseek(fs_fd, offset);
+		if (i % 2 ? fs_read(fs_fd, buf, io_size) != (int)io_size
+			  : fs_write(fs_fd, buf, io_size) != (int)io_size)
+			die("Short transfer");
+	}
+	elapsed = get_time() - start;
+	allocs = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED) - allocs;
+
+	fs_close(fs_fd);
+	fs_delete("hotpath");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("FS Hotpath:\n");
+	printf("ops=%zu\n", num_ops);
+	printf("allocations=%lu\n", allocs);
+	printf("ops_per_sec=%.0f\n", elapsed > 0 ? num_ops / elapsed : 0);
+	return 0;
+}
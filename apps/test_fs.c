@@ -1,18 +1,31 @@
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <crc32c.h>
+#include <disk.h>
 #include <fs.h>
 
+#include "fsd.h"
+
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
 #define test_fs_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
@@ -34,230 +47,580 @@ struct thread_arg {
 	char **argv;
 };
 
-void thread_fs_script(void *arg)
+/* The image of @diskname is used in place: while fsd.x has it mounted, a
+ second writer would corrupt it */
+static void check_local(const char *diskname)
+{
+	if (fsd_live(diskname))
+		die("'%s' is served by fsd.x, stop it first", diskname);
+}
+
+static int mount_local(const char *diskname, const struct fs_mount_opts *opts)
+{
+	check_local(diskname);
+	return fs_mount_opts(diskname, opts);
+}
+
+static double get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Script engine: the script is parsed once into an array of operations, so
+ * that running it (and timing it) involves no text handling.
+ */
+enum script_cmd {
+	S_MOUNT,
+	S_UMOUNT,
+	S_CREATE,
+	S_DELETE,
+	S_OPEN,
+	S_CLOSE,
+	S_USE,
+	S_SEEK,
+	S_TRUNCATE,
+	S_FALLOCATE,
+	S_WRITE,
+	S_READ,
+	S_REPEAT,
+	S_END,
+	S_TIME,
+	S_REPORT,
+	S_SEED,
+};
+
+/* Number argument: @lo, or a random value in [@lo, @hi] taken as a
+ multiple of @align */
+struct script_val {
+	long lo, hi, align;
+};
+
+struct script_op {
+	enum script_cmd cmd;
+	int line;
+	/* File name, or label of a TIME block */
+	char *name;
+	/* Descriptor slot, -1 for the current one */
+	int slot;
+	/* Offset, size, length or count */
+	struct script_val val;
+	/* Data to write, or to compare what is read with (NULL: no check) */
+	char *data;
+	size_t data_size;
+	/* Index of the matching REPEAT or END */
+	int jump;
+	/* Checksum verification of MOUNT, sampled every val reads */
+	enum fs_verify verify;
+};
+
+struct script {
+	struct script_op *ops;
+	int num_ops;
+	/* Descriptor names, slot 0 is the unnamed one */
+	char *slot_names[FS_OPEN_MAX_COUNT];
+	int num_slots;
+	/* Largest transfers, to size the shared buffers */
+	size_t max_write, max_read;
+};
+
+/* Measurements of the TIME block being run */
+struct script_timer {
+	const char *label;
+	double start;
+	uint64_t bytes;
+	uint64_t *lat;
+	size_t num_lat, max_lat;
+};
+
+static uint64_t script_rand_state = 1;
+
+/* xorshift64*, reproducible from one SEED to the next */
+static uint64_t script_rand(void)
+{
+	script_rand_state ^= script_rand_state >> 12;
+	script_rand_state ^= script_rand_state << 25;
+	script_rand_state ^= script_rand_state >> 27;
+	return script_rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+static struct script_val script_parse_val(const char *arg, int line)
+{
+	struct script_val val = { 0, 0, 1 };
+
+	if (!arg)
+		die("line %d: missing number", line);
+
+	if (!strncmp(arg, "RANDOM:", 7)) {
+		int n = sscanf(arg + 7, "%ld:%ld:%ld", &val.lo, &val.hi, &val.align);
+		if (n < 2 || val.lo < 0 || val.hi < val.lo || val.align < 1)
+			die("line %d: invalid random range '%s'", line, arg);
+	} else {
+		val.lo = val.hi = atoi(arg);
+	}
+	return val;
+}
+
+static long script_eval(const struct script_val *val)
+{
+	if (val->lo == val->hi)
+		return val->lo;
+
+	long x = val->lo + script_rand() % (val->hi - val->lo + 1);
+	x -= x % val->align;
+	return x < val->lo ? x + val->align : x;
+}
+
+/* Slot of descriptor @name, allocated on first use */
+static int script_slot(struct script *s, const char *name, int line)
+{
+	if (!name)
+		name = "";
+	for (int i = 0; i < s->num_slots; i++) {
+		if (!strcmp(s->slot_names[i], name))
+			return i;
+	}
+	if (s->num_slots == FS_OPEN_MAX_COUNT)
+		die("line %d: too many descriptors", line);
+	s->slot_names[s->num_slots] = strdup(name);
+	return s->num_slots++;
+}
+
+/* Read host file @path, with a zero byte after its content */
+static char *script_load(const char *path, size_t *size, int line)
 {
-	struct thread_arg *t_arg = arg;
 	struct stat st;
-	char *diskname, *script;
-	FILE *fd_script;
-	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
-	char *command_args[total_command_parts];
-	int offset;
-	char mounted = 0;
+	char *data;
+	FILE *f;
 
-	char line_buffer[1024];
-	int command_index = 1;
+	if (!path)
+		die("line %d: missing file name", line);
+	if (stat(path, &st))
+		die_perror("stat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", path);
 
-	if (t_arg->argc < 2)
-		die("Usage: <diskname> <script filename>");
+	f = fopen(path, "r");
+	data = calloc(st.st_size + 1, 1);
+	if (!f || !data)
+		die_perror("open");
+	size_t n = fread(data, 1, st.st_size, f);
+	assert(n == (size_t)st.st_size);
+	fclose(f);
+	*size = st.st_size;
+	return data;
+}
 
-	diskname = t_arg->argv[0];
-	script = t_arg->argv[1];
+/* Data argument of WRITE and READ: DATA <string> or FILE <host file> */
+static void script_parse_data(struct script_op *op, char *source, char *desc)
+{
+	if (!strcmp(source, "DATA")) {
+		if (!desc)
+			die("line %d: missing data", op->line);
+		op->data = strdup(desc);
+		op->data_size = strlen(desc);
+	} else if (!strcmp(source, "FILE")) {
+		op->data = script_load(desc, &op->data_size, op->line);
+	} else {
+		die("line %d: Invalid data description", op->line);
+	}
+}
+
+static void script_parse(struct script *s, const char *path)
+{
+	static const char *names[] = {
+		[S_MOUNT] = "MOUNT", [S_UMOUNT] = "UMOUNT", [S_CREATE] = "CREATE",
+		[S_DELETE] = "DELETE", [S_OPEN] = "OPEN", [S_CLOSE] = "CLOSE",
+		[S_USE] = "USE", [S_SEEK] = "SEEK", [S_TRUNCATE] = "TRUNCATE",
+		[S_FALLOCATE] = "FALLOCATE", [S_WRITE] = "WRITE", [S_READ] = "READ",
+		[S_REPEAT] = "REPEAT", [S_END] = "END", [S_TIME] = "TIME",
+		[S_REPORT] = "REPORT", [S_SEED] = "SEED",
+	};
+	char line_buffer[1024];
+	char *args[5];
+	int stack[64], depth = 0, timing = -1, max_ops = 0, line = 0;
+	FILE *f;
+
+	memset(s, 0, sizeof(*s));
+	script_slot(s, NULL, 0);
 
-	/* Open script on host computer */
-	fd_script = fopen(script, "r");
-	if (!fd_script)
+	f = fopen(path, "r");
+	if (!f)
 		die_perror("fopen");
 
-	int fs_fd = -1;
+	while (fgets(line_buffer, sizeof(line_buffer), f) != NULL) {
+		struct script_op *op;
+		size_t cmd;
 
-	/* Loop through the script and execute the specified commands */
-	while (fgets(line_buffer, 1024, fd_script) != NULL) {
-		/* Remove trailing newline from command line */
+		line++;
 		char *nl = strchr(line_buffer, '\n');
 		if (nl)
 			*nl = '\0';
 
 		/* Tokenize line */
-		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
-			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
-		command = command_args[0];
-
-		int data_fd;
-		int count, data_size;
-
-		char *read_buf;
+		args[0] = strtok(line_buffer, "\t");
+		for (int i = 1; i < 5; i++)
+			args[i] = args[i - 1] ? strtok(NULL, "\t") : NULL;
 
 		/* End when no command present */
-		if (!command)
+		if (!args[0])
+			break;
+		if (args[0][0] == '#')
+			continue;
+
+		for (cmd = 0; cmd < ARRAY_SIZE(names); cmd++) {
+			if (!strcmp(args[0], names[cmd]))
+				break;
+		}
+		if (cmd == ARRAY_SIZE(names))
+			die("line %d: unknown command '%s'", line, args[0]);
+
+		if (s->num_ops == max_ops) {
+			max_ops = max_ops ? 2 * max_ops : 64;
+			s->ops = realloc(s->ops, max_ops * sizeof(*s->ops));
+			if (!s->ops)
+				die_perror("realloc");
+		}
+		op = &s->ops[s->num_ops];
+		memset(op, 0, sizeof(*op));
+		op->cmd = cmd;
+		op->line = line;
+		op->slot = -1;
+
+		switch (op->cmd) {
+		case S_MOUNT:
+			if (!args[1])
+				break;
+			if (!strcmp(args[1], "VERIFY")) {
+				op->verify = FS_VERIFY_ALWAYS;
+			} else if (!strcmp(args[1], "SAMPLED")) {
+				op->verify = FS_VERIFY_SAMPLED;
+				op->val = script_parse_val(args[2], line);
+			} else {
+				die("line %d: unknown mount option '%s'", line, args[1]);
+			}
 			break;
+		case S_UMOUNT:
+			break;
+		case S_CREATE:
+		case S_DELETE:
+			if (!args[1])
+				die("line %d: missing file name", line);
+			op->name = strdup(args[1]);
+			break;
+		case S_OPEN:
+			if (!args[1])
+				die("line %d: missing file name", line);
+			op->name = strdup(args[1]);
+			op->slot = script_slot(s, args[2], line);
+			break;
+		case S_CLOSE:
+			if (args[1])
+				op->slot = script_slot(s, args[1], line);
+			break;
+		case S_USE:
+			if (!args[1])
+				die("line %d: missing descriptor name", line);
+			op->slot = script_slot(s, args[1], line);
+			break;
+		case S_SEEK:
+		case S_TRUNCATE:
+		case S_FALLOCATE:
+		case S_SEED:
+			op->val = script_parse_val(args[1], line);
+			break;
+		case S_WRITE:
+			if (!args[1])
+				die("line %d: missing data", line);
+			if (!strcmp(args[1], "SIZE")) {
+				op->val = script_parse_val(args[2], line);
+				s->max_write = MAX(s->max_write, (size_t)op->val.hi);
+			} else {
+				script_parse_data(op, args[1], args[2]);
+			}
+			break;
+		case S_READ:
+			op->val = script_parse_val(args[1], line);
+			if (op->val.lo < 0)
+				die("line %d: invalid data read length", line);
+			if (args[2])
+				script_parse_data(op, args[2], args[3]);
+			s->max_read = MAX(s->max_read, (size_t)op->val.hi);
+			s->max_read = MAX(s->max_read, op->data_size);
+			break;
+		case S_REPEAT:
+			op->val = script_parse_val(args[1], line);
+			if (depth == (int)ARRAY_SIZE(stack))
+				die("line %d: REPEAT nested too deep", line);
+			stack[depth++] = s->num_ops;
+			break;
+		case S_END:
+			if (depth == 0)
+				die("line %d: END without REPEAT", line);
+			op->jump = stack[--depth];
+			s->ops[op->jump].jump = s->num_ops;
+			break;
+		case S_TIME:
+			if (timing != -1)
+				die("line %d: TIME blocks cannot nest", line);
+			op->name = strdup(args[1] ? args[1] : "");
+			timing = s->num_ops;
+			break;
+		case S_REPORT:
+			if (timing == -1)
+				die("line %d: REPORT without TIME", line);
+			op->jump = timing;
+			timing = -1;
+			break;
+		}
+		s->num_ops++;
+	}
+	fclose(f);
+
+	if (depth)
+		die("line %d: REPEAT without END", s->ops[stack[depth - 1]].line);
+	if (timing != -1)
+		die("line %d: TIME without REPORT", s->ops[timing].line);
+}
+
+static void script_free(struct script *s)
+{
+	for (int i = 0; i < s->num_ops; i++) {
+		free(s->ops[i].name);
+		free(s->ops[i].data);
+	}
+	for (int i = 0; i < s->num_slots; i++)
+		free(s->slot_names[i]);
+	free(s->ops);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void script_report(struct script_timer *t)
+{
+	double elapsed = get_time() - t->start;
+	size_t n = t->num_lat;
+
+	qsort(t->lat, n, sizeof(*t->lat), cmp_u64);
+	printf("TIME %s: ops=%zu elapsed_s=%.6f ops_per_sec=%.1f MBps=%.1f "
+	       "p50_us=%.2f p99_us=%.2f max_us=%.2f\n", t->label, n, elapsed,
+	       elapsed > 0 ? n / elapsed : 0,
+	       elapsed > 0 ? t->bytes / elapsed / 1e6 : 0,
+	       n ? t->lat[n / 2] / 1e3 : 0, n ? t->lat[n * 99 / 100] / 1e3 : 0,
+	       n ? t->lat[n - 1] / 1e3 : 0);
+	t->label = NULL;
+}
+
+void thread_fs_script(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct script s;
+	struct script_timer timer = { 0 };
+	char *diskname, *write_buf, *read_buf;
+	int fds[FS_OPEN_MAX_COUNT];
+	long *remaining;
+	int cur = 0, count;
+	char mounted = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
 
-		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+	diskname = t_arg->argv[0];
+	script_parse(&s, t_arg->argv[1]);
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		fds[i] = -1;
+	remaining = calloc(s.num_ops + 1, sizeof(*remaining));
+	write_buf = malloc(s.max_write + 1);
+	read_buf = malloc(s.max_read + 1);
+	if (!remaining || !write_buf || !read_buf)
+		die_perror("malloc");
+	for (size_t i = 0; i < s.max_write; i++)
+		write_buf[i] = script_rand();
+
+	for (int pc = 0; pc < s.num_ops; pc++) {
+		struct script_op *op = &s.ops[pc];
+		int slot = op->slot == -1 ? cur : op->slot;
+		/* Per-operation output would distort what TIME measures */
+		int quiet = timer.label != NULL;
+		double start = quiet ? get_time() : 0;
+		long val, bytes = 0;
+
+		switch (op->cmd) {
+		case S_MOUNT: {
+			struct fs_mount_opts opts = { .verify = op->verify };
+			if (op->verify == FS_VERIFY_SAMPLED)
+				opts.sample_rate = script_eval(&op->val);
+			if (mount_local(diskname, &opts))
 				die("Cannot mount disk");
-			else {
+			mounted = 1;
+			if (!quiet)
 				printf("MOUNT successful.\n");
-				mounted = 1;
-			}
+			break;
+		}
 
-		} else if (strcmp(command, "UMOUNT") == 0) {
+		case S_UMOUNT:
 			if (mounted && fs_umount())
 				die("Cannot unmount");
-			else {
+			mounted = 0;
+			if (!quiet)
 				printf("UMOUNT successful.\n");
-				mounted = 0;
-			}
-
-		} else if (strcmp(command, "CREATE") == 0) {
-			fs_filename = command_args[1];
+			break;
 
-			if(fs_create(fs_filename)) {
+		case S_CREATE:
+			if (fs_create(op->name)) {
 				fs_umount();
 				die("Cannot create file");
 			}
+			if (!quiet)
+				printf("CREATE successful.\n");
+			break;
 
-			printf("CREATE successful.\n");
-
-		} else if (strcmp(command, "DELETE") == 0) {
-			fs_filename = command_args[1];
-
-			if(fs_delete(fs_filename)) {
+		case S_DELETE:
+			if (fs_delete(op->name)) {
 				fs_umount();
 				die("Cannot delete file");
 			}
+			if (!quiet)
+				printf("DELETE successful.\n");
+			break;
 
-			printf("DELETE successful.\n");
-
-		} else if (strcmp(command, "OPEN") == 0) {
-			fs_filename = command_args[1];
-
-			fs_fd = fs_open(fs_filename);
-
-			if (fs_fd < 0) {
+		case S_OPEN:
+			fds[slot] = fs_open(op->name);
+			if (fds[slot] < 0) {
 				fs_umount();
 				die("Cannot open file");
 			}
+			cur = slot;
+			if (!quiet)
+				printf("OPEN successful.\n");
+			break;
 
-			printf("OPEN successful.\n");
-
-		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
+		case S_CLOSE:
+			if (fs_close(fds[slot])) {
 				fs_umount();
 				die("Cannot close file");
 			}
+			fds[slot] = -1;
+			if (!quiet)
+				printf("CLOSE successful.\n");
+			break;
 
-			printf("CLOSE successful.\n");
-
-		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+		case S_USE:
+			cur = slot;
+			continue;
 
-			if (fs_lseek(fs_fd, offset)) {
+		case S_SEEK:
+			if (fs_lseek(fds[slot], script_eval(&op->val))) {
 				fs_umount();
 				die("Cannot seek to position");
-			} else {
-				printf("SEEK successful.\n");
 			}
+			if (!quiet)
+				printf("SEEK successful.\n");
+			break;
 
-		} else if (strcmp(command, "WRITE") == 0) {
-			data_source = command_args[1];
-			data_description = command_args[2];
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-				data_size = st.st_size;
-				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
-			} else {
-				data = NULL;
-				data_size = 0;
+		case S_TRUNCATE:
+			if (fs_truncate(fds[slot], script_eval(&op->val))) {
+				fs_umount();
+				die("Cannot truncate file");
 			}
+			if (!quiet)
+				printf("TRUNCATE successful.\n");
+			break;
 
-			if (!data) {
+		case S_FALLOCATE:
+			if (fs_fallocate(fds[slot], script_eval(&op->val))) {
 				fs_umount();
-				die_perror("Could not find data to write");
+				die("Cannot allocate space");
 			}
+			if (!quiet)
+				printf("FALLOCATE successful.\n");
+			break;
 
-			count = fs_write(fs_fd, data, data_size);
+		case S_WRITE:
+			if (op->data)
+				count = fs_write(fds[slot], op->data, op->data_size);
+			else
+				count = fs_write(fds[slot], write_buf,
+						 script_eval(&op->val));
 			if (count < 0) {
 				fs_umount();
 				die("write error");
 			}
-			printf("Wrote %d bytes to file.\n", count);
-
-		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
-			data_source = command_args[2];
-			data_description = command_args[3];
-
-			char file_loaded = 0;
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-
-				FILE *data_file = fopen(data_description, "r");
-				data_size = st.st_size;
-				data = calloc(data_size+1, sizeof(char));
-				size_t n = fread (data, sizeof(char), data_size, data_file);
-				assert(n == sizeof(char) * data_size);
-				fclose(data_file);
-				file_loaded = 1;
-			} else {
-				fs_umount();
-				die("Invalid data description");
-			}
-
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
-			}
-
-			if (read_req_length < 0) {
-				fs_umount();
-				die("invalid data read length");
-			}
-
-			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+			bytes = count;
+			if (!quiet)
+				printf("Wrote %d bytes to file.\n", count);
+			break;
 
+		case S_READ:
+			val = script_eval(&op->val);
+			/* Zeroed so that the canary after the data can be checked */
+			if (op->data)
+				memset(read_buf, 0, MAX((size_t)val, op->data_size) + 1);
+			count = fs_read(fds[slot], read_buf, val);
 			if (count < 0) {
 				fs_umount();
 				die("read error");
 			}
+			bytes = count;
 
-			// both data and read_buf were allocated with an extra zero byte
+			// both data and read_buf hold an extra zero byte
 			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+			if (!op->data)
+				break;
+			if (memcmp(op->data, read_buf, op->data_size + 1) == 0) {
+				if (!quiet)
+					printf("Read %d bytes from file. Compared %zu correct.\n",
+					       count, op->data_size);
+			} else {
+				printf("Read unexpected data! %s read vs given %s\n",
+				       read_buf, op->data);
+			}
+			break;
+
+		case S_REPEAT:
+			remaining[pc] = script_eval(&op->val);
+			if (remaining[pc] <= 0)
+				pc = op->jump;
+			continue;
+
+		case S_END:
+			if (--remaining[op->jump] > 0)
+				pc = op->jump;
+			continue;
+
+		case S_TIME:
+			timer.label = op->name;
+			timer.bytes = 0;
+			timer.num_lat = 0;
+			timer.start = get_time();
+			continue;
+
+		case S_REPORT:
+			script_report(&timer);
+			continue;
+
+		case S_SEED:
+			script_rand_state = script_eval(&op->val) | 1;
+			continue;
+		}
 
-			free(read_buf);
-			if(file_loaded){
-				free(data);
+		if (quiet) {
+			if (timer.num_lat == timer.max_lat) {
+				timer.max_lat = timer.max_lat ? 2 * timer.max_lat : 1024;
+				timer.lat = realloc(timer.lat,
+						    timer.max_lat * sizeof(*timer.lat));
+				if (!timer.lat)
+					die_perror("realloc");
 			}
+			timer.lat[timer.num_lat++] = (get_time() - start) * 1e9;
+			timer.bytes += bytes;
 		}
 	}
 
@@ -266,7 +629,57 @@ void thread_fs_script(void *arg)
 	if (mounted && fs_umount())
 		die("Cannot unmount diskname");
 
-	fclose(fd_script);
+	free(timer.lat);
+	free(remaining);
+	free(write_buf);
+	free(read_buf);
+	script_free(&s);
+}
+
+/* Hand the command to the fsd.x daemon serving @diskname, if one is running,
+ and print its response as the local command would. Return 0 when no daemon
+ answers, the caller then mounts the disk itself. */
+static int fsd_request(const char *diskname, enum fsd_op op, const char *name,
+		       const void *data, size_t data_len)
+{
+	struct sockaddr_un addr;
+	struct fsd_req req = { FSD_MAGIC, op, 0, 0, data_len };
+	struct fsd_resp resp;
+	char *out;
+	int sock;
+
+	if (name && strlen(name) > UINT8_MAX)
+		return 0;
+	req.name_len = name ? strlen(name) : 0;
+
+	if (fsd_addr(diskname, &addr) || access(addr.sun_path, F_OK))
+		return 0;
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return 0;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(sock);
+		return 0;
+	}
+
+	if (fsd_xfer(sock, &req, sizeof(req), 1) ||
+	    fsd_xfer(sock, (void *)name, req.name_len, 1) ||
+	    fsd_xfer(sock, (void *)data, data_len, 1) ||
+	    fsd_xfer(sock, &resp, sizeof(resp), 0))
+		die("Lost connection to fsd.x");
+	out = malloc(resp.len + 1);
+	if (!out || fsd_xfer(sock, out, resp.len, 0))
+		die("Lost connection to fsd.x");
+	close(sock);
+
+	if (resp.status) {
+		out[resp.len] = '\0';
+		die("%s", out);
+	}
+	fwrite(out, 1, resp.len, stdout);
+	fflush(stdout);
+	free(out);
+	return 1;
 }
 
 void thread_fs_stat(void *arg)
@@ -274,7 +687,7 @@ void thread_fs_stat(void *arg)
 	struct thread_arg *t_arg = arg;
 	char *diskname, *filename;
 	int fs_fd;
-	int stat;
+	int stat, alloc;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -282,7 +695,10 @@ void thread_fs_stat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fsd_request(diskname, FSD_STAT, filename, NULL, 0))
+		return;
+
+	if (mount_local(diskname, NULL))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -305,6 +721,8 @@ void thread_fs_stat(void *arg)
 		return;
 	}
 
+	alloc = fs_stat_alloc(fs_fd);
+
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
@@ -314,6 +732,7 @@ void thread_fs_stat(void *arg)
 		die("cannot unmount diskname");
 
 	printf("Size of file '%s' is %d bytes\n", filename, stat);
+	printf("Allocated size of file '%s' is %d bytes\n", filename, alloc);
 }
 
 void thread_fs_cat(void *arg)
@@ -329,7 +748,10 @@ void thread_fs_cat(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fsd_request(diskname, FSD_CAT, filename, NULL, 0))
+		return;
+
+	if (mount_local(diskname, NULL))
 		die("Cannot mount diskname");
 
 	fs_fd = fs_open(filename);
@@ -384,7 +806,10 @@ void thread_fs_rm(void *arg)
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
 
-	if (fs_mount(diskname))
+	if (fsd_request(diskname, FSD_RM, filename, NULL, 0))
+		return;
+
+	if (mount_local(diskname, NULL))
 		die("Cannot mount diskname");
 
 	if (fs_delete(filename)) {
@@ -398,6 +823,33 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_cp(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <src> <dst>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (mount_local(diskname, NULL))
+		die("Cannot mount diskname");
+
+	/* The copy shares the blocks of the source, only metadata is written */
+	if (fs_copy(src, dst)) {
+		fs_umount();
+		die("Cannot copy file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Copied file '%s' to '%s'\n", src, dst);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -426,11 +878,17 @@ void thread_fs_add(void *arg)
 	if (!buf)
 		die_perror("mmap");
 
+	if (fsd_request(diskname, FSD_ADD, filename, buf, st.st_size)) {
+		munmap(buf, st.st_size);
+		close(fd);
+		return;
+	}
+
 	/* Now, deal with our filesystem:
 	 * - mount, create a new file, copy content of host file into this new
 	 *   file, close the new file, and umount
 	 */
-	if (fs_mount(diskname))
+	if (mount_local(diskname, NULL))
 		die("Cannot mount diskname");
 
 	if (fs_create(filename)) {
@@ -461,6 +919,119 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+void thread_fs_add_dir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname, *buf;
+	const char *names[FS_FILE_MAX_COUNT];
+	char path[PATH_MAX];
+	size_t num_files = 0, total = 0;
+	struct dirent *entry;
+	struct stat st;
+	DIR *dir;
+	int fd, fs_fd, written;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	dir = opendir(dirname);
+	if (!dir)
+		die_perror("opendir");
+
+	/* Regular files whose name fits in the root directory */
+	while ((entry = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+		if (stat(path, &st) || !S_ISREG(st.st_mode))
+			continue;
+		if (strlen(entry->d_name) >= FS_FILENAME_LEN) {
+			test_fs_error("skipping '%s', name too long", entry->d_name);
+			continue;
+		}
+		if (num_files == FS_FILE_MAX_COUNT)
+			die("More than %d files in %s", FS_FILE_MAX_COUNT, dirname);
+		names[num_files] = strdup(entry->d_name);
+		if (!names[num_files])
+			die_perror("strdup");
+		num_files++;
+	}
+	closedir(dir);
+
+	/* One mount, one batch for the directory, one metadata flush */
+	if (mount_local(diskname, NULL))
+		die("Cannot mount diskname");
+
+	if (fs_create_many(names, num_files)) {
+		fs_umount();
+		die("Cannot create files");
+	}
+
+	for (size_t i = 0; i < num_files; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dirname, names[i]);
+		fd = open(path, O_RDONLY);
+		if (fd < 0 || fstat(fd, &st))
+			die_perror("open");
+
+		fs_fd = fs_open(names[i]);
+		if (fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
+
+		written = 0;
+		if (st.st_size > 0) {
+			buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (buf == MAP_FAILED)
+				die_perror("mmap");
+			written = fs_write(fs_fd, buf, st.st_size);
+			munmap(buf, st.st_size);
+		}
+		close(fd);
+
+		if (fs_close(fs_fd)) {
+			fs_umount();
+			die("Cannot close file");
+		}
+		if (written < st.st_size)
+			test_fs_error("short write for '%s' (%d/%zu bytes)",
+				      names[i], written, st.st_size);
+		total += written;
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Wrote %zu files (%zu bytes)\n", num_files, total);
+	for (size_t i = 0; i < num_files; i++)
+		free((char *)names[i]);
+}
+
+void thread_fs_rm_many(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <filename>...");
+
+	diskname = t_arg->argv[0];
+
+	if (mount_local(diskname, NULL))
+		die("Cannot mount diskname");
+
+	if (fs_delete_many((const char **)&t_arg->argv[1], t_arg->argc - 1)) {
+		fs_umount();
+		die("Cannot delete files");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed %d files\n", t_arg->argc - 1);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -471,7 +1042,10 @@ void thread_fs_ls(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fsd_request(diskname, FSD_LS, NULL, NULL, 0))
+		return;
+
+	if (mount_local(diskname, NULL))
 		die("Cannot mount diskname");
 
 	fs_ls();
@@ -490,7 +1064,10 @@ void thread_fs_info(void *arg)
 
 	diskname = t_arg->argv[0];
 
-	if (fs_mount(diskname))
+	if (fsd_request(diskname, FSD_INFO, NULL, NULL, 0))
+		return;
+
+	if (mount_local(diskname, NULL))
 		die("Cannot mount diskname");
 
 	fs_info();
@@ -499,12 +1076,951 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
-size_t get_argv(char *argv)
+/* Read the whole file @filename @rounds times with verification mode @verify
+ and return the throughput in MB/s */
+static double csum_bench_read(char *diskname, char *filename,
+			      enum fs_verify verify, int rounds)
 {
-	long int ret = strtol(argv, NULL, 0);
-	if (ret == LONG_MIN || ret == LONG_MAX)
-		die_perror("strtol");
-	return (size_t)ret;
+	struct fs_mount_opts opts = { .verify = verify };
+	int fs_fd, stat;
+	char *buf;
+	double start, elapsed;
+
+	if (mount_local(diskname, &opts))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	stat = fs_stat(fs_fd);
+	buf = malloc(stat);
+	if (!buf)
+		die_perror("malloc");
+
+	start = get_time();
+	for (int i = 0; i < rounds; i++) {
+		fs_lseek(fs_fd, 0);
+		if (fs_read(fs_fd, buf, stat) != stat) {
+			fs_umount();
+			die("read error");
+		}
+	}
+	elapsed = get_time() - start;
+
+	free(buf);
+	fs_close(fs_fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return (double)stat * rounds / elapsed / 1e6;
+}
+
+void thread_fs_csum_bench(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *buf;
+	struct fs_mount_opts opts = { .csum = 1 };
+	int fd, fs_fd, rounds;
+	struct stat st;
+	const size_t kernel_len = 1 << 20;
+	const int kernel_rounds = 256;
+	double start, hw, sw, never, always;
+	uint32_t crc = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	/* Raw checksum kernel throughput */
+	buf = malloc(kernel_len);
+	if (!buf)
+		die_perror("malloc");
+	memset(buf, 0xA5, kernel_len);
+	start = get_time();
+	for (int i = 0; i < kernel_rounds; i++)
+		crc = crc32c(crc, buf, kernel_len);
+	hw = kernel_len * kernel_rounds / (get_time() - start) / 1e6;
+	start = get_time();
+	for (int i = 0; i < kernel_rounds; i++)
+		crc = crc32c_sw(crc, buf, kernel_len);
+	sw = kernel_len * kernel_rounds / (get_time() - start) / 1e6;
+	free(buf);
+
+	/* Copy the host file in, with the checksum table enabled */
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		die("Not a non-empty regular file: %s\n", filename);
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die_perror("mmap");
+
+	if (mount_local(diskname, &opts))
+		die("Cannot mount diskname");
+	if (fs_create(filename)) {
+		fs_umount();
+		die("Cannot create file");
+	}
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+	if (fs_write(fs_fd, buf, st.st_size) != st.st_size) {
+		fs_umount();
+		die("Cannot write whole file");
+	}
+	fs_close(fs_fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	munmap(buf, st.st_size);
+	close(fd);
+
+	/* About 256 MB of reads per mode */
+	rounds = MAX(1, (256 << 20) / st.st_size);
+	never = csum_bench_read(diskname, filename, FS_VERIFY_NEVER, rounds);
+	always = csum_bench_read(diskname, filename, FS_VERIFY_ALWAYS, rounds);
+
+	printf("crc32c_hw=%s\n", crc32c_hw_available() ? "yes" : "no");
+	printf("crc32c_MBps=%.1f\n", hw);
+	printf("crc32c_sw_MBps=%.1f\n", sw);
+	printf("read_verify_never_MBps=%.1f\n", never);
+	printf("read_verify_always_MBps=%.1f\n", always);
+	printf("verify_overhead_pct=%.2f\n", (never - always) / never * 100);
+}
+
+static void defrag_sigint(int signum)
+{
+	(void)signum;
+	fs_defrag_cancel();
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int moved;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (mount_local(diskname, NULL))
+		die("Cannot mount diskname");
+
+	printf("Before:\n");
+	fs_frag_report();
+
+	/* Ctrl-C stops after the file being moved, the disk stays consistent */
+	signal(SIGINT, defrag_sigint);
+	moved = fs_defrag_all();
+	signal(SIGINT, SIG_DFL);
+	if (moved < 0) {
+		fs_umount();
+		die("Cannot defragment");
+	}
+
+	printf("After:\n");
+	fs_frag_report();
+	printf("Moved %d files\n", moved);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_stats stats;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
+
+	/* Count what the script does and nothing else */
+	fs_stats_reset();
+	thread_fs_script(arg);
+	if (fs_stats(&stats))
+		die("Library built without FS_STATS");
+
+	printf("FS Stats:\n");
+	printf("block_reads=%llu\n", (unsigned long long)stats.block_reads);
+	printf("block_writes=%llu\n", (unsigned long long)stats.block_writes);
+	printf("rmw=%llu\n", (unsigned long long)stats.rmw);
+	printf("fat_walk_steps=%llu\n", (unsigned long long)stats.fat_walk_steps);
+	printf("cow_copies=%llu\n", (unsigned long long)stats.cow_copies);
+	printf("flushes=%llu\n", (unsigned long long)stats.flush.calls);
+	printf("sync_shared=%llu\n", (unsigned long long)stats.sync_shared);
+	for (int i = 0; i < FS_OP_COUNT; i++) {
+		struct fs_op_stats *op = &stats.ops[i];
+		if (op->calls == 0)
+			continue;
+		printf("op=%s calls=%llu bytes=%llu avg_ns=%llu p50_ns=%llu "
+		       "p99_ns=%llu p999_ns=%llu\n", fs_stats_op_name(i),
+		       (unsigned long long)op->calls,
+		       (unsigned long long)op->bytes,
+		       (unsigned long long)(op->total_ns / op->calls),
+		       (unsigned long long)fs_stats_percentile(op, 50),
+		       (unsigned long long)fs_stats_percentile(op, 99),
+		       (unsigned long long)fs_stats_percentile(op, 99.9));
+	}
+}
+
+/* Records kept by the trace command, older ones are overwritten */
+#define TRACE_CAPACITY (1 << 20)
+
+void thread_fs_trace(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <script filename> <trace filename>");
+
+	if (block_trace_start(t_arg->argv[2], TRACE_CAPACITY))
+		die("Cannot start trace");
+	thread_fs_script(arg);
+	block_trace_stop();
+}
+
+void thread_fs_replay(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct stat st;
+	struct block_trace_header *hdr;
+	struct block_trace_rec *recs;
+	uint64_t *lat, num_recs, num_lat = 0, first, skipped = 0, writes_left = 0;
+	uint64_t blocks[2] = { 0 }, per_origin[FS_OP_COUNT + 1] = { 0 };
+	size_t max_count = 1;
+	char *buf;
+	int fd, fast = 0, write = 0;
+	double start, elapsed;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <trace filename> [fast] [write]\n"
+		    "\twrite: also replay the writes, which overwrite the image "
+		    "(metadata included) with dummy data, use a scratch copy");
+	for (int i = 2; i < t_arg->argc; i++) {
+		if (!strcmp(t_arg->argv[i], "fast"))
+			fast = 1;
+		else if (!strcmp(t_arg->argv[i], "write"))
+			write = 1;
+		else
+			die("Unknown replay option '%s'", t_arg->argv[i]);
+	}
+
+	fd = open(t_arg->argv[1], O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if ((size_t)st.st_size < sizeof(*hdr))
+		die("Trace file too short");
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (hdr == MAP_FAILED)
+		die_perror("mmap");
+	close(fd);
+
+	if (memcmp(hdr->magic, BLOCK_TRACE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->block_size < BLOCK_SIZE || hdr->block_size > BLOCK_SIZE_MAX ||
+	    hdr->capacity == 0 ||
+	    sizeof(*hdr) + hdr->capacity * sizeof(*recs) > (size_t)st.st_size)
+		die("Invalid trace file");
+	recs = (struct block_trace_rec *)(hdr + 1);
+
+	/* Oldest record first when the ring has wrapped */
+	num_recs = hdr->head < hdr->capacity ? hdr->head : hdr->capacity;
+	first = hdr->head - num_recs;
+	for (uint64_t i = 0; i < num_recs; i++)
+		max_count = MAX(max_count, recs[(first + i) % hdr->capacity].count);
+
+	/* Writes carry dummy data, they are only replayed when asked to */
+	buf = calloc(max_count, hdr->block_size);
+	lat = calloc(num_recs + 1, sizeof(*lat));
+	if (!buf || !lat)
+		die_perror("calloc");
+	memset(buf, 0xa5, max_count * hdr->block_size);
+
+	check_local(t_arg->argv[0]);
+	if (write)
+		fprintf(stderr, "Warning: replaying writes over '%s'\n",
+			t_arg->argv[0]);
+	if (block_disk_open(t_arg->argv[0]) ||
+	    block_disk_set_block_size(hdr->block_size))
+		die("Cannot open diskname");
+
+	start = get_time();
+	for (uint64_t i = 0; i < num_recs; i++) {
+		struct block_trace_rec *rec = &recs[(first + i) % hdr->capacity];
+		double t;
+
+		if (rec->op == BLOCK_TRACE_WRITE && !write) {
+			writes_left++;
+			continue;
+		}
+
+		/* At original speed, wait until the transfer was issued */
+		if (!fast) {
+			double due = (rec->ns - recs[first % hdr->capacity].ns) / 1e9;
+			while ((t = get_time() - start) < due) {
+				struct timespec ts = { 0, (long)((due - t) * 1e9) };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		t = get_time();
+		int ret = rec->op == BLOCK_TRACE_WRITE
+			? block_write_range(rec->block, rec->count, buf)
+			: block_read_range(rec->block, rec->count, buf);
+		lat[num_lat++] = (get_time() - t) * 1e9;
+		if (ret) {
+			skipped++;
+			continue;
+		}
+		blocks[rec->op == BLOCK_TRACE_WRITE] += rec->count;
+		per_origin[rec->origin < FS_OP_COUNT ? rec->origin : FS_OP_COUNT]++;
+	}
+	elapsed = get_time() - start;
+	block_disk_close();
+
+	qsort(lat, num_lat, sizeof(*lat), cmp_u64);
+	printf("FS Replay:\n");
+	printf("mode=%s\n", fast ? "fast" : "original");
+	printf("records=%llu\n", (unsigned long long)num_recs);
+	printf("skipped=%llu\n", (unsigned long long)skipped);
+	printf("writes_not_replayed=%llu\n", (unsigned long long)writes_left);
+	printf("blocks_read=%llu\n", (unsigned long long)blocks[0]);
+	printf("blocks_written=%llu\n", (unsigned long long)blocks[1]);
+	printf("elapsed_s=%.6f\n", elapsed);
+	printf("MBps=%.1f\n", elapsed > 0 ?
+	       (blocks[0] + blocks[1]) * (double)hdr->block_size / elapsed / 1e6 : 0);
+	printf("p50_ns=%llu\n", (unsigned long long)lat[num_lat / 2]);
+	printf("p99_ns=%llu\n", (unsigned long long)lat[num_lat * 99 / 100]);
+	printf("max_ns=%llu\n",
+	       (unsigned long long)(num_lat ? lat[num_lat - 1] : 0));
+	for (int i = 0; i <= FS_OP_COUNT; i++) {
+		if (per_origin[i])
+			printf("origin=%s records=%llu\n",
+			       i < FS_OP_COUNT ? fs_stats_op_name(i) : "none",
+			       (unsigned long long)per_origin[i]);
+	}
+
+	free(lat);
+	free(buf);
+	munmap(hdr, st.st_size);
+}
+
+/*
+ * Import/export pipeline: host-side reads, writes and checksums run on a
+ * pool of workers while the calling thread, the only one using the library,
+ * feeds or drains a bounded queue of whole files.
+ */
+struct xfer_item {
+	int index;
+	char *buf;
+	size_t size;
+};
+
+struct xfer_queue {
+	struct xfer_item *items;
+	int cap, head, count, closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+};
+
+struct xfer {
+	struct xfer_queue queue;
+	char *dirname;
+	char (*names)[FS_FILENAME_LEN];
+	size_t *sizes;
+	uint32_t *crcs;
+	int num_files;
+	/* Next file for the import readers */
+	int next;
+};
+
+static void xfer_queue_init(struct xfer_queue *q, int cap)
+{
+	q->items = calloc(cap, sizeof(*q->items));
+	if (!q->items)
+		die_perror("calloc");
+	q->cap = cap;
+	q->head = q->count = q->closed = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+}
+
+static void xfer_queue_push(struct xfer_queue *q, struct xfer_item *item)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->cap)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	q->items[(q->head + q->count++) % q->cap] = *item;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Return 0 once the queue is closed and drained */
+static int xfer_queue_pop(struct xfer_queue *q, struct xfer_item *item)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	if (q->count == 0) {
+		pthread_mutex_unlock(&q->lock);
+		return 0;
+	}
+	*item = q->items[q->head];
+	q->head = (q->head + 1) % q->cap;
+	q->count--;
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+	return 1;
+}
+
+static void xfer_queue_close(struct xfer_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void xfer_queue_destroy(struct xfer_queue *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+	free(q->items);
+}
+
+/* Read whole host files and checksum them */
+static void *import_worker(void *arg)
+{
+	struct xfer *x = arg;
+	char path[PATH_MAX];
+	int index;
+
+	while ((index = __atomic_fetch_add(&x->next, 1, __ATOMIC_RELAXED))
+	       < x->num_files) {
+		struct xfer_item item = { index, NULL, x->sizes[index] };
+		size_t done = 0;
+		int fd;
+
+		snprintf(path, sizeof(path), "%s/%s", x->dirname, x->names[index]);
+		fd = open(path, O_RDONLY);
+		item.buf = malloc(item.size ? item.size : 1);
+		if (fd < 0 || !item.buf)
+			die_perror(path);
+		while (done < item.size) {
+			ssize_t ret = pread(fd, item.buf + done, item.size - done, done);
+			if (ret <= 0)
+				die_perror("pread");
+			done += ret;
+		}
+		close(fd);
+
+		x->crcs[index] = crc32c(0, item.buf, item.size);
+		xfer_queue_push(&x->queue, &item);
+	}
+	return NULL;
+}
+
+/* Checksum whole files and write them out on the host */
+static void *export_worker(void *arg)
+{
+	struct xfer *x = arg;
+	struct xfer_item item;
+	char path[PATH_MAX];
+
+	while (xfer_queue_pop(&x->queue, &item)) {
+		size_t done = 0;
+		int fd;
+
+		x->crcs[item.index] = crc32c(0, item.buf, item.size);
+		snprintf(path, sizeof(path), "%s/%s", x->dirname,
+			 x->names[item.index]);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die_perror(path);
+		while (done < item.size) {
+			ssize_t ret = pwrite(fd, item.buf + done, item.size - done, done);
+			if (ret <= 0)
+				die_perror("pwrite");
+			done += ret;
+		}
+		close(fd);
+		free(item.buf);
+	}
+	return NULL;
+}
+
+static int xfer_threads(struct thread_arg *t_arg)
+{
+	long n = t_arg->argc > 2 ? atoi(t_arg->argv[2])
+				 : sysconf(_SC_NPROCESSORS_ONLN);
+	return n < 1 ? 1 : n > 64 ? 64 : n;
+}
+
+static void xfer_report(struct xfer *x, const char *what, double elapsed)
+{
+	size_t total = 0;
+
+	/* Same manifest on both sides, so a round trip can be diffed */
+	for (int i = 0; i < x->num_files; i++) {
+		printf("%s %zu %08x\n", x->names[i], x->sizes[i], x->crcs[i]);
+		total += x->sizes[i];
+	}
+	printf("%s %d files (%zu bytes) in %.3fs, %.1f MB/s\n", what,
+	       x->num_files, total, elapsed, total / elapsed / 1e6);
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char names[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+	size_t sizes[FS_FILE_MAX_COUNT];
+	uint32_t crcs[FS_FILE_MAX_COUNT];
+	const char *create[FS_FILE_MAX_COUNT];
+	pthread_t threads[64];
+	struct xfer x = { .names = names, .sizes = sizes, .crcs = crcs };
+	struct xfer_item item;
+	char path[PATH_MAX];
+	struct dirent *entry;
+	struct stat st;
+	int num_threads, fs_fd;
+	double start;
+	DIR *dir;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory> [threads]");
+
+	x.dirname = t_arg->argv[1];
+	num_threads = xfer_threads(t_arg);
+
+	dir = opendir(x.dirname);
+	if (!dir)
+		die_perror("opendir");
+	while ((entry = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", x.dirname, entry->d_name);
+		if (stat(path, &st) || !S_ISREG(st.st_mode))
+			continue;
+		if (strlen(entry->d_name) >= FS_FILENAME_LEN) {
+			test_fs_error("skipping '%s', name too long", entry->d_name);
+			continue;
+		}
+		if (x.num_files == FS_FILE_MAX_COUNT)
+			die("More than %d files in %s", FS_FILE_MAX_COUNT, x.dirname);
+		strcpy(names[x.num_files], entry->d_name);
+		create[x.num_files] = names[x.num_files];
+		sizes[x.num_files++] = st.st_size;
+	}
+	closedir(dir);
+
+	start = get_time();
+	if (mount_local(t_arg->argv[0], NULL))
+		die("Cannot mount diskname");
+
+	/* Plan the allocation before any data moves: each file reserves its
+	 * blocks in one go, so it lands in a contiguous run whatever order the
+	 * workers deliver the files in */
+	if (fs_create_many(create, x.num_files)) {
+		fs_umount();
+		die("Cannot create files");
+	}
+	for (int i = 0; i < x.num_files; i++) {
+		fs_fd = fs_open(names[i]);
+		if (fs_fd < 0 || fs_fallocate(fs_fd, sizes[i]) || fs_close(fs_fd)) {
+			fs_umount();
+			die("Cannot allocate '%s'", names[i]);
+		}
+	}
+
+	xfer_queue_init(&x.queue, 2 * num_threads);
+	for (int i = 0; i < num_threads; i++)
+		pthread_create(&threads[i], NULL, import_worker, &x);
+
+	for (int i = 0; i < x.num_files; i++) {
+		xfer_queue_pop(&x.queue, &item);
+		fs_fd = fs_open(names[item.index]);
+		if (fs_fd < 0 ||
+		    fs_write(fs_fd, item.buf, item.size) != (int)item.size) {
+			fs_umount();
+			die("Cannot write '%s'", names[item.index]);
+		}
+		fs_close(fs_fd);
+		free(item.buf);
+	}
+
+	for (int i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	xfer_queue_destroy(&x.queue);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	xfer_report(&x, "Imported", get_time() - start);
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char names[FS_FILE_MAX_COUNT][FS_FILENAME_LEN];
+	size_t sizes[FS_FILE_MAX_COUNT];
+	uint32_t crcs[FS_FILE_MAX_COUNT];
+	pthread_t threads[64];
+	struct xfer x = { .names = names, .sizes = sizes, .crcs = crcs };
+	int num_threads, fs_fd;
+	double start;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory> [threads]");
+
+	x.dirname = t_arg->argv[1];
+	num_threads = xfer_threads(t_arg);
+	if (mkdir(x.dirname, 0755) && errno != EEXIST)
+		die_perror("mkdir");
+
+	start = get_time();
+	if (mount_local(t_arg->argv[0], NULL))
+		die("Cannot mount diskname");
+	x.num_files = fs_list(names, FS_FILE_MAX_COUNT);
+
+	xfer_queue_init(&x.queue, 2 * num_threads);
+	for (int i = 0; i < num_threads; i++)
+		pthread_create(&threads[i], NULL, export_worker, &x);
+
+	/* Only this thread reads from the file system */
+	for (int i = 0; i < x.num_files; i++) {
+		struct xfer_item item = { i, NULL, 0 };
+		int size;
+
+		fs_fd = fs_open(names[i]);
+		if (fs_fd < 0 || (size = fs_stat(fs_fd)) < 0) {
+			fs_umount();
+			die("Cannot open '%s'", names[i]);
+		}
+		item.size = sizes[i] = size;
+		item.buf = malloc(size ? size : 1);
+		if (!item.buf)
+			die_perror("malloc");
+		if (fs_read(fs_fd, item.buf, size) != size) {
+			fs_umount();
+			die("Cannot read '%s'", names[i]);
+		}
+		fs_close(fs_fd);
+		xfer_queue_push(&x.queue, &item);
+	}
+	xfer_queue_close(&x.queue);
+
+	for (int i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	xfer_queue_destroy(&x.queue);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	xfer_report(&x, "Exported", get_time() - start);
+}
+
+size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret == LONG_MIN || ret == LONG_MAX)
+		die_perror("strtol");
+	return (size_t)ret;
+}
+
+/* Bytes read back by the completion callbacks of thread_fs_aio() */
+static size_t aio_read_bytes;
+
+static void aio_read_done(int fd, int result, void *arg)
+{
+	(void)fd;
+	(void)arg;
+	if (result > 0)
+		__atomic_fetch_add(&aio_read_bytes, result, __ATOMIC_RELAXED);
+}
+
+void thread_fs_aio(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_aio_event events[64];
+	struct stat st;
+	char name[FS_FILENAME_LEN];
+	int num_files = 4, fs_fd[16], extra_fd[300];
+	size_t num_reqs = 0, written = 0, correct = 0;
+	char *buf, *out[16];
+	int fd, efd;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [files]");
+	if (t_arg->argc > 2)
+		num_files = get_argv(t_arg->argv[2]);
+	if (num_files < 1 || num_files > 16)
+		die("Between 1 and 16 files");
+
+	fd = open(t_arg->argv[1], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		die_perror("open");
+	if (st.st_size == 0)
+		die("Empty file");
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die_perror("mmap");
+
+	if (mount_local(t_arg->argv[0], NULL))
+		die("Cannot mount diskname");
+	efd = fs_aio_fd();
+	if (efd < 0)
+		die("Cannot start the I/O workers");
+
+	/* Every file gets the whole host file, one block per request; the
+	 requests of a descriptor complete in order, the files in parallel */
+	for (int i = 0; i < num_files; i++) {
+		snprintf(name, sizeof(name), "aio-%d", i);
+		if (fs_create(name) || (fs_fd[i] = fs_open(name)) < 0)
+			die("Cannot create file");
+		for (off_t off = 0; off < st.st_size; off += BLOCK_SIZE) {
+			size_t len = MIN(st.st_size - off, BLOCK_SIZE);
+			if (fs_write_async(fs_fd[i], buf + off, len, NULL, NULL))
+				die("Cannot queue write");
+			num_reqs++;
+		}
+	}
+
+	/* Other descriptors of the files come and go while the writes run */
+	for (int i = 0; i < (int)ARRAY_SIZE(extra_fd); i++) {
+		snprintf(name, sizeof(name), "aio-%d", i % num_files);
+		if ((extra_fd[i] = fs_open(name)) < 0)
+			die("Cannot open file");
+	}
+	for (int i = 0; i < (int)ARRAY_SIZE(extra_fd); i++)
+		fs_close(extra_fd[i]);
+
+	/* Reactor loop: wait for the eventfd, then reap what completed */
+	while (num_reqs) {
+		struct pollfd pfd = { .fd = efd, .events = POLLIN };
+		uint64_t count;
+		int n;
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			die_perror("poll");
+		if (read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			die_perror("read");
+		while ((n = fs_aio_reap(events, ARRAY_SIZE(events))) > 0) {
+			for (int j = 0; j < n; j++)
+				written += MAX(events[j].result, 0);
+			num_reqs -= n;
+		}
+	}
+
+	/* Read every file back in one request, completing through a callback */
+	for (int i = 0; i < num_files; i++) {
+		out[i] = malloc(st.st_size);
+		if (!out[i])
+			die_perror("malloc");
+		fs_lseek(fs_fd[i], 0);
+		if (fs_read_async(fs_fd[i], out[i], st.st_size, aio_read_done, NULL))
+			die("Cannot queue read");
+	}
+	fs_aio_wait();
+
+	for (int i = 0; i < num_files; i++) {
+		for (off_t j = 0; j < st.st_size; j++)
+			correct += out[i][j] == buf[j];
+		free(out[i]);
+		fs_close(fs_fd[i]);
+		snprintf(name, sizeof(name), "aio-%d", i);
+		fs_delete(name);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	munmap(buf, st.st_size);
+	close(fd);
+
+	printf("FS Aio:\n");
+	printf("files=%d\n", num_files);
+	printf("written=%zu\n", written);
+	printf("read=%zu\n", aio_read_bytes);
+	printf("correct=%zu\n", correct);
+}
+
+/* Writers of thread_fs_sync(), each syncing after every block it writes */
+struct sync_writer {
+	pthread_t thread;
+	int fd;
+	int rounds;
+	char *buf;
+	size_t written;
+};
+
+static void *sync_writer_run(void *arg)
+{
+	struct sync_writer *w = arg;
+
+	for (int i = 0; i < w->rounds; i++) {
+		int ret = fs_write(w->fd, w->buf, BLOCK_SIZE);
+		if (ret > 0)
+			w->written += ret;
+		if (fs_sync())
+			die("Cannot sync");
+	}
+	return NULL;
+}
+
+/* Concurrent write + fs_sync() loops on a mount with sync-on-close, then
+ check everything after remounting */
+void thread_fs_sync(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_mount_opts opts = { .durability = FS_DURABLE_CLOSE };
+	struct sync_writer w[16];
+	struct fs_stats stats;
+	char name[FS_FILENAME_LEN];
+	int num_threads = 4, rounds = 20, have_stats;
+	size_t written = 0, correct = 0;
+	char *buf, *out;
+	double start, elapsed;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [threads] [rounds]");
+	if (t_arg->argc > 1)
+		num_threads = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		rounds = get_argv(t_arg->argv[2]);
+	if (num_threads < 1 || num_threads > 16)
+		die("Between 1 and 16 threads");
+
+	buf = malloc(BLOCK_SIZE);
+	out = malloc(BLOCK_SIZE);
+	if (!buf || !out)
+		die_perror("malloc");
+	for (int i = 0; i < BLOCK_SIZE; i++)
+		buf[i] = 'a' + i % 26;
+
+	if (mount_local(t_arg->argv[0], &opts))
+		die("Cannot mount diskname");
+	for (int i = 0; i < num_threads; i++) {
+		snprintf(name, sizeof(name), "sync-%d", i);
+		if (fs_create(name) || (w[i].fd = fs_open(name)) < 0)
+			die("Cannot create file");
+		w[i].rounds = rounds;
+		w[i].buf = buf;
+		w[i].written = 0;
+	}
+
+	fs_stats_reset();
+	start = get_time();
+	for (int i = 0; i < num_threads; i++)
+		pthread_create(&w[i].thread, NULL, sync_writer_run, &w[i]);
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		written += w[i].written;
+		if (fs_close(w[i].fd))
+			die("Cannot close file");
+	}
+	elapsed = get_time() - start;
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	/* The library may be built without counters */
+	have_stats = !fs_stats(&stats);
+
+	if (mount_local(t_arg->argv[0], NULL))
+		die("Cannot mount diskname");
+	for (int i = 0; i < num_threads; i++) {
+		snprintf(name, sizeof(name), "sync-%d", i);
+		int fd = fs_open(name);
+		if (fd < 0)
+			die("Cannot open file");
+		while (fs_read(fd, out, BLOCK_SIZE) == BLOCK_SIZE)
+			correct += memcmp(out, buf, BLOCK_SIZE) ? 0 : BLOCK_SIZE;
+		fs_close(fd);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("FS Sync:\n");
+	printf("threads=%d\n", num_threads);
+	printf("written=%zu\n", written);
+	printf("correct=%zu\n", correct);
+	if (have_stats) {
+		const struct fs_op_stats *f = &stats.flush;
+		printf("syncs=%llu shared=%llu flushes=%llu flushes_per_sec=%.0f "
+		       "flush_p50_ns=%llu flush_p99_ns=%llu\n",
+		       (unsigned long long)stats.ops[FS_OP_SYNC].calls,
+		       (unsigned long long)stats.sync_shared,
+		       (unsigned long long)f->calls,
+		       elapsed > 0 ? f->calls / elapsed : 0,
+		       (unsigned long long)fs_stats_percentile(f, 50),
+		       (unsigned long long)fs_stats_percentile(f, 99));
+	}
+	free(buf);
+	free(out);
+}
+
+/* Write the image to a host file, or to stdout with "-" */
+void thread_fs_dump(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct stat st;
+	double start;
+	int fd;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename or ->");
+	check_local(t_arg->argv[0]);
+
+	fd = strcmp(t_arg->argv[1], "-")
+		? open(t_arg->argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644)
+		: STDOUT_FILENO;
+	if (fd < 0)
+		die_perror("open");
+
+	start = get_time();
+	if (fs_dump(t_arg->argv[0], fd))
+		die("Cannot dump diskname");
+	if (fd == STDOUT_FILENO)
+		return;
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	close(fd);
+
+	printf("FS Dump:\n");
+	printf("bytes=%zu\n", (size_t)st.st_size);
+	printf("secs=%.3f\n", get_time() - start);
+}
+
+/* Rebuild an image from a host file written by dump, or from stdin with "-" */
+void thread_fs_restore(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	double start;
+	int fd;
+
+	if (t_arg->argc < 2)
+		die("Usage: <host filename or -> <diskname>");
+	check_local(t_arg->argv[1]);
+
+	fd = strcmp(t_arg->argv[0], "-") ? open(t_arg->argv[0], O_RDONLY)
+					 : STDIN_FILENO;
+	if (fd < 0)
+		die_perror("open");
+
+	start = get_time();
+	if (fs_restore(fd, t_arg->argv[1]))
+		die("Cannot restore diskname");
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	printf("FS Restore:\n");
+	printf("secs=%.3f\n", get_time() - start);
 }
 
 static struct {
@@ -515,9 +2031,23 @@ static struct {
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
+	{ "cp",		thread_fs_cp },
+	{ "add-dir",	thread_fs_add_dir },
+	{ "rm-many",	thread_fs_rm_many },
+	{ "import",	thread_fs_import },
+	{ "export",	thread_fs_export },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "csum_bench",	thread_fs_csum_bench },
+	{ "defrag",	thread_fs_defrag },
+	{ "stats",	thread_fs_stats },
+	{ "trace",	thread_fs_trace },
+	{ "replay",	thread_fs_replay },
+	{ "aio",	thread_fs_aio },
+	{ "sync",	thread_fs_sync },
+	{ "dump",	thread_fs_dump },
+	{ "restore",	thread_fs_restore }
 };
 
 void usage(char *program)
@@ -527,6 +2057,9 @@ void usage(char *program)
 	fprintf(stderr, "Possible commands are:\n");
 	for (i = 0; i < ARRAY_SIZE(commands); i++)
 		fprintf(stderr, "\t%s\n", commands[i].name);
+	fprintf(stderr, "Warning: 'replay <diskname> <trace> write' overwrites the "
+		"blocks of <diskname> the trace wrote, metadata included, with "
+		"dummy data\n");
 	exit(1);
 }
 
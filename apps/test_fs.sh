@@ -238,6 +238,642 @@ END_SCRIPT
     log "Score: ${score}"
 }
 
+# reserve blocks, write into them, then shrink the file
+truncate_fallocate() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	python3 -c "for i in range(10000): print('a', end='')" > test-file-1
+	python3 -c "for i in range(3000): print('a', end='')" > test-file-2
+    cat <<END_SCRIPT > truncate.script
+MOUNT
+CREATE	test-file-1
+OPEN	test-file-1
+FALLOCATE	20000
+WRITE	FILE	test-file-1
+TRUNCATE	3000
+SEEK	0
+READ	3000	FILE	test-file-2
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs truncate.script
+    local script_out="${STDOUT}"
+    run_test ./test_fs.x info test.fs
+
+	rm -f test.fs test-file-1 test-file-2 truncate.script
+
+	local line_array=()
+	line_array+=("$(select_line "${script_out}" "8")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("Read 3000 bytes from file. Compared 3000 correct.")
+	corr_array+=("fat_free_ratio=98/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# a file spanning several 64 KiB blocks, with unaligned ends
+large_blocks() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x -b 65536 test.fs 100
+	python3 -c "for i in range(200000): print(chr(97 + i % 26), end='')" > test-file-1
+	run_tool ./test_fs.x add test.fs test-file-1
+    cat <<END_SCRIPT > large.script
+MOUNT
+OPEN	test-file-1
+READ	200000	FILE	test-file-1
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_test ./test_fs.x script test.fs large.script
+	local script_out="${STDOUT}"
+	run_test ./test_fs.x stat test.fs test-file-1
+	local stat_out="${STDOUT}"
+	run_test ./fsck.x test.fs
+
+	rm -f test.fs test-file-1 large.script
+
+	local line_array=()
+	line_array+=("$(select_line "${script_out}" "3")")
+	line_array+=("$(select_line "${stat_out}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	local corr_array=()
+	corr_array+=("Read 200000 bytes from file. Compared 200000 correct.")
+	corr_array+=("Allocated size of file 'test-file-1' is 262144 bytes")
+	corr_array+=("test.fs: 1 files, 4 used blocks, 0 errors")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# holes use up the spare FAT entries, then take zeroed data blocks
+sparse_full_fat() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	# 2048 data blocks fill the first FAT block, a second one holds the holes
+	run_tool ./fs_make.x test.fs 2048
+	run_test ./test_fs.x info test.fs
+	local info_out="${STDOUT}"
+	rm -f test.fs
+
+	# 100 data blocks leave 1948 spare entries, the last 10 blocks of the
+	# hole cannot have one
+	run_tool ./fs_make.x test.fs 100
+    cat <<END_SCRIPT > sparse.script
+MOUNT
+CREATE	sparse
+OPEN	sparse
+TRUNCATE	$(( (1948 + 10) * 4096 ))
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_tool ./test_fs.x script test.fs sparse.script
+	run_test ./test_fs.x stat test.fs sparse
+
+	rm -f test.fs sparse.script
+
+	local line_array=()
+	line_array+=("$(select_line "${info_out}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	local corr_array=()
+	corr_array+=("fat_blk_count=2")
+	corr_array+=("Allocated size of file 'sparse' is 40960 bytes")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# a hole the disk cannot hold fails without taking any block
+truncate_nospace() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+    cat <<END_SCRIPT > nospace.script
+MOUNT
+CREATE	big
+OPEN	big
+TRUNCATE	100000000
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_tool ./test_fs.x script test.fs nospace.script
+	run_test ./test_fs.x info test.fs
+	local info_out="${STDOUT}"
+	run_test ./fsck.x test.fs
+
+	rm -f test.fs nospace.script
+
+	local line_array=()
+	line_array+=("$(select_line "${info_out}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	local corr_array=()
+	corr_array+=("fat_free_ratio=99/100")
+	corr_array+=("test.fs: 1 files, 0 used blocks, 0 errors")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# a data block changed behind the file system fails the read that checks it
+csum_verify() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x -c test.fs 100
+	python3 -c "for i in range(10000): print('a', end='')" > test-file-1
+	run_tool ./test_fs.x add test.fs test-file-1
+	# flip a byte in the second block of the file, data blocks start at 3
+	local first=$(./test_fs.x ls test.fs | sed -n 's/.*data_blk: //p')
+	printf 'b' | dd of=test.fs bs=1 seek=$(( (3 + first + 1) * 4096 + 10 )) \
+		conv=notrunc 2>/dev/null
+    cat <<END_SCRIPT > verify.script
+MOUNT	VERIFY
+OPEN	test-file-1
+READ	10000
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_test ./test_fs.x script test.fs verify.script
+	local always_err="${STDERR}"
+	sed -i 's/^MOUNT.*/MOUNT	SAMPLED	1/' verify.script
+	run_test ./test_fs.x script test.fs verify.script
+
+	rm -f test.fs test-file-1 verify.script
+
+	local line_array=()
+	line_array+=("$(select_line "${always_err}" "1")")
+	line_array+=("$(select_line "${always_err}" "2")")
+	line_array+=("$(select_line "${STDERR}" "1")")
+	local corr_array=()
+	corr_array+=("checksum mismatch in data block $(( first + 1 ))")
+	corr_array+=("read error")
+	corr_array+=("checksum mismatch in data block $(( first + 1 ))")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# fsck finds a leaked FAT entry and reclaims it
+fsck_repair() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	python3 -c "for i in range(4096): print('a', end='')" > test-file-1
+	run_tool ./test_fs.x add test.fs test-file-1
+	# mark data block 50 as used without any file owning it
+	printf '\xff\xff' | dd of=test.fs bs=1 seek=$((4096 + 2 * 50)) conv=notrunc 2>/dev/null
+	run_test ./fsck.x -r test.fs
+	local repair_out="${STDOUT}"
+	run_test ./fsck.x test.fs
+
+	rm -f test.fs test-file-1
+
+	local line_array=()
+	line_array+=("$(select_line "${repair_out}" "1")")
+	line_array+=("$(select_line "${repair_out}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	local corr_array=()
+	corr_array+=("fat: 1 entries used by no file")
+	corr_array+=("test.fs: 1 files, 1 used blocks, 1 errors, 1 fixes")
+	corr_array+=("test.fs: 1 files, 1 used blocks, 0 errors")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# two files written a block at a time each, interleaved on disk, then moved
+# to one run each
+defrag_interleaved() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	python3 -c "for i in range(20): print(chr(97 + i) * 4096, end='')" > test-file-a
+	python3 -c "for i in range(20): print(chr(65 + i) * 4096, end='')" > test-file-b
+	echo -e "MOUNT\nCREATE\tfrag-a\nCREATE\tfrag-b" > defrag.script
+	echo -e "OPEN\tfrag-a\tA\nOPEN\tfrag-b\tB" >> defrag.script
+	local i
+	for i in $(seq 0 19); do
+		dd if=test-file-a of=test-blk-a${i} bs=4096 skip=${i} count=1 2>/dev/null
+		dd if=test-file-b of=test-blk-b${i} bs=4096 skip=${i} count=1 2>/dev/null
+		echo -e "USE\tA\nWRITE\tFILE\ttest-blk-a${i}" >> defrag.script
+		echo -e "USE\tB\nWRITE\tFILE\ttest-blk-b${i}" >> defrag.script
+	done
+	echo -e "CLOSE\tA\nCLOSE\tB\nUMOUNT" >> defrag.script
+	./test_fs.x script test.fs defrag.script >/dev/null
+
+	run_test ./test_fs.x defrag test.fs
+	local defrag_out="${STDOUT}"
+    cat <<END_SCRIPT > defrag.script
+MOUNT
+OPEN	frag-a	A
+OPEN	frag-b	B
+USE	A
+READ	81920	FILE	test-file-a
+USE	B
+READ	81920	FILE	test-file-b
+CLOSE	A
+CLOSE	B
+UMOUNT
+END_SCRIPT
+	run_test ./test_fs.x script test.fs defrag.script
+	local script_out="${STDOUT}"
+	run_test ./fsck.x test.fs
+
+	rm -f test.fs test-file-a test-file-b test-blk-* defrag.script
+
+	local line_array=()
+	line_array+=("$(select_line "${defrag_out}" "3")")
+	line_array+=("$(select_line "${defrag_out}" "10")")
+	line_array+=("$(select_line "${defrag_out}" "11")")
+	line_array+=("$(select_line "${script_out}" "4")")
+	line_array+=("$(select_line "${script_out}" "5")")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	local corr_array=()
+	corr_array+=("file: frag-a, blocks: 20, extents: 20, avg_run: 1.0")
+	corr_array+=("total: blocks: 40, extents: 2, avg_run: 20.0")
+	corr_array+=("Moved 2 files")
+	corr_array+=("Read 81920 bytes from file. Compared 81920 correct.")
+	corr_array+=("Read 81920 bytes from file. Compared 81920 correct.")
+	corr_array+=("test.fs: 2 files, 40 used blocks, 0 errors")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# a directory added in one batch, files removed in one batch; a batch with a
+# missing name removes nothing
+add_dir_rm_many() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	rm -rf test-dir && mkdir test-dir
+	local i
+	for i in 1 2 3 4 5; do
+		python3 -c "for j in range(${i} * 3000): print(chr(96 + ${i}), end='')" \
+			> test-dir/file-${i}
+	done
+	run_test ./test_fs.x add-dir test.fs test-dir
+	local add_out="${STDOUT}"
+	run_tool ./test_fs.x rm-many test.fs file-1 file-9
+	run_test ./test_fs.x rm-many test.fs file-1 file-2 file-3
+	local rm_out="${STDOUT}"
+    cat <<END_SCRIPT > rm_many.script
+MOUNT
+OPEN	file-5
+READ	15000	FILE	test-dir/file-5
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_test ./test_fs.x script test.fs rm_many.script
+	local script_out="${STDOUT}"
+	run_test ./fsck.x test.fs
+
+	rm -rf test.fs test-dir rm_many.script
+
+	local line_array=()
+	line_array+=("$(select_line "${add_out}" "1")")
+	line_array+=("$(select_line "${rm_out}" "1")")
+	line_array+=("$(select_line "${script_out}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	local corr_array=()
+	corr_array+=("Wrote 5 files (45000 bytes)")
+	corr_array+=("Removed 3 files")
+	corr_array+=("Read 15000 bytes from file. Compared 15000 correct.")
+	corr_array+=("test.fs: 2 files, 7 used blocks, 0 errors")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# files imported by several workers and exported back by several workers
+# come out the same, with the same manifest on both sides
+import_export() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	rm -rf test-dir test-dir-2 && mkdir test-dir
+	local i
+	for i in 1 2 3 4 5 6; do
+		dd if=/dev/urandom of=test-dir/file-${i} bs=5000 count=${i} 2>/dev/null
+	done
+	run_test ./test_fs.x import test.fs test-dir 3
+	local import_out="${STDOUT}"
+	run_test ./test_fs.x export test.fs test-dir-2 3
+	local export_out="${STDOUT}"
+
+	local manifest="manifests differ"
+	diff <(echo "${import_out}" | sed '$d' | sort) \
+		<(echo "${export_out}" | sed '$d' | sort) >/dev/null &&
+		manifest="manifests match"
+	local files="files differ"
+	diff -r test-dir test-dir-2 >/dev/null && files="files match"
+
+	rm -rf test.fs test-dir test-dir-2
+
+	local line_array=()
+	line_array+=("$(select_line "${export_out}" "7")")
+	line_array+=("${manifest}")
+	line_array+=("${files}")
+	local corr_array=()
+	corr_array+=("Exported 6 files (105000 bytes)")
+	corr_array+=("manifests match")
+	corr_array+=("files match")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# a copy shares the blocks of its source, which outlive the source
+copy_shared() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	python3 -c "for i in range(40000): print('a', end='')" > test-file-1
+	run_tool ./test_fs.x add test.fs test-file-1
+	run_tool ./test_fs.x cp test.fs test-file-1 test-file-2
+	run_test ./test_fs.x info test.fs
+	local info_out="${STDOUT}"
+	run_tool ./test_fs.x rm test.fs test-file-1
+	run_test ./fsck.x test.fs
+
+	rm -f test.fs test-file-1
+
+	local line_array=()
+	line_array+=("$(select_line "${info_out}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	local corr_array=()
+	corr_array+=("fat_free_ratio=88/100")
+	corr_array+=("test.fs: 1 files, 11 used blocks, 0 errors")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# queued writes and reads on several files, completed through the eventfd
+# and through callbacks, with descriptors opened and closed meanwhile
+async_io() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	python3 -c "for i in range(10000): print(chr(97 + i % 26), end='')" > test-file-1
+	run_test ./test_fs.x aio test.fs test-file-1 4
+
+	rm -f test.fs test-file-1
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "5")")
+	local corr_array=()
+	corr_array+=("written=40000")
+	corr_array+=("correct=40000")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# concurrent fs_sync() callers and sync-on-close, checked after remounting
+group_sync() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./test_fs.x sync test.fs 4 20
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	local corr_array=()
+	corr_array+=("written=327680")
+	corr_array+=("correct=327680")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# image striped across three members, blocks read back through the workers
+striped_volume() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x -u 8192 test.fs 100 test-m0 test-m1 test-m2
+	python3 -c "for i in range(10000): print(chr(97 + i % 26), end='')" > test-file-1
+	run_test ./test_fs.x aio test.fs test-file-1 4
+
+	rm -f test.fs test-m0 test-m1 test-m2 test-file-1
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "5")")
+	local corr_array=()
+	corr_array+=("written=40000")
+	corr_array+=("correct=40000")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# dump an image through a pipe into a new one, then read the file back; a
+# dump cut short restores no file system at all
+dump_restore() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	python3 -c "for i in range(10000): print(chr(97 + i % 26), end='')" > test-file-1
+	run_tool ./test_fs.x add test.fs test-file-1
+	./test_fs.x dump test.fs - | ./test_fs.x restore - test2.fs >/dev/null
+    cat <<END_SCRIPT > dump_restore.script
+MOUNT
+OPEN	test-file-1
+READ	10000	FILE	test-file-1
+CLOSE
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test2.fs dump_restore.script
+	local script_out="${STDOUT}"
+
+	./test_fs.x dump test.fs - | head -c 20000 > test.dump
+	./test_fs.x restore test.dump test3.fs >/dev/null 2>&1
+	run_test ./fsck.x test3.fs
+
+	rm -f test.fs test2.fs test3.fs test.dump test-file-1 dump_restore.script
+
+	local line_array=()
+	line_array+=("$(select_line "${script_out}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	local corr_array=()
+	corr_array+=("Read 10000 bytes from file. Compared 10000 correct.")
+	corr_array+=("superblock: invalid signature or geometry")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# loops and named descriptors, unaligned writes spanning blocks
+script_engine() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	python3 -c "for i in range(4096): print('a', end='')" > test-file-1
+    cat <<END_SCRIPT > engine.script
+MOUNT
+CREATE	test-file-1
+OPEN	test-file-1	W
+OPEN	test-file-1	R
+USE	W
+SEEK	5
+REPEAT	3
+WRITE	FILE	test-file-1
+END
+USE	R
+SEEK	4101
+READ	4096	FILE	test-file-1
+CLOSE	W
+CLOSE	R
+UMOUNT
+END_SCRIPT
+    run_test ./test_fs.x script test.fs engine.script
+
+	rm -f test.fs test-file-1 engine.script
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "6")")
+	line_array+=("$(select_line "${STDOUT}" "10")")
+	local corr_array=()
+	corr_array+=("Wrote 4096 bytes to file.")
+	corr_array+=("Read 4096 bytes from file. Compared 4096 correct.")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# more descriptors than one chunk of the table, all on one file, one of them
+# left past the end by a truncate through another
+many_fds() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	python3 - > fds.script <<END_SCRIPT
+print("MOUNT\nCREATE\tf")
+for i in range(300): print(f"OPEN\tf\tfd{i}")
+print("WRITE\tDATA\t0123456789\nUSE\tfd0\nSEEK\t8\nTRUNCATE\t4")
+print("READ\t4\nWRITE\tDATA\txy\nUSE\tfd1\nREAD\t4\tDATA\t0123")
+print("SEEK\t8\nREAD\t2\tDATA\txy")
+for i in range(300): print(f"CLOSE\tfd{i}")
+print("UMOUNT")
+END_SCRIPT
+	run_test ./test_fs.x script test.fs fds.script
+
+	rm -f test.fs fds.script
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "302")")
+	line_array+=("$(select_line "${STDOUT}" "303")")
+	line_array+=("$(select_line "${STDOUT}" "306")")
+	line_array+=("$(select_line "${STDOUT}" "307")")
+	line_array+=("$(select_line "${STDOUT}" "309")")
+	line_array+=("$(select_line "${STDOUT}" "610")")
+	local corr_array=()
+	corr_array+=("OPEN successful.")
+	corr_array+=("Wrote 10 bytes to file.")
+	corr_array+=("Wrote 2 bytes to file.")
+	corr_array+=("Read 4 bytes from file. Compared 4 correct.")
+	corr_array+=("Read 2 bytes from file. Compared 2 correct.")
+	corr_array+=("UMOUNT successful.")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# commands served by fsd.x for the disk it keeps mounted
+fsd_daemon() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	python3 -c "for i in range(10000): print(chr(97 + i % 26), end='')" > test-file-1
+	python3 -c "for i in range(500000): print('a', end='')" > test-file-2
+	./fsd.x test.fs >/dev/null &
+	local pid=$!
+	local i
+	for i in $(seq 20); do
+		[[ -S test.fs.sock ]] && break
+		sleep 0.1
+	done
+
+	run_test ./test_fs.x add test.fs test-file-1
+	local add_out="${STDOUT}"
+	run_test ./test_fs.x ls test.fs
+	local ls_out="${STDOUT}"
+	local content="content differs"
+	./test_fs.x cat test.fs test-file-1 | tail -n +3 | cmp -s - test-file-1 &&
+		content="content matches"
+	run_test ./test_fs.x add test.fs test-file-2
+	local full_err="${STDERR}"
+	run_test ./test_fs.x rm test.fs test-file-1
+	local rm_out="${STDOUT}"
+
+	kill -TERM ${pid}
+	wait ${pid}
+	run_test ./fsck.x test.fs
+
+	rm -f test.fs test.fs.sock test-file-1 test-file-2
+
+	local line_array=()
+	line_array+=("$(select_line "${add_out}" "1")")
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("${content}")
+	line_array+=("$(select_line "${full_err}" "1")")
+	line_array+=("$(select_line "${rm_out}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	local corr_array=()
+	corr_array+=("Wrote file 'test-file-1' (10000/10000 bytes)")
+	corr_array+=("file: test-file-1, size: 10000")
+	corr_array+=("content matches")
+	corr_array+=("Not enough space for 500000 bytes")
+	corr_array+=("Removed file 'test-file-1'")
+	corr_array+=("test.fs: 0 files, 0 used blocks, 0 errors")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# a million small reads and writes make no heap allocation, counted by
+# wrapping the allocation functions at link time
+hot_path() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	# longer than run_test allows
+	local hot_out=$(timeout 30 ./test_alloc.x test.fs 1000000 2>&1)
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${hot_out}" "3")")
+	local corr_array=()
+	corr_array+=("allocations=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
 #
 # Run tests
 #
@@ -249,6 +885,42 @@ run_tests() {
 	create_simple
     
 	read_block
+
+	truncate_fallocate
+
+	large_blocks
+
+	sparse_full_fat
+
+	truncate_nospace
+
+	csum_verify
+
+	fsck_repair
+
+	defrag_interleaved
+
+	add_dir_rm_many
+
+	import_export
+
+	copy_shared
+
+	async_io
+
+	group_sync
+
+	striped_volume
+
+	dump_restore
+
+	script_engine
+
+	many_fds
+
+	fsd_daemon
+
+	hot_path
 }
 
 make_fs() {
@@ -256,7 +928,7 @@ make_fs() {
     make > /dev/null 2>&1 ||
         die "Compilation failed"
 
-    local execs=("test_fs.x" "fs_make.x" "fs_ref.x")
+    local execs=("test_fs.x" "fs_make.x" "fs_ref.x" "fsck.x" "fsd.x" "test_alloc.x")
 
     # Make sure executables were properly created
     local x
@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "fs_internal.h"
+#include "stats.h"
+
+/*
+ * Asynchronous reads and writes: requests are queued per file and served by a
+ * pool of worker threads calling fs_read() and fs_write(). A file is served
+ * by one worker at a time, in submission order, so the requests of a
+ * descriptor (and of every descriptor of the file) keep their order, while
+ * different files proceed in parallel as fs_write() allows. Files with work
+ * wait their turn in a ring, a worker puts a file back at the end after each
+ * request so that a long queue does not starve the others.
+ */
+struct aio_req {
+	struct aio_req *next;
+	int fd;
+	int write;
+	void *buf;
+	size_t count;
+	fs_aio_cb cb;
+	void *arg;
+	int result;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	/* signalled when a file gets work, and when the pool stops */
+	pthread_cond_t work;
+	/* signalled when the last pending request completes */
+	pthread_cond_t idle;
+	/* requests of every file, by root dir index */
+	struct aio_req *head[FS_FILE_MAX_COUNT];
+	struct aio_req *tail[FS_FILE_MAX_COUNT];
+	/* file queued in the ring or being served */
+	uint8_t scheduled[FS_FILE_MAX_COUNT];
+	int ring[FS_FILE_MAX_COUNT];
+	int ring_head, ring_len;
+	/* completed requests without a callback, for fs_aio_reap() */
+	struct aio_req *done_head, *done_tail;
+	/* recycled requests, so that submitting does not allocate */
+	struct aio_req *free_list;
+	/* submitted and not yet completed */
+	int pending;
+	pthread_t *threads;
+	int num_threads;
+	int stop;
+	int efd;
+} aio = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+	.efd = -1,
+};
+
+static void *aio_worker(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&aio.lock);
+	for(;;)
+	{
+		while(aio.ring_len == 0 && !aio.stop)
+			pthread_cond_wait(&aio.work, &aio.lock);
+		if(aio.ring_len == 0) break;
+
+		int file = aio.ring[aio.ring_head];
+		aio.ring_head = (aio.ring_head + 1) % FS_FILE_MAX_COUNT;
+		aio.ring_len--;
+		struct aio_req *req = aio.head[file];
+		aio.head[file] = req->next;
+		if(aio.head[file] == NULL)
+			aio.tail[file] = NULL;
+		pthread_mutex_unlock(&aio.lock);
+
+		if(req->write)
+			req->result = fs_write(req->fd, req->buf, req->count);
+		else
+			req->result = fs_read(req->fd, req->buf, req->count);
+		if(req->cb)
+			req->cb(req->fd, req->result, req->arg);
+
+		pthread_mutex_lock(&aio.lock);
+		// the next request of the file waits behind the other files
+		if(aio.head[file])
+		{
+			aio.ring[(aio.ring_head + aio.ring_len) % FS_FILE_MAX_COUNT] = file;
+			aio.ring_len++;
+			pthread_cond_signal(&aio.work);
+		}
+		else
+			aio.scheduled[file] = 0;
+
+		if(req->cb)
+		{
+			req->next = aio.free_list;
+			aio.free_list = req;
+		}
+		else
+		{
+			req->next = NULL;
+			if(aio.done_tail) aio.done_tail->next = req;
+			else aio.done_head = req;
+			aio.done_tail = req;
+			uint64_t one = 1;
+			while(write(aio.efd, &one, sizeof(one)) == -1 && errno == EINTR);
+		}
+		if(--aio.pending == 0)
+			pthread_cond_broadcast(&aio.idle);
+	}
+	pthread_mutex_unlock(&aio.lock);
+	return NULL;
+}
+
+// start the workers and the eventfd, on first use. Called with aio.lock held.
+static int aio_start(void)
+{
+	if(aio.threads) return 0;
+
+	aio.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(aio.efd == -1) return -1;
+
+	int num_threads = mount_opts.aio_threads;
+	if(num_threads == 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	num_threads = MIN(MAX(num_threads, 1), FS_FILE_MAX_COUNT);
+	aio.threads = stats_calloc(num_threads, sizeof(pthread_t));
+	if(aio.threads == NULL)
+	{
+		close(aio.efd);
+		aio.efd = -1;
+		return -1;
+	}
+	aio.stop = 0;
+	for(aio.num_threads = 0; aio.num_threads < num_threads; aio.num_threads++)
+	{
+		if(pthread_create(&aio.threads[aio.num_threads], NULL, aio_worker,
+				  NULL) != 0)
+			break;
+	}
+	return aio.num_threads ? 0 : -1;
+}
+
+// wait for every request, then stop the workers. See fs_umount().
+void aio_exit(void)
+{
+	pthread_mutex_lock(&aio.lock);
+	while(aio.pending)
+		pthread_cond_wait(&aio.idle, &aio.lock);
+	aio.stop = 1;
+	pthread_cond_broadcast(&aio.work);
+	pthread_mutex_unlock(&aio.lock);
+
+	for(int t = 0; t < aio.num_threads; t++)
+		pthread_join(aio.threads[t], NULL);
+	free(aio.threads);
+	aio.threads = NULL;
+	aio.num_threads = 0;
+
+	// completions nobody reaped go with the mount
+	while(aio.done_head)
+	{
+		struct aio_req *req = aio.done_head;
+		aio.done_head = req->next;
+		free(req);
+	}
+	aio.done_tail = NULL;
+	while(aio.free_list)
+	{
+		struct aio_req *req = aio.free_list;
+		aio.free_list = req->next;
+		free(req);
+	}
+	if(aio.efd != -1) close(aio.efd);
+	aio.efd = -1;
+}
+
+static int aio_submit(int fd, int is_write, void *buf, size_t count,
+		      fs_aio_cb cb, void *arg)
+{
+	if(super == NULL) return -1;
+	FileDescriptor *d = fd_get(fd);
+	if(d == NULL || d->file == NULL)
+	{
+		perror("fd out of bounds or not currently open\n");
+		return -1;
+	}
+	if(buf == NULL)
+	{
+		perror("buf cannot be NULL\n");
+		return -1;
+	}
+	int file = d->file->dirent;
+
+	pthread_mutex_lock(&aio.lock);
+	if(aio_start() == -1)
+	{
+		pthread_mutex_unlock(&aio.lock);
+		return -1;
+	}
+	struct aio_req *req = aio.free_list;
+	if(req)
+		aio.free_list = req->next;
+	else
+	{
+		req = stats_malloc(sizeof(*req));
+		if(req == NULL)
+		{
+			pthread_mutex_unlock(&aio.lock);
+			return -1;
+		}
+	}
+	*req = (struct aio_req){ NULL, fd, is_write, buf, count, cb, arg, 0 };
+
+	if(aio.tail[file]) aio.tail[file]->next = req;
+	else aio.head[file] = req;
+	aio.tail[file] = req;
+	aio.pending++;
+	if(!aio.scheduled[file])
+	{
+		aio.scheduled[file] = 1;
+		aio.ring[(aio.ring_head + aio.ring_len) % FS_FILE_MAX_COUNT] = file;
+		aio.ring_len++;
+		pthread_cond_signal(&aio.work);
+	}
+	pthread_mutex_unlock(&aio.lock);
+	return 0;
+}
+
+int fs_read_async(int fd, void *buf, size_t count, fs_aio_cb cb, void *arg)
+{
+	return aio_submit(fd, 0, buf, count, cb, arg);
+}
+
+int fs_write_async(int fd, void *buf, size_t count, fs_aio_cb cb, void *arg)
+{
+	return aio_submit(fd, 1, buf, count, cb, arg);
+}
+
+int fs_aio_fd(void)
+{
+	if(super == NULL) return -1;
+	pthread_mutex_lock(&aio.lock);
+	int efd = aio_start() == -1 ? -1 : aio.efd;
+	pthread_mutex_unlock(&aio.lock);
+	return efd;
+}
+
+int fs_aio_reap(struct fs_aio_event *events, int max)
+{
+	if(events == NULL || max < 0) return -1;
+
+	int count = 0;
+	pthread_mutex_lock(&aio.lock);
+	while(count < max && aio.done_head)
+	{
+		struct aio_req *req = aio.done_head;
+		aio.done_head = req->next;
+		events[count].fd = req->fd;
+		events[count].result = req->result;
+		events[count].arg = req->arg;
+		count++;
+		req->next = aio.free_list;
+		aio.free_list = req;
+	}
+	if(aio.done_head == NULL)
+		aio.done_tail = NULL;
+	pthread_mutex_unlock(&aio.lock);
+	return count;
+}
+
+int fs_aio_wait(void)
+{
+	if(super == NULL) return -1;
+	pthread_mutex_lock(&aio.lock);
+	while(aio.pending)
+		pthread_cond_wait(&aio.idle, &aio.lock);
+	pthread_mutex_unlock(&aio.lock);
+	return 0;
+}
@@ -0,0 +1,156 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+#include "stats.h"
+
+/*
+ * Allocation groups: the data area is split in groups of one FAT block each,
+ * every group with its own free count, search hint and lock. A writer thread
+ * allocates in the group of the block it extends, or else in the group it has
+ * affinity with, so concurrent appenders to different files take different
+ * locks and their files stay contiguous. Only when both are full does it
+ * steal from the other groups, in order.
+ */
+struct alloc_group {
+	pthread_mutex_t lock;
+	/* Free entries of the group */
+	uint32_t free;
+	/* Every entry of the group below it is taken */
+	uint32_t next_free;
+};
+
+static struct alloc_group *groups;
+static int num_groups;
+/* Free entries of all the groups */
+static uint32_t free_total;
+
+/* Affinity of the calling thread, handed out round robin on its first
+ allocation */
+static __thread int affinity = -1;
+static int next_affinity;
+
+// set the groups up from the allocation summary of the superblock
+void alloc_init(void)
+{
+	num_groups = (super->amt_blk_data + FAT_PER_BLK - 1) / FAT_PER_BLK;
+	groups = stats_calloc(num_groups, sizeof(*groups));
+	assert(groups);
+	for(int g = 0; g < num_groups; g++)
+	{
+		pthread_mutex_init(&groups[g].lock, NULL);
+		groups[g].free = super->region_free[g];
+		groups[g].next_free = MAX((size_t)super->next_free, g * FAT_PER_BLK);
+	}
+	free_total = super->free_blk;
+}
+
+// copy the state of the groups back into the superblock summary
+void alloc_store(void)
+{
+	super->free_blk = free_total;
+	super->next_free = super->amt_blk_data;
+	for(int g = 0; g < num_groups; g++)
+	{
+		super->region_free[g] = groups[g].free;
+		if(groups[g].free && groups[g].next_free < super->next_free)
+			super->next_free = groups[g].next_free;
+	}
+}
+
+void alloc_exit(void)
+{
+	for(int g = 0; g < num_groups; g++)
+		pthread_mutex_destroy(&groups[g].lock);
+	free(groups);
+	groups = NULL;
+	num_groups = 0;
+}
+
+int alloc_free_count(void)
+{
+	return __atomic_load_n(&free_total, __ATOMIC_RELAXED);
+}
+
+int alloc_group_free(int g)
+{
+	return __atomic_load_n(&groups[g].free, __ATOMIC_RELAXED);
+}
+
+// keep the groups current as FAT entry @i is freed or taken, see fat_set()
+void sum_account(uint16_t i, int freed)
+{
+	// fsck repairs the FAT without groups, and rebuilds the summary after
+	if(groups == NULL) return;
+
+	struct alloc_group *grp = &groups[FAT_BLK(i)];
+	if(freed)
+	{
+		__atomic_add_fetch(&free_total, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&grp->free, 1, __ATOMIC_RELAXED);
+		uint32_t hint = __atomic_load_n(&grp->next_free, __ATOMIC_RELAXED);
+		while(i < hint && !__atomic_compare_exchange_n(&grp->next_free,
+			&hint, i, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+	else
+	{
+		__atomic_sub_fetch(&free_total, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&grp->free, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// take a free entry of group @g, entry @near if it is free
+static int group_alloc(int g, int near)
+{
+	struct alloc_group *grp = &groups[g];
+	int end = MIN((g + 1) * FAT_PER_BLK, (size_t)super->amt_blk_data);
+	int index = -1;
+
+	pthread_mutex_lock(&grp->lock);
+	if(near > 0 && near < end && FAT_BLK(near) == g && fat_get(near) == 0)
+		index = near;
+	// a free in the group may lower the hint meanwhile, keep it then
+	uint32_t start = __atomic_load_n(&grp->next_free, __ATOMIC_RELAXED);
+	for(int i = MAX(start, 1u); index == -1 && i < end; i++)
+	{
+		if(fat_get(i) != 0) continue;
+		index = i;
+		__atomic_compare_exchange_n(&grp->next_free, &start, i + 1, 0,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	if(index != -1) fat_set(index, FAT_EOC);
+	pthread_mutex_unlock(&grp->lock);
+	return index;
+}
+
+int alloc_block(uint16_t near)
+{
+	if(num_groups == 0) return -1;
+	if(affinity == -1)
+		affinity = __atomic_fetch_add(&next_affinity, 1, __ATOMIC_RELAXED);
+	int home = affinity % num_groups;
+
+	// right after the block being extended, or anywhere in its group
+	if(near != FAT_EOC && !IS_HOLE(near) && near + 1 < super->amt_blk_data)
+	{
+		int g = FAT_BLK(near + 1);
+		if(alloc_group_free(g))
+		{
+			int index = group_alloc(g, near + 1);
+			if(index != -1) return index;
+		}
+	}
+
+	// then the group of this thread, then steal from the next ones
+	for(int k = 0; k < num_groups; k++)
+	{
+		int g = (home + k) % num_groups;
+		if(!alloc_group_free(g)) continue;
+		int index = group_alloc(g, 0);
+		if(index != -1) return index;
+	}
+	return -1;
+}
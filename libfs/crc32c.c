@@ -0,0 +1,201 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+/* Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+/* Slicing-by-8 tables, filled once on first use, whichever thread gets there
+ first */
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+/* The hardware version runs three independent streams over LONG (then SHORT)
+ byte chunks to hide the latency of the crc32 instruction, then merges them
+ by shifting a stream's crc over the bytes of the next ones */
+#define LONG 1024
+#define SHORT 256
+static uint32_t crc_long[4][256];
+static uint32_t crc_short[4][256];
+static pthread_once_t crc_shift_once = PTHREAD_ONCE_INIT;
+
+/* Multiply GF(2) matrix @mat by vector @vec */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+	for (; vec; vec >>= 1, mat++) {
+		if (vec & 1)
+			sum ^= *mat;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	for (int n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Build the operator appending @len zero bytes to a crc (@len is a power of
+ two), as byte-wise tables */
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len)
+{
+	uint32_t op[32], sq[32];
+
+	/* Operator for one zero bit, squared up to one zero byte */
+	op[0] = CRC32C_POLY;
+	for (int n = 1; n < 32; n++)
+		op[n] = 1U << (n - 1);
+	for (int i = 0; i < 3; i++) {
+		gf2_matrix_square(sq, op);
+		memcpy(op, sq, sizeof(op));
+	}
+	/* Then up to @len zero bytes */
+	for (; len > 1; len >>= 1) {
+		gf2_matrix_square(sq, op);
+		memcpy(op, sq, sizeof(op));
+	}
+
+	for (uint32_t n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_matrix_times(op, n);
+		zeros[1][n] = gf2_matrix_times(op, n << 8);
+		zeros[2][n] = gf2_matrix_times(op, n << 16);
+		zeros[3][n] = gf2_matrix_times(op, n << 24);
+	}
+}
+
+static void crc32c_init_shift(void)
+{
+	crc32c_zeros(crc_long, LONG);
+	crc32c_zeros(crc_short, SHORT);
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+	       zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+static void crc32c_init_table(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		crc_table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j-1][i] >> 8) ^
+				crc_table[0][crc_table[j-1][i] & 0xFF];
+	}
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	pthread_once(&crc_table_once, crc32c_init_table);
+
+	crc = ~crc;
+	/* Eight bytes per step through the sliced tables */
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		word ^= crc;
+		crc = crc_table[7][word & 0xFF] ^
+		      crc_table[6][(word >> 8) & 0xFF] ^
+		      crc_table[5][(word >> 16) & 0xFF] ^
+		      crc_table[4][(word >> 24) & 0xFF] ^
+		      crc_table[3][(word >> 32) & 0xFF] ^
+		      crc_table[2][(word >> 40) & 0xFF] ^
+		      crc_table[1][(word >> 48) & 0xFF] ^
+		      crc_table[0][word >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+/* Run three crc32 streams over @chunk bytes each, starting at @p */
+#define CRC32C_3WAY(chunk, zeros)					\
+	while (len >= (chunk) * 3) {					\
+		uint64_t crc1 = 0, crc2 = 0, w0, w1, w2;		\
+		const uint8_t *end = p + (chunk);			\
+		do {							\
+			memcpy(&w0, p, 8);				\
+			memcpy(&w1, p + (chunk), 8);			\
+			memcpy(&w2, p + (chunk) * 2, 8);		\
+			crc64 = _mm_crc32_u64(crc64, w0);		\
+			crc1 = _mm_crc32_u64(crc1, w1);			\
+			crc2 = _mm_crc32_u64(crc2, w2);			\
+			p += 8;						\
+		} while (p < end);					\
+		crc64 = crc32c_shift(zeros, crc64) ^ crc1;		\
+		crc64 = crc32c_shift(zeros, crc64) ^ crc2;		\
+		p += (chunk) * 2;					\
+		len -= (chunk) * 3;					\
+	}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t crc64 = ~crc;
+
+	pthread_once(&crc_shift_once, crc32c_init_shift);
+
+	CRC32C_3WAY(LONG, crc_long)
+	CRC32C_3WAY(SHORT, crc_short)
+
+	/* Eight bytes per crc32 instruction, then the leftover bytes */
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		p += 8;
+		len -= 8;
+	}
+	uint32_t crc32 = (uint32_t)crc64;
+	while (len--)
+		crc32 = _mm_crc32_u8(crc32, *p++);
+	return ~crc32;
+}
+#endif
+
+int crc32c_hw_available(void)
+{
+#if defined(__x86_64__)
+	return __builtin_cpu_supports("sse4.2") != 0;
+#else
+	return 0;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	/* Resolved once, the CPU won't change under us. Threads racing on the
+	 first call all store the same pointer. */
+	static uint32_t (*impl)(uint32_t, const void *, size_t);
+	uint32_t (*f)(uint32_t, const void *, size_t) =
+		__atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+	if (!f) {
+#if defined(__x86_64__)
+		f = crc32c_hw_available() ? crc32c_hw : crc32c_sw;
+#else
+		f = crc32c_sw;
+#endif
+		__atomic_store_n(&impl, f, __ATOMIC_RELAXED);
+	}
+	return f(crc, buf, len);
+}
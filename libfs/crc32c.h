@@ -0,0 +1,40 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * crc32c - Compute a CRC32C (Castagnoli) checksum
+ * @crc: Checksum of the preceding data, 0 to start a new one
+ * @buf: Data buffer
+ * @len: Number of bytes in @buf
+ *
+ * Extend checksum @crc over the @len bytes of @buf. The SSE4.2 crc32
+ * instruction is used when the CPU has it, a table-driven version otherwise.
+ *
+ * Return: the updated checksum.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_sw - Compute a CRC32C checksum without hardware support
+ * @crc: Checksum of the preceding data, 0 to start a new one
+ * @buf: Data buffer
+ * @len: Number of bytes in @buf
+ *
+ * Same as crc32c() but always uses the table-driven version, so both can be
+ * compared.
+ *
+ * Return: the updated checksum.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_hw_available - Check for hardware CRC32C support
+ *
+ * Return: 1 if crc32c() runs on the SSE4.2 crc32 instruction. 0 otherwise.
+ */
+int crc32c_hw_available(void);
+
+#endif /* _CRC32C_H */
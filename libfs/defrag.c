@@ -0,0 +1,242 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+#include "stats.h"
+
+/* Blocks copied per transfer while relocating a file */
+#define COPY_BATCH 64
+
+static volatile sig_atomic_t defrag_cancelled;
+
+void fs_defrag_cancel(void)
+{
+	defrag_cancelled = 1;
+}
+
+// count the data blocks of file @root_index and the runs they form
+static void measure(int root_index, struct fs_frag *frag)
+{
+	uint16_t prev = FAT_EOC;
+
+	memset(frag, 0, sizeof(*frag));
+	for(uint16_t curr = root_dir[root_index].first_data_blk_index;
+	    curr != FAT_EOC; curr = fat_get(curr))
+	{
+		if(IS_HOLE(curr)) continue;
+		frag->blocks++;
+		if(prev == FAT_EOC || curr != prev + 1)
+			frag->extents++;
+		prev = curr;
+	}
+}
+
+// root directory index of @filename, -1 if not mounted or no such file
+static int find_file(const char *filename)
+{
+	if(super == NULL || !name_valid(filename))
+		return -1;
+	enum type t = CURR_FILE;
+	return get_index(t, filename);
+}
+
+// free the chain starting at @first
+static void free_chain(uint16_t first)
+{
+	uint16_t curr = first, next;
+	while(curr != FAT_EOC)
+	{
+		next = fat_get(curr);
+		fat_set(curr, 0);
+		curr = next;
+	}
+}
+
+/* Copy the data blocks of file @root_index, in chain order, to the free run
+ starting at @run. The checksums follow the data. */
+static int copy_blocks(int root_index, int run)
+{
+	uint8_t *buf = block_buf_alloc(COPY_BATCH);
+	size_t done = 0, batch = 0;
+
+	if(buf == NULL) return -1;
+	for(uint16_t curr = root_dir[root_index].first_data_blk_index;
+	    curr != FAT_EOC; curr = fat_get(curr))
+	{
+		if(IS_HOLE(curr)) continue;
+		if(block_read(super->data_blk_index + curr, buf + batch*blk_size) == -1)
+			break;
+		if(csum_tab)
+			csum_tab[run + done + batch] = csum_tab[curr];
+		if(++batch == COPY_BATCH)
+		{
+			if(block_write_range(super->data_blk_index + run + done,
+					     batch, buf) == -1)
+				break;
+			done += batch;
+			batch = 0;
+		}
+	}
+	if(batch && block_write_range(super->data_blk_index + run + done,
+				      batch, buf) == 0)
+	{
+		done += batch;
+		batch = 0;
+	}
+	free(buf);
+
+	struct fs_frag frag;
+	measure(root_index, &frag);
+	return done == frag.blocks ? 0 : -1;
+}
+
+/* Move the data blocks of file @root_index into one free run. The metadata
+ is written so that the disk holds a consistent file system at every step,
+ at worst with a leaked chain fsck can reclaim: the new chain is flushed next
+ to the old one, then the root dir entry is switched to it, then the old
+ chain is freed. Return 1 if the file moved, 0 if it is contiguous already,
+ if no free run is large enough or if cancelled, -1 on I/O error. */
+static int relocate(int root_index)
+{
+	struct fs_frag frag;
+	uint16_t first = root_dir[root_index].first_data_blk_index;
+
+	measure(root_index, &frag);
+	if(frag.extents <= 1) return 0;
+	// freeing the old chain would take blocks from a copy
+	if(chain_shared(root_index)) return 0;
+
+	int run = get_free_run(frag.blocks, 1);
+	if(run == -1) return 0;
+
+	// nothing points at the run yet, so failing here changes nothing
+	if(copy_blocks(root_index, run) == -1) return -1;
+	if(defrag_cancelled) return 0;
+
+	// build the new chain, holes get entries of their own
+	uint16_t new_first = FAT_EOC, prev = FAT_EOC;
+	size_t k = 0;
+	for(uint16_t curr = first; curr != FAT_EOC; curr = fat_get(curr))
+	{
+		int index;
+		if(IS_HOLE(curr))
+		{
+			index = get_hole_index();
+			if(index == -1)
+			{
+				free_chain(new_first);
+				return 0;
+			}
+		}
+		else
+		{
+			index = run + k++;
+			fat_set(index, FAT_EOC);
+		}
+
+		if(prev == FAT_EOC)
+			new_first = index;
+		else
+			fat_set(prev, index);
+		prev = index;
+	}
+	if(write_fat() == -1 || csum_flush() == -1) return -1;
+
+	root_dir[root_index].first_data_blk_index = new_first;
+	extents_drop(root_index);
+	if(block_write(super->root_dir_index, root_dir) == -1) return -1;
+
+	free_chain(first);
+	if(write_fat() == -1) return -1;
+	return 1;
+}
+
+int fs_fragmentation(const char *filename, struct fs_frag *frag)
+{
+	STATS_OP(FS_OP_FRAG);
+
+	int root_index = find_file(filename);
+	if(root_index == -1 || frag == NULL) return -1;
+
+	measure(root_index, frag);
+	return 0;
+}
+
+int fs_frag_report(void)
+{
+	STATS_OP(FS_OP_FRAG);
+
+	struct fs_frag frag;
+	size_t total_blocks = 0, total_extents = 0;
+
+	if(super == NULL) return -1;
+
+	printf("FS Frag:\n");
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(root_dir[i].fileName[0] == '\0') continue;
+		measure(i, &frag);
+		printf("file: %s, blocks: %zu, extents: %zu, avg_run: %.1f\n",
+		       (char*)root_dir[i].fileName, frag.blocks, frag.extents,
+		       frag.extents ? (double)frag.blocks / frag.extents : 0.0);
+		total_blocks += frag.blocks;
+		total_extents += frag.extents;
+	}
+	printf("total: blocks: %zu, extents: %zu, avg_run: %.1f\n",
+	       total_blocks, total_extents,
+	       total_extents ? (double)total_blocks / total_extents : 0.0);
+	return 0;
+}
+
+int fs_defrag(const char *filename)
+{
+	STATS_OP(FS_OP_DEFRAG);
+	META_CHANGE();
+
+	int root_index = find_file(filename);
+	if(root_index == -1) return -1;
+
+	defrag_cancelled = 0;
+	return relocate(root_index);
+}
+
+int fs_defrag_all(void)
+{
+	STATS_OP(FS_OP_DEFRAG);
+	META_CHANGE();
+
+	int order[FS_FILE_MAX_COUNT];
+	size_t blocks[FS_FILE_MAX_COUNT];
+	int num_files = 0, moved = 0;
+	struct fs_frag frag;
+
+	if(super == NULL) return -1;
+	defrag_cancelled = 0;
+
+	// largest files first, they gain the most from a sequential layout
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(root_dir[i].fileName[0] == '\0') continue;
+		measure(i, &frag);
+		int j = num_files++;
+		for(; j > 0 && blocks[j-1] < frag.blocks; j--)
+		{
+			order[j] = order[j-1];
+			blocks[j] = blocks[j-1];
+		}
+		order[j] = i;
+		blocks[j] = frag.blocks;
+	}
+
+	for(int i = 0; i < num_files && !defrag_cancelled; i++)
+	{
+		int status = relocate(order[i]);
+		if(status == -1) return -1;
+		moved += status;
+	}
+	return moved;
+}
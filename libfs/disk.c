@@ -1,11 +1,20 @@
+#define _GNU_SOURCE /* for O_DIRECT */
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "stats.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
@@ -15,19 +24,474 @@
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
+	/* File descriptor, of the first member for a stripe set */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Block size, and its log2 */
+	size_t bsize;
+	int bshift;
+	/* File size in bytes, of all the members for a stripe set */
+	off_t bytes;
+	/* Opened with O_DIRECT */
+	int direct;
+	/* Members of a stripe set (1 for a plain image), and the stripe unit
+	 * in bytes */
+	int fds[BLOCK_STRIPE_MAX];
+	int num_members;
+	size_t unit;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = { .fd = INVALID_FD, .bsize = BLOCK_SIZE, .bshift = 12 };
 
-int block_disk_open(const char *diskname)
+_Static_assert(BLOCK_SIZE == 1 << 12, "bshift of the default block size");
+
+/* Bounce buffers of POOL_BYTES for O_DIRECT transfers from unaligned
+ buffers. The fsck workers read concurrently, so a buffer is taken by setting
+ its bit in @busy atomically; when all are taken a temporary one is used. */
+#define POOL_BUFS 8
+#define POOL_BYTES (16 * BLOCK_SIZE)
+
+static struct {
+	void *bufs[POOL_BUFS];
+	unsigned int busy;
+} pool;
+
+static int pool_get(void)
+{
+	for (int i = 0; i < POOL_BUFS; i++) {
+		unsigned int bit = 1u << i;
+		if (!(__atomic_fetch_or(&pool.busy, bit, __ATOMIC_ACQUIRE) & bit))
+			return i;
+	}
+	return -1;
+}
+
+static void pool_put(int i)
+{
+	__atomic_fetch_and(&pool.busy, ~(1u << i), __ATOMIC_RELEASE);
+}
+
+static void pool_free(void)
+{
+	for (int i = 0; i < POOL_BUFS; i++) {
+		free(pool.bufs[i]);
+		pool.bufs[i] = NULL;
+	}
+	pool.busy = 0;
+}
+
+_Static_assert(sizeof(struct block_trace_rec) == 16, "trace records are packed");
+
+/* Block I/O trace being recorded */
+struct trace {
+	/* Mapping of the trace file, NULL when not recording */
+	struct block_trace_header *hdr;
+	struct block_trace_rec *recs;
+	size_t map_len;
+	uint64_t start_ns;
+};
+
+static struct trace trace;
+/* Origin of the transfers of the calling thread */
+static __thread int trace_origin = BLOCK_TRACE_NO_ORIGIN;
+
+static uint64_t trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Append a record for a transfer of @count blocks at @block. Slots are
+ reserved atomically since the fsck workers read blocks concurrently. */
+static void trace_record(enum block_trace_op op, size_t block, size_t count)
+{
+	while (count > 0) {
+		uint16_t n = count > UINT16_MAX ? UINT16_MAX : count;
+		uint64_t slot = __atomic_fetch_add(&trace.hdr->head, 1,
+						   __ATOMIC_RELAXED);
+		struct block_trace_rec *rec =
+			&trace.recs[slot % trace.hdr->capacity];
+
+		rec->ns = trace_now() - trace.start_ns;
+		rec->block = block;
+		rec->count = n;
+		rec->op = op;
+		rec->origin = trace_origin;
+		block += n;
+		count -= n;
+	}
+}
+
+int block_trace_start(const char *path, size_t capacity)
 {
 	int fd;
+	void *map;
+	size_t len = sizeof(struct block_trace_header) +
+		     capacity * sizeof(struct block_trace_rec);
+
+	if (trace.hdr) {
+		block_error("trace already started");
+		return -1;
+	}
+
+	if (!path || capacity == 0 || capacity > UINT32_MAX) {
+		block_error("invalid trace file or capacity");
+		return -1;
+	}
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (ftruncate(fd, len) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	trace.hdr = map;
+	trace.recs = (struct block_trace_rec *)(trace.hdr + 1);
+	trace.map_len = len;
+	trace.start_ns = trace_now();
+	memcpy(trace.hdr->magic, BLOCK_TRACE_MAGIC, sizeof(trace.hdr->magic));
+	trace.hdr->block_size = disk.bsize;
+	trace.hdr->capacity = capacity;
+	trace.hdr->head = 0;
+
+	return 0;
+}
+
+int block_trace_stop(void)
+{
+	if (!trace.hdr) {
+		block_error("no trace started");
+		return -1;
+	}
+
+	munmap(trace.hdr, trace.map_len);
+	trace.hdr = NULL;
+	trace.recs = NULL;
+
+	return 0;
+}
+
+int block_trace_origin(int origin)
+{
+	int prev = trace_origin;
+	trace_origin = origin;
+	return prev;
+}
+
+/*
+ * Stripe sets: a text file naming member images and a stripe unit, see
+ * block_stripe_create(). Byte @off of the disk is in stripe off / unit, which
+ * lives on member stripe % count at offset (stripe / count) * unit +
+ * off % unit. A transfer spanning several members becomes one vectored call
+ * per member, served in parallel by a worker thread per member; the caller
+ * serves one of them itself.
+ */
+struct stripe_set {
+	size_t unit;
+	int count;
+	char paths[BLOCK_STRIPE_MAX][PATH_MAX];
+};
+
+enum stripe_op { STRIPE_READ, STRIPE_WRITE, STRIPE_FLUSH };
+
+/* Stripes of one member per call, more are left to the next round */
+#define STRIPE_IOV 64
+
+struct stripe_job {
+	struct stripe_job *next;
+	int member;
+	enum stripe_op op;
+	struct iovec iov[STRIPE_IOV];
+	int iovcnt;
+	off_t off;
+	int ret;
+	/* Jobs of the transfer still queued or running */
+	int *pending;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	/* Signalled when a member gets a job, and when the workers stop */
+	pthread_cond_t work[BLOCK_STRIPE_MAX];
+	/* Signalled when the last job of a transfer completes */
+	pthread_cond_t done;
+	struct stripe_job *head[BLOCK_STRIPE_MAX], *tail[BLOCK_STRIPE_MAX];
+	pthread_t threads[BLOCK_STRIPE_MAX];
+	int num_threads;
+	int stop;
+} stripe = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Read stripe set file @name into @set. Return 1 if it is one, 0 if @name is
+ something else (a plain image, or a file that cannot be read), -1 if the set
+ is invalid. */
+static int stripe_parse(const char *name, struct stripe_set *set)
+{
+	char line[PATH_MAX];
+	size_t magic_len = strlen(BLOCK_STRIPE_MAGIC);
+	FILE *f = fopen(name, "r");
+
+	if (!f)
+		return 0;
+	if (!fgets(line, sizeof(line), f) ||
+	    strncmp(line, BLOCK_STRIPE_MAGIC " ", magic_len + 1)) {
+		fclose(f);
+		return 0;
+	}
+
+	set->unit = strtoul(line + magic_len + 1, NULL, 0);
+	set->count = 0;
+	/* Relative member paths start from the directory of the set file */
+	const char *slash = strrchr(name, '/');
+	int dir_len = slash ? slash - name + 1 : 0;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '\0')
+			continue;
+		if (set->count == BLOCK_STRIPE_MAX) {
+			set->count = 0;
+			break;
+		}
+		int n = line[0] == '/'
+			? snprintf(set->paths[set->count], PATH_MAX, "%s", line)
+			: snprintf(set->paths[set->count], PATH_MAX, "%.*s%s",
+				   dir_len, name, line);
+		if (n >= PATH_MAX) {
+			set->count = 0;
+			break;
+		}
+		set->count++;
+	}
+	fclose(f);
+
+	if (set->count == 0 || set->unit == 0 || set->unit % BLOCK_SIZE) {
+		block_error("invalid stripe set '%s'", name);
+		return -1;
+	}
+	return 1;
+}
+
+/* Bytes of member @i when the stripe set holds @total bytes */
+static off_t stripe_member_bytes(off_t total, size_t unit, int count, int i)
+{
+	off_t row = (off_t)unit * count;
+	off_t rest = total % row - (off_t)i * unit;
+
+	if (rest < 0)
+		rest = 0;
+	if (rest > (off_t)unit)
+		rest = unit;
+	return total / row * unit + rest;
+}
+
+static int stripe_run(struct stripe_job *job)
+{
+	int fd = disk.fds[job->member];
+	struct iovec *iov = job->iov;
+	int iovcnt = job->iovcnt;
+	off_t off = job->off;
+
+	if (job->op == STRIPE_FLUSH) {
+		if (fdatasync(fd) < 0) {
+			perror("fdatasync");
+			return -1;
+		}
+		return 0;
+	}
+
+	while (iovcnt > 0) {
+		ssize_t ret = job->op == STRIPE_WRITE ? pwritev(fd, iov, iovcnt, off)
+						      : preadv(fd, iov, iovcnt, off);
+		if (ret <= 0) {
+			perror(job->op == STRIPE_WRITE ? "pwritev" : "preadv");
+			return -1;
+		}
+		/* Skip what went through, retry the rest */
+		off += ret;
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+static void *stripe_worker(void *arg)
+{
+	int m = (int)(intptr_t)arg;
+
+	pthread_mutex_lock(&stripe.lock);
+	for (;;) {
+		while (!stripe.head[m] && !stripe.stop)
+			pthread_cond_wait(&stripe.work[m], &stripe.lock);
+		struct stripe_job *job = stripe.head[m];
+		if (!job)
+			break;
+		stripe.head[m] = job->next;
+		if (!stripe.head[m])
+			stripe.tail[m] = NULL;
+		pthread_mutex_unlock(&stripe.lock);
+
+		job->ret = stripe_run(job);
+
+		pthread_mutex_lock(&stripe.lock);
+		if (--*job->pending == 0)
+			pthread_cond_broadcast(&stripe.done);
+	}
+	pthread_mutex_unlock(&stripe.lock);
+	return NULL;
+}
+
+static void stripe_stop(void)
+{
+	pthread_mutex_lock(&stripe.lock);
+	stripe.stop = 1;
+	for (int m = 0; m < stripe.num_threads; m++)
+		pthread_cond_signal(&stripe.work[m]);
+	pthread_mutex_unlock(&stripe.lock);
+
+	for (int m = 0; m < stripe.num_threads; m++) {
+		pthread_join(stripe.threads[m], NULL);
+		pthread_cond_destroy(&stripe.work[m]);
+	}
+	stripe.num_threads = 0;
+}
+
+/* One worker per member of the set being opened */
+static int stripe_start(int count)
+{
+	stripe.stop = 0;
+	for (int m = 0; m < count; m++) {
+		pthread_cond_init(&stripe.work[m], NULL);
+		if (pthread_create(&stripe.threads[m], NULL, stripe_worker,
+				   (void *)(intptr_t)m)) {
+			pthread_cond_destroy(&stripe.work[m]);
+			stripe_stop();
+			block_error("cannot start the stripe workers");
+			return -1;
+		}
+		stripe.num_threads++;
+	}
+	return 0;
+}
+
+/* Run @count jobs on different members, the first one in the calling thread */
+static int stripe_submit(struct stripe_job *jobs, int count)
+{
+	int pending = count - 1, ret;
+
+	if (count > 1) {
+		pthread_mutex_lock(&stripe.lock);
+		for (int i = 1; i < count; i++) {
+			int m = jobs[i].member;
+			jobs[i].next = NULL;
+			jobs[i].pending = &pending;
+			if (stripe.tail[m])
+				stripe.tail[m]->next = &jobs[i];
+			else
+				stripe.head[m] = &jobs[i];
+			stripe.tail[m] = &jobs[i];
+			pthread_cond_signal(&stripe.work[m]);
+		}
+		pthread_mutex_unlock(&stripe.lock);
+	}
+
+	ret = stripe_run(&jobs[0]);
+
+	if (count > 1) {
+		pthread_mutex_lock(&stripe.lock);
+		while (pending)
+			pthread_cond_wait(&stripe.done, &stripe.lock);
+		pthread_mutex_unlock(&stripe.lock);
+		for (int i = 1; i < count; i++)
+			if (jobs[i].ret)
+				ret = -1;
+	}
+	return ret;
+}
+
+/* Move @len bytes between @buf and the stripe set at @off */
+static int stripe_xfer(char *buf, size_t len, off_t off, int writing)
+{
+	struct stripe_job jobs[BLOCK_STRIPE_MAX];
+	int n = disk.num_members;
+
+	while (len > 0) {
+		int slot[BLOCK_STRIPE_MAX], num_jobs = 0;
+
+		for (int m = 0; m < n; m++)
+			slot[m] = -1;
+		/* Consecutive stripes of a member are contiguous in it */
+		while (len > 0) {
+			off_t stripe_nr = off / disk.unit;
+			size_t in = off % disk.unit;
+			size_t piece = len < disk.unit - in ? len : disk.unit - in;
+			int m = stripe_nr % n;
+
+			if (slot[m] == -1) {
+				slot[m] = num_jobs++;
+				jobs[slot[m]].member = m;
+				jobs[slot[m]].op = writing ? STRIPE_WRITE : STRIPE_READ;
+				jobs[slot[m]].iovcnt = 0;
+				jobs[slot[m]].off = stripe_nr / n * disk.unit + in;
+			}
+			struct stripe_job *job = &jobs[slot[m]];
+			if (job->iovcnt == STRIPE_IOV)
+				break;
+			job->iov[job->iovcnt++] = (struct iovec){ buf, piece };
+			buf += piece;
+			off += piece;
+			len -= piece;
+		}
+		if (stripe_submit(jobs, num_jobs))
+			return -1;
+	}
+	return 0;
+}
+
+void *block_buf_alloc(size_t count)
+{
+	void *buf;
+
+	if (stats_memalign(&buf, BLOCK_SIZE, count * disk.bsize))
+		return NULL;
+	return buf;
+}
+
+int block_disk_open(const char *diskname)
+{
+	return block_disk_open_flags(diskname, 0);
+}
+
+int block_disk_open_flags(const char *diskname, int flags)
+{
+	struct stripe_set *set;
 	struct stat st;
+	int oflags = O_RDWR;
+	int count, is_set, opened = 0;
+	off_t sizes[BLOCK_STRIPE_MAX], total = 0;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
@@ -39,26 +503,172 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
-		perror("open");
+	if (flags & BLOCK_DISK_DIRECT)
+		oflags |= O_DIRECT;
+
+	if (!(set = stats_malloc(sizeof(*set)))) {
+		block_error("cannot allocate stripe set");
 		return -1;
 	}
+	if ((is_set = stripe_parse(diskname, set)) == -1)
+		goto error;
+	count = is_set ? set->count : 1;
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
-		return -1;
+	for (; opened < count; opened++) {
+		const char *path = is_set ? set->paths[opened] : diskname;
+
+		if ((disk.fds[opened] = open(path, oflags, 0644)) < 0) {
+			if (errno == EINVAL && (flags & BLOCK_DISK_DIRECT))
+				block_error("'%s' does not support O_DIRECT", path);
+			else
+				perror("open");
+			goto error;
+		}
+
+		if (fstat(disk.fds[opened], &st)) {
+			perror("fstat");
+			close(disk.fds[opened]);
+			goto error;
+		}
+		sizes[opened] = st.st_size;
+		total += st.st_size;
+	}
+
+	/* Members hold their share of the stripes, as block_disk_create()
+	 sized them */
+	for (int i = 0; is_set && i < count; i++) {
+		if (sizes[i] != stripe_member_bytes(total, set->unit, count, i)) {
+			block_error("member '%s' does not match stripe set '%s'",
+				    set->paths[i], diskname);
+			goto error;
+		}
 	}
 
 	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
+	if (total % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+			    (size_t)total, BLOCK_SIZE);
+		goto error;
+	}
+
+	if (flags & BLOCK_DISK_DIRECT) {
+		for (int i = 0; i < POOL_BUFS; i++) {
+			if (stats_memalign(&pool.bufs[i], BLOCK_SIZE, POOL_BYTES)) {
+				pool.bufs[i] = NULL;
+				block_error("cannot allocate bounce buffers");
+				pool_free();
+				goto error;
+			}
+		}
+	}
+
+	if (count > 1 && stripe_start(count)) {
+		pool_free();
+		goto error;
+	}
+
+	disk.fd = disk.fds[0];
+	disk.num_members = count;
+	disk.unit = is_set ? set->unit : 0;
+	disk.bytes = total;
+	disk.bcount = total / BLOCK_SIZE;
+	disk.direct = !!(flags & BLOCK_DISK_DIRECT);
+	free(set);
+
+	return 0;
+
+error:
+	while (opened > 0)
+		close(disk.fds[--opened]);
+	free(set);
+	return -1;
+}
+
+/* Create (or truncate) image @path of @bytes bytes */
+static int image_create(const char *path, off_t bytes, int preallocate)
+{
+	int fd, ret;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Only the size is set, the blocks read as zeros until written */
+	if (ftruncate(fd, bytes) < 0) {
+		perror("ftruncate");
+		close(fd);
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	if (preallocate && bytes > 0 &&
+	    (ret = posix_fallocate(fd, 0, bytes)) != 0) {
+		block_error("posix_fallocate: error %d", ret);
+		close(fd);
+		return -1;
+	}
 
+	close(fd);
+	return 0;
+}
+
+int block_disk_create(const char *diskname, size_t bcount, int preallocate)
+{
+	struct stripe_set *set;
+	off_t total = (off_t)bcount * BLOCK_SIZE;
+	int is_set, ret = 0;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (!(set = stats_malloc(sizeof(*set)))) {
+		block_error("cannot allocate stripe set");
+		return -1;
+	}
+	is_set = stripe_parse(diskname, set);
+	if (is_set == 0)
+		ret = image_create(diskname, total, preallocate);
+	/* A stripe set file stays, its members are created instead */
+	for (int i = 0; is_set == 1 && ret == 0 && i < set->count; i++)
+		ret = image_create(set->paths[i],
+				   stripe_member_bytes(total, set->unit,
+						       set->count, i),
+				   preallocate);
+	free(set);
+	return is_set == -1 ? -1 : ret;
+}
+
+int block_stripe_create(const char *setname, const char *const *members,
+			int count, size_t unit)
+{
+	FILE *f;
+
+	if (!setname || !members || count < 1 || count > BLOCK_STRIPE_MAX ||
+	    unit == 0 || unit % BLOCK_SIZE) {
+		block_error("invalid stripe set");
+		return -1;
+	}
+	for (int i = 0; i < count; i++) {
+		if (!members[i] || members[i][0] == '\0' ||
+		    strchr(members[i], '\n') || strlen(members[i]) >= PATH_MAX) {
+			block_error("invalid member name");
+			return -1;
+		}
+	}
+
+	if (!(f = fopen(setname, "w"))) {
+		perror("fopen");
+		return -1;
+	}
+	fprintf(f, "%s %zu\n", BLOCK_STRIPE_MAGIC, unit);
+	for (int i = 0; i < count; i++)
+		fprintf(f, "%s\n", members[i]);
+	if (fclose(f)) {
+		perror("fclose");
+		return -1;
+	}
 	return 0;
 }
 
@@ -69,13 +679,79 @@ int block_disk_close(void)
 		return -1;
 	}
 
-	close(disk.fd);
+	if (disk.num_members > 1)
+		stripe_stop();
+	for (int i = 0; i < disk.num_members; i++)
+		close(disk.fds[i]);
+	pool_free();
 
 	disk.fd = INVALID_FD;
+	disk.num_members = 0;
+	disk.unit = 0;
+	disk.direct = 0;
+	disk.bsize = BLOCK_SIZE;
+	disk.bshift = 12;
+
+	return 0;
+}
+
+int block_disk_set_block_size(size_t size)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (size < BLOCK_SIZE || size > BLOCK_SIZE_MAX || (size & (size - 1))) {
+		block_error("invalid block size '%zu'", size);
+		return -1;
+	}
+
+	if (disk.bytes % size != 0) {
+		block_error("size '%zu' is not multiple of '%zu'",
+			    (size_t)disk.bytes, size);
+		return -1;
+	}
+
+	disk.bsize = size;
+	disk.bshift = __builtin_ctzl(size);
+	disk.bcount = disk.bytes / size;
+	if (trace.hdr)
+		trace.hdr->block_size = size;
 
 	return 0;
 }
 
+size_t block_disk_block_size(void)
+{
+	return disk.bsize;
+}
+
+int block_disk_flush(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	uint64_t start = STATS_START();
+	int ret;
+	if (disk.num_members > 1) {
+		/* Every member at once */
+		struct stripe_job jobs[BLOCK_STRIPE_MAX];
+		for (int m = 0; m < disk.num_members; m++) {
+			jobs[m].member = m;
+			jobs[m].op = STRIPE_FLUSH;
+		}
+		ret = stripe_submit(jobs, disk.num_members);
+	} else if ((ret = fdatasync(disk.fd)) < 0) {
+		perror("fdatasync");
+	}
+	STATS_TIME(flush, start);
+
+	return ret < 0 ? -1 : 0;
+}
+
 int block_disk_count(void)
 {
 	if (disk.fd == INVALID_FD) {
@@ -86,6 +762,63 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
+/* Move @len bytes between @buf and the disk at @off, retrying on short
+ transfers */
+static int disk_xfer_raw(char *buf, size_t len, off_t off, int writing)
+{
+	if (disk.num_members > 1)
+		return stripe_xfer(buf, len, off, writing);
+
+	while (len > 0) {
+		ssize_t ret = writing ? pwrite(disk.fd, buf, len, off)
+				      : pread(disk.fd, buf, len, off);
+		if (ret <= 0) {
+			perror(writing ? "pwrite" : "pread");
+			return -1;
+		}
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Same, copying through an aligned bounce buffer if O_DIRECT needs one */
+static int disk_xfer(void *buf, size_t len, off_t off, int writing)
+{
+	if (!disk.direct || (uintptr_t)buf % BLOCK_SIZE == 0)
+		return disk_xfer_raw(buf, len, off, writing);
+
+	int slot = pool_get();
+	char *bounce = slot >= 0 ? pool.bufs[slot] : NULL;
+	char *p = buf;
+	int ret = 0;
+
+	if (!bounce && stats_memalign((void **)&bounce, BLOCK_SIZE, POOL_BYTES)) {
+		block_error("cannot allocate bounce buffer");
+		return -1;
+	}
+
+	while (len > 0 && ret == 0) {
+		size_t n = len < POOL_BYTES ? len : POOL_BYTES;
+		if (writing)
+			memcpy(bounce, p, n);
+		ret = disk_xfer_raw(bounce, n, off, writing);
+		if (!writing && ret == 0)
+			memcpy(p, bounce, n);
+		p += n;
+		off += n;
+		len -= n;
+	}
+
+	if (slot >= 0)
+		pool_put(slot);
+	else
+		free(bounce);
+	return ret;
+}
+
 int block_write(size_t block, const void *buf)
 {
 	if (disk.fd == INVALID_FD) {
@@ -99,19 +832,12 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
+	STATS_ADD(block_writes, 1);
+	if (trace.hdr)
+		trace_record(BLOCK_TRACE_WRITE, block, 1);
 
 	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
-		return -1;
-	}
-
-	return 0;
+	return disk_xfer((void *)buf, disk.bsize, (off_t)block << disk.bshift, 1);
 }
 
 int block_read(size_t block, void *buf)
@@ -127,18 +853,46 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	STATS_ADD(block_reads, 1);
+	if (trace.hdr)
+		trace_record(BLOCK_TRACE_READ, block, 1);
+
+	/* Perform the actual read from the disk image */
+	return disk_xfer(buf, disk.bsize, (off_t)block << disk.bshift, 0);
+}
+
+/* Transfer @count blocks starting at @block in one system call */
+static int block_rw_range(size_t block, size_t count, void *buf, int writing)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (block + count > disk.bcount) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
-	return 0;
+	if (writing)
+		STATS_ADD(block_writes, count);
+	else
+		STATS_ADD(block_reads, count);
+	if (trace.hdr)
+		trace_record(writing ? BLOCK_TRACE_WRITE : BLOCK_TRACE_READ,
+			     block, count);
+
+	return disk_xfer(buf, count << disk.bshift, (off_t)block << disk.bshift,
+			 writing);
 }
 
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	return block_rw_range(block, count, (void *)buf, 1);
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	return block_rw_range(block, count, buf, 0);
+}
@@ -2,23 +2,115 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
 
-/** Size of a disk block in bytes */
+/** Size of a disk block in bytes, until block_disk_set_block_size() */
 #define BLOCK_SIZE 4096
 
+/** Largest block size, see block_disk_set_block_size() */
+#define BLOCK_SIZE_MAX 65536
+
+/** First word of a stripe set file, see block_stripe_create() */
+#define BLOCK_STRIPE_MAGIC "BLKSTRIPE"
+
+/** Most member images of a stripe set */
+#define BLOCK_STRIPE_MAX 16
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
  *
  * Open virtual disk file @diskname. A virtual disk file must be opened before
  * blocks can be read from it with block_read() or written to it with
- * block_write().
+ * block_write(). If @diskname is a stripe set file (see block_stripe_create()),
+ * its member images are opened and make up the disk together.
  *
  * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
  * or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/** Bypass the host page cache, see block_disk_open_flags() */
+#define BLOCK_DISK_DIRECT 0x1
+
+/**
+ * block_disk_open_flags - Open virtual disk file with flags
+ * @diskname: Name of the virtual disk file
+ * @flags: Open flags
+ *
+ * Same as block_disk_open(), which is block_disk_open_flags(@diskname, 0).
+ * With %BLOCK_DISK_DIRECT, the file is opened with O_DIRECT and transfers go
+ * straight between the disk and the caller's buffer, without a copy in the
+ * host page cache. Buffers that are not aligned on %BLOCK_SIZE (see
+ * block_buf_alloc()) are copied through a small pool of aligned buffers.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * (or its file system does not support O_DIRECT) or is already open. 0
+ * otherwise.
+ */
+int block_disk_open_flags(const char *diskname, int flags);
+
+/**
+ * block_disk_flush - Flush written blocks to stable storage
+ *
+ * Wait until every block written so far is on stable storage (fdatasync), so
+ * that blocks written after it cannot reach the disk before them.
+ *
+ * Return: -1 if there was no virtual disk file opened or if the flush fails.
+ * 0 otherwise.
+ */
+int block_disk_flush(void);
+
+/**
+ * block_buf_alloc - Allocate a buffer for block transfers
+ * @count: Number of blocks
+ *
+ * Allocate @count blocks of the open disk aligned on %BLOCK_SIZE, which a
+ * disk opened with %BLOCK_DISK_DIRECT transfers without a copy. The buffer
+ * is released with free().
+ *
+ * Return: the buffer, or NULL if memory is exhausted.
+ */
+void *block_buf_alloc(size_t count);
+
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks
+ * @preallocate: Reserve the space on the host file system
+ *
+ * Create (or truncate) virtual disk file @diskname with @bcount blocks of
+ * %BLOCK_SIZE bytes, all reading as zeros. The file is sparse, so this is
+ * immediate whatever the size, unless @preallocate asks for the space to be
+ * allocated now. If @diskname is a stripe set file, it is kept and its member
+ * images are created instead, each with its share of the stripes.
+ *
+ * Return: -1 if @diskname is invalid or if the file cannot be created or
+ * sized. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount, int preallocate);
+
+/**
+ * block_stripe_create - Describe a disk striped across images
+ * @setname: Name of the stripe set file
+ * @members: Names of the member images, relative ones start from the
+ * directory of @setname
+ * @count: Number of members, up to %BLOCK_STRIPE_MAX
+ * @unit: Stripe unit in bytes, a multiple of %BLOCK_SIZE
+ *
+ * Write stripe set file @setname, which block_disk_create() and
+ * block_disk_open() then take in place of a virtual disk file. Consecutive
+ * runs of @unit bytes of the disk go to the members in turn, round robin. A
+ * transfer spanning several members is split into one vectored transfer per
+ * member, all issued in parallel, so sequential throughput adds up across
+ * members on different devices.
+ *
+ * Return: -1 if an argument is invalid or if @setname cannot be written. 0
+ * otherwise.
+ */
+int block_stripe_create(const char *setname, const char *const *members,
+			int count, size_t unit);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +118,28 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_set_block_size - Change the block size of the open disk
+ * @size: New block size in bytes
+ *
+ * Make block numbers, block counts and transfers of the open virtual disk
+ * count in blocks of @size bytes instead of %BLOCK_SIZE, until it is closed.
+ * Block 0 starts at the beginning of the file whatever the size.
+ *
+ * Return: -1 if there was no virtual disk file opened, if @size is not a
+ * power of two between %BLOCK_SIZE and %BLOCK_SIZE_MAX, or if the size of the
+ * virtual disk file is not a multiple of it. 0 otherwise.
+ */
+int block_disk_set_block_size(size_t size);
+
+/**
+ * block_disk_block_size - Get disk's block size
+ *
+ * Return: the block size in bytes of the open virtual disk, %BLOCK_SIZE if
+ * none is open.
+ */
+size_t block_disk_block_size(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -39,8 +153,8 @@ int block_disk_count(void);
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
- * block @block.
+ * Write the content of buffer @buf (one block, %BLOCK_SIZE bytes unless
+ * block_disk_set_block_size() changed it) in the virtual disk's block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
  * operation fails. 0 otherwise.
@@ -52,13 +166,109 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
- * buffer @buf.
+ * Read the content of virtual disk's block @block (one block, %BLOCK_SIZE
+ * bytes unless block_disk_set_block_size() changed it) into buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
  * operation fails. 0 otherwise.
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count blocks) in the virtual disk's
+ * blocks @block to @block + @count - 1, in a single transfer.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count blocks) into buffer @buf, in a single transfer.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible, or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/** Magic string at the start of a block I/O trace file */
+#define BLOCK_TRACE_MAGIC "BLKTRACE"
+
+/** Origin of block I/O issued outside of any file system call */
+#define BLOCK_TRACE_NO_ORIGIN 0xff
+
+/** Kind of a traced transfer */
+enum block_trace_op {
+	BLOCK_TRACE_READ,
+	BLOCK_TRACE_WRITE,
+};
+
+/** Trace file header, followed by @capacity records */
+struct block_trace_header {
+	char magic[8];
+	uint32_t block_size;
+	/* Number of record slots in the ring */
+	uint32_t capacity;
+	/* Number of records ever written. Once it passes @capacity the oldest
+	 * ones are overwritten, the next record goes to slot @head % @capacity. */
+	uint64_t head;
+};
+
+/** One traced transfer */
+struct block_trace_rec {
+	/* Time since block_trace_start(), in nanoseconds */
+	uint64_t ns;
+	/* First block and number of blocks */
+	uint32_t block;
+	uint16_t count;
+	/* enum block_trace_op */
+	uint8_t op;
+	/* enum fs_op of the file system call that issued the transfer, or
+	 * %BLOCK_TRACE_NO_ORIGIN */
+	uint8_t origin;
+};
+
+/**
+ * block_trace_start - Start recording block I/O
+ * @path: Name of the trace file
+ * @capacity: Number of records the trace file holds
+ *
+ * Create trace file @path and record every following block_read(),
+ * block_write() and range transfer into it: block number, direction,
+ * timestamp and originating file system call. The file is a ring, only the
+ * last @capacity transfers are kept. Records go to a shared mapping of the
+ * file, so recording costs a clock read and a few stores per transfer.
+ *
+ * Return: -1 if a trace is already being recorded or if @path cannot be
+ * created. 0 otherwise.
+ */
+int block_trace_start(const char *path, size_t capacity);
+
+/**
+ * block_trace_stop - Stop recording block I/O
+ *
+ * Return: -1 if no trace is being recorded. 0 otherwise.
+ */
+int block_trace_stop(void);
+
+/**
+ * block_trace_origin - Set the origin of the next transfers
+ * @origin: Origin stored in the trace records
+ *
+ * Return: the previous origin, to be restored when the caller is done.
+ */
+int block_trace_origin(int origin);
+
 #endif /* _DISK_H */
 
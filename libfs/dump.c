@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+#include "stats.h"
+
+/*
+ * Dump stream: a header, the metadata blocks (superblock, FAT and root
+ * directory, as on disk), the data blocks in use in ascending order, and the
+ * CRC32C of everything before it. The FAT tells which data blocks are in use,
+ * so the stream carries no block list: restore reads the FAT first and knows
+ * where each block that follows goes. Free blocks are left out on both sides,
+ * they stay holes in the restored image.
+ *
+ * Restore keeps the metadata in memory until the checksum at the end of the
+ * stream has matched, and writes the superblock last: a dump cut short or
+ * corrupt leaves an image without a file system, never one whose FAT does
+ * not match its data.
+ */
+#define DUMP_MAGIC "ECSDUMP1"
+
+struct dump_header {
+	char magic[8];
+	uint32_t blk_size;
+	/* Blocks of the image, and data blocks in the stream */
+	uint32_t amt_blk;
+	uint32_t used_blk;
+	uint32_t unused;
+}__attribute__((packed));
+
+/* Data blocks moved per read or write system call */
+#define DUMP_BATCH_BYTES (1 << 20)
+
+// data block @i is in use: allocated, and not the reserved block 0
+static int dump_used(const uint16_t *fat, size_t i)
+{
+	return i != 0 && fat[i] != 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while(len > 0)
+	{
+		ssize_t ret = write(fd, p, len);
+		if(ret < 0 && errno == EINTR) continue;
+		if(ret <= 0)
+		{
+			perror("write");
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	while(len > 0)
+	{
+		ssize_t ret = read(fd, p, len);
+		if(ret < 0 && errno == EINTR) continue;
+		if(ret < 0)
+		{
+			perror("read");
+			return -1;
+		}
+		if(ret == 0)
+		{
+			fprintf(stderr, "fs_restore: truncated dump\n");
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+int fs_dump(const char *diskname, int fd)
+{
+	STATS_OP(FS_OP_DUMP);
+
+	if(super != NULL)
+	{
+		fprintf(stderr, "fs_dump: a file system is mounted\n");
+		return -1;
+	}
+	if(block_disk_open(diskname) == -1) return -1;
+
+	int status = -1;
+	uint8_t *meta = NULL, *batch = NULL;
+	if(load_super() == -1)
+	{
+		fprintf(stderr, "fs_dump: invalid superblock\n");
+		goto out;
+	}
+
+	// superblock, FAT and root directory are contiguous
+	size_t num_meta = super->data_blk_index;
+	meta = block_buf_alloc(num_meta);
+	batch = block_buf_alloc(DUMP_BATCH_BYTES / blk_size);
+	if(meta == NULL || batch == NULL) goto out;
+	if(block_read_range(0, num_meta, meta) == -1) goto out;
+	const uint16_t *fat = (const uint16_t *)(meta + blk_size);
+
+	struct dump_header hdr = { .blk_size = blk_size, .amt_blk = super->amt_blk };
+	memcpy(hdr.magic, DUMP_MAGIC, sizeof(hdr.magic));
+	for(size_t i = 0; i < super->amt_blk_data; i++)
+		hdr.used_blk += dump_used(fat, i);
+
+	uint32_t crc = crc32c(0, &hdr, sizeof(hdr));
+	crc = crc32c(crc, meta, num_meta * blk_size);
+	if(write_all(fd, &hdr, sizeof(hdr)) == -1 ||
+	   write_all(fd, meta, num_meta * blk_size) == -1)
+		goto out;
+
+	// runs of used blocks fill the batch in physical order, each run with
+	// one read, then the batch goes out with one write
+	size_t batch_blk = DUMP_BATCH_BYTES / blk_size, filled = 0;
+	size_t i = 0;
+	while(i < super->amt_blk_data)
+	{
+		if(!dump_used(fat, i))
+		{
+			i++;
+			continue;
+		}
+		size_t run = 1;
+		while(i + run < super->amt_blk_data && dump_used(fat, i + run) &&
+		      filled + run < batch_blk)
+			run++;
+		if(block_read_range(super->data_blk_index + i, run,
+				    batch + filled * blk_size) == -1)
+			goto out;
+		filled += run;
+		i += run;
+		if(filled == batch_blk)
+		{
+			crc = crc32c(crc, batch, filled * blk_size);
+			if(write_all(fd, batch, filled * blk_size) == -1) goto out;
+			filled = 0;
+		}
+	}
+	if(filled)
+	{
+		crc = crc32c(crc, batch, filled * blk_size);
+		if(write_all(fd, batch, filled * blk_size) == -1) goto out;
+	}
+	status = write_all(fd, &crc, sizeof(crc));
+
+out:
+	free(meta);
+	free(batch);
+	free_meta();
+	block_disk_close();
+	return status;
+}
+
+int fs_restore(int fd, const char *diskname)
+{
+	STATS_OP(FS_OP_RESTORE);
+
+	if(super != NULL)
+	{
+		fprintf(stderr, "fs_restore: a file system is mounted\n");
+		return -1;
+	}
+
+	struct dump_header hdr;
+	if(read_all(fd, &hdr, sizeof(hdr)) == -1) return -1;
+	if(memcmp(hdr.magic, DUMP_MAGIC, sizeof(hdr.magic)) ||
+	   hdr.blk_size < BLOCK_SIZE || hdr.blk_size > BLOCK_SIZE_MAX ||
+	   (hdr.blk_size & (hdr.blk_size - 1)) || hdr.amt_blk == 0 ||
+	   hdr.amt_blk > UINT16_MAX)
+	{
+		fprintf(stderr, "fs_restore: not a dump\n");
+		return -1;
+	}
+	uint32_t crc = crc32c(0, &hdr, sizeof(hdr));
+	size_t size = hdr.blk_size;
+
+	// the superblock gives the size of the rest of the metadata
+	SuperBlock *sb = stats_malloc(size);
+	uint8_t *meta = NULL, *batch = NULL;
+	int status = -1, opened = 0;
+	if(sb == NULL) return -1;
+	if(read_all(fd, sb, size) == -1) goto out;
+	crc = crc32c(crc, sb, size);
+	size_t num_meta = sb->data_blk_index;
+	if(memcmp(sb->sig, SIGNATURE, sizeof(sb->sig)) || sb->amt_blk != hdr.amt_blk ||
+	   num_meta < 3 || num_meta >= hdr.amt_blk ||
+	   sb->amt_blk_data != hdr.amt_blk - num_meta ||
+	   (num_meta - 2) * (size / 2) < sb->amt_blk_data)
+	{
+		fprintf(stderr, "fs_restore: invalid superblock\n");
+		goto out;
+	}
+
+	if(block_disk_create(diskname, hdr.amt_blk * (size / BLOCK_SIZE), 0) == -1 ||
+	   block_disk_open(diskname) == -1)
+		goto out;
+	opened = 1;
+	if(block_disk_set_block_size(size) == -1) goto out;
+
+	meta = block_buf_alloc(num_meta);
+	batch = block_buf_alloc(DUMP_BATCH_BYTES / size);
+	if(meta == NULL || batch == NULL) goto out;
+	memcpy(meta, sb, size);
+	if(read_all(fd, meta + size, (num_meta - 1) * size) == -1) goto out;
+	crc = crc32c(crc, meta + size, (num_meta - 1) * size);
+	const uint16_t *fat = (const uint16_t *)(meta + size);
+
+	size_t used = 0;
+	for(size_t i = 0; i < sb->amt_blk_data; i++)
+		used += dump_used(fat, i);
+	if(used != hdr.used_blk)
+	{
+		fprintf(stderr, "fs_restore: FAT does not match the dump\n");
+		goto out;
+	}
+
+	// the next batch of used blocks comes in with one read, then each run
+	// of it goes to the disk with one write
+	size_t batch_blk = DUMP_BATCH_BYTES / size, i = 0;
+	while(used > 0)
+	{
+		size_t count = used < batch_blk ? used : batch_blk;
+		if(read_all(fd, batch, count * size) == -1) goto out;
+		crc = crc32c(crc, batch, count * size);
+		used -= count;
+
+		for(size_t done = 0; done < count; )
+		{
+			while(!dump_used(fat, i)) i++;
+			size_t run = 1;
+			while(done + run < count && i + run < sb->amt_blk_data &&
+			      dump_used(fat, i + run))
+				run++;
+			if(block_write_range(num_meta + i, run, batch + done * size) == -1)
+				goto out;
+			done += run;
+			i += run;
+		}
+	}
+
+	uint32_t expected;
+	if(read_all(fd, &expected, sizeof(expected)) == -1) goto out;
+	if(expected != crc)
+	{
+		fprintf(stderr, "fs_restore: checksum mismatch\n");
+		goto out;
+	}
+	// the superblock only reaches the disk after what it describes
+	if(block_write_range(1, num_meta - 1, meta + size) == -1 ||
+	   block_disk_flush() == -1 || block_write(0, meta) == -1)
+		goto out;
+	status = block_disk_flush();
+
+out:
+	free(sb);
+	free(meta);
+	free(batch);
+	if(opened) block_disk_close();
+	return status;
+}
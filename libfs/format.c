@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+#include "stats.h"
+
+int fs_format(const char *diskname, const struct fs_format_opts *opts)
+{
+	STATS_OP(FS_OP_FORMAT);
+
+	if(super != NULL || opts == NULL)
+	{
+		fprintf(stderr, "fs_format: no options or a file system is mounted\n");
+		return -1;
+	}
+
+	size_t size = opts->block_size ? opts->block_size : BLOCK_SIZE;
+	if(size < BLOCK_SIZE || size > BLOCK_SIZE_MAX || (size & (size - 1)))
+	{
+		fprintf(stderr, "fs_format: invalid block size\n");
+		return -1;
+	}
+
+	// the FAT indexes data blocks on 16 bits, FAT_EOC excluded
+	int amt_blk_FAT = fat_blk_count(opts->data_blocks, size) + opts->fat_reserve;
+
+	// data blocks that (nearly) fill the last FAT block leave no entry
+	// for holes, take one more block for them if the format allows it
+	size_t entries = MIN(amt_blk_FAT * (size / 2), (size_t)FAT_EOC);
+	if(entries < opts->data_blocks + HOLE_MIN && entries < FAT_EOC &&
+	   amt_blk_FAT < UINT8_MAX &&
+	   opts->data_blocks + amt_blk_FAT + 3 <= UINT16_MAX)
+		amt_blk_FAT++;
+	size_t amt_blk = opts->data_blocks + amt_blk_FAT + 2;
+	if(opts->data_blocks == 0 || opts->data_blocks >= FAT_EOC ||
+	   opts->fat_reserve < 0 || amt_blk_FAT > UINT8_MAX || amt_blk > UINT16_MAX)
+	{
+		fprintf(stderr, "fs_format: invalid geometry\n");
+		return -1;
+	}
+
+	if(block_disk_create(diskname, amt_blk * (size / BLOCK_SIZE),
+			     opts->preallocate) == -1 ||
+	   block_disk_open(diskname) == -1)
+		return -1;
+
+	// superblock, then the FAT and the root directory right after it, each
+	// in a whole block
+	SuperBlock *sb = NULL;
+	uint16_t *fat_blk = NULL;
+	RootDirectory *dir = NULL;
+	int status = -1;
+	if(block_disk_set_block_size(size) == -1) goto out;
+	sb = block_buf_alloc(1);
+	fat_blk = block_buf_alloc(1);
+	dir = block_buf_alloc(1);
+	if(sb == NULL || fat_blk == NULL || dir == NULL) goto out;
+	memset(sb, 0, size);
+	memset(fat_blk, 0, size);
+	memset(dir, 0, size);
+
+	memcpy(sb->sig, SIGNATURE, sizeof(sb->sig));
+	sb->amt_blk = amt_blk;
+	sb->amt_blk_FAT = amt_blk_FAT;
+	sb->root_dir_index = amt_blk_FAT + 1;
+	sb->data_blk_index = amt_blk_FAT + 2;
+	sb->amt_blk_data = opts->data_blocks;
+	sb->blk_size = size;
+
+	// a fresh image is clean, its first mount needs no FAT scan
+	sb->sum_version = SUM_VERSION;
+	sb->sum_flags = SUM_CLEAN;
+	sb->free_blk = opts->data_blocks - 1;
+	sb->free_dirent = FS_FILE_MAX_COUNT;
+	sb->next_free = 1;
+	for(size_t i = 1; i < opts->data_blocks; i++)
+		sb->region_free[i / (size / 2)]++;
+
+	// data block 0 is never allocated, its entry ends no chain
+	fat_blk[0] = FAT_EOC;
+	for(int i = 0; i < amt_blk_FAT; i++)
+	{
+		if(block_write(i + 1, fat_blk) == -1) goto out;
+		fat_blk[0] = 0;
+	}
+
+	if(block_write(sb->root_dir_index, dir) == -1) goto out;
+	if(block_write(0, sb) == -1) goto out;
+	status = 0;
+
+out:
+	free(sb);
+	free(fat_blk);
+	free(dir);
+	block_disk_close();
+
+	// the checksum table is created by the first mount asking for it
+	if(status == 0 && opts->csum)
+	{
+		struct fs_mount_opts mount = { .csum = 1 };
+		if(fs_mount_opts(diskname, &mount) == -1 || fs_umount() == -1)
+			status = -1;
+	}
+	return status;
+}
@@ -1,5 +1,8 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -7,88 +10,96 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "crc32c.h"
 #include "disk.h"
 #include "fs.h"
+#include "fs_internal.h"
+#include "stats.h"
 
 
 #define FILE_SIZE 4
-#define FAT_EOC 0xFFFF
-
-enum type {FAT,ROOT,CURR_FILE,FREE_FD};
-
-/*
- * 								*
- * Superblock:							*
- * - Using "__attribute__" to pack data	so that	insist particu-	*
- *   lar sized padding, also avoid meaningless bytes allocated	*
- * - Superblock contains 7 pieces of data: Signature, total amt *
- *   of blocks of virtual disk, root dir block index, data block*
- *   start index, amt of data blocks, num of blocks for FAT, as	*
- *   well as unused/padding.					*
- *   								*
- */
-
-// attribute ref: 
-typedef struct {
-	uint8_t sig[8];
-	uint16_t amt_blk;
-	uint16_t root_dir_index;
-	uint16_t data_blk_index;
-	uint16_t amt_blk_data;
-	uint8_t amt_blk_FAT;
-	uint8_t unused[4079];
-}__attribute__((packed)) SuperBlock;
-
-uint16_t *fat;
-
-/*	Root Directory 		*/
-typedef struct {
-	uint8_t fileName[FS_FILENAME_LEN];
-	uint32_t size;
-	uint16_t first_data_blk_index;
-	uint8_t unused[10];
-}__attribute__((packed)) RootDirectory;
-
-/*	File Descriptor		*/
-typedef struct {
-	size_t offset;
-	uint8_t fileName[FS_FILENAME_LEN];
-	uint16_t index;
-} FileDescriptor;
+
+/* Descriptors are allocated FD_CHUNK at a time as more get open and never
+ move, so that the workers of aio.c can look them up while fs_open() and
+ fs_close() run. Free ones are chained from fd_free, which only the thread
+ opening and closing descriptors touches. The first chunk is set up at mount,
+ the bounce block of a descriptor when it is first opened. */
+#define FD_CHUNK 256
+static FileDescriptor *fd_chunks[FS_OPEN_MAX_COUNT / FD_CHUNK];
+static int fd_capacity;
+static int fd_free = -1;
+/* Open file objects, by root dir entry */
+static struct open_file open_files[FS_FILE_MAX_COUNT];
 
 SuperBlock *super;
+uint16_t **fat_pages;
+uint8_t *fat_dirty;
 RootDirectory *root_dir;
-FileDescriptor fd_arr[FS_OPEN_MAX_COUNT];
+size_t blk_size = BLOCK_SIZE;
+int blk_shift = 12;
+
+/* Source for clearing blocks on disk */
+static const uint8_t zero_blk[BLOCK_SIZE_MAX];
+
+uint32_t *csum_tab;
+struct fs_mount_opts mount_opts;
+unsigned int verify_count;
 
 
 
 /* helper functions section */
 
-/* https://stackoverflow.com/questions/3437404/min-and-max-in-c */
- #define MIN(a,b) \
-   ({ __typeof__ (a) _a = (a); \
-       __typeof__ (b) _b = (b); \
-     _a < _b ? _a : _b; })
+// record the checksum of data block @index after writing @data to it
+void csum_update(uint16_t index, const void *data)
+{
+	if(csum_tab == NULL) return;
+	csum_tab[index] = crc32c(0, data, blk_size);
+}
 
- #define MAX(a,b) \
-   ({ __typeof__ (a) _a = (a); \
-       __typeof__ (b) _b = (b); \
-     _a > _b ? _a : _b; })
+// check @data just read from data block @index, -1 on mismatch
+int csum_verify(uint16_t index, const void *data)
+{
+	if(csum_tab == NULL || csum_tab[index] == 0) return 0;
+	switch(mount_opts.verify)
+	{
+		case FS_VERIFY_NEVER:
+			return 0;
+		case FS_VERIFY_SAMPLED:
+			if(__atomic_fetch_add(&verify_count, 1, __ATOMIC_RELAXED) %
+			   mount_opts.sample_rate != 0) return 0;
+			break;
+		case FS_VERIFY_ALWAYS:
+			break;
+	}
+	if(crc32c(0, data, blk_size) != csum_tab[index])
+	{
+		fprintf(stderr, "checksum mismatch in data block %d\n", index);
+		return -1;
+	}
+	return 0;
+}
 
 // Follow the fat table and clear all data
 int remove_file(int index)
 {
 	if(index >= FS_FILE_MAX_COUNT) return -1;
-	uint16_t curr, temp;
-	curr = root_dir[index].first_data_blk_index;
 	root_dir[index].fileName[0] = '\0';
-	while(curr != FAT_EOC)
+	// blocks shared with a copy stay with it
+	chain_release(root_dir[index].first_data_blk_index);
+	return 0;
+}
+
+// whether @filename can name a file: not empty, and leaving room for the
+// NULL character in a root dir entry
+int name_valid(const char *filename)
+{
+	if(filename == NULL || filename[0] == '\0' ||
+	   strlen(filename) >= FS_FILENAME_LEN)
 	{
-		temp = fat[curr];
-		fat[curr] = 0;
-		curr = temp;
+		perror("filename too short/long\n");
+		return 0;
 	}
-	return 0;
+	return 1;
 }
 
 // return the first free index in root dir, fat table, file descriptor
@@ -96,7 +107,6 @@ int remove_file(int index)
 int get_index(enum type t, const char* file)
 {
 	int index = -1;
-	int i = 0;
 	switch(t)
 	{
 		case ROOT:
@@ -112,16 +122,8 @@ int get_index(enum type t, const char* file)
 			break;
 			
 		case FAT:
-			for(int i = 0; i < super->amt_blk_data; i++)
-			{
-				if(fat[i] != 0){continue;}
-				else
-				{
-					fat[i] = FAT_EOC;
-					index = i;
-					break;
-				}
-			}
+			// in the allocation group of the calling thread
+			index = alloc_block(FAT_EOC);
 			break;
 		
 		case CURR_FILE:
@@ -134,39 +136,307 @@ int get_index(enum type t, const char* file)
 				}
 			}
 			break;
+	}
+	return index;
+}
 
-		case FREE_FD:
-			while(i < FS_OPEN_MAX_COUNT)
-			{
-				char file_ch = fd_arr[i].fileName[0];
-				if(file_ch == '\0')
-				{
-					index = i;
-					break;
-				}
-				i++;
-			}
+FileDescriptor *fd_get(int fd)
+{
+	if(fd < 0 || fd >= FS_OPEN_MAX_COUNT) return NULL;
+	FileDescriptor *chunk = __atomic_load_n(&fd_chunks[fd / FD_CHUNK],
+						__ATOMIC_ACQUIRE);
+	return chunk ? &chunk[fd % FD_CHUNK] : NULL;
+}
+
+// add a chunk of free descriptors
+static int fd_grow(void)
+{
+	if(fd_capacity == FS_OPEN_MAX_COUNT) return -1;
+	FileDescriptor *chunk = stats_calloc(FD_CHUNK, sizeof(*chunk));
+	assert(chunk);
+	// the lowest descriptors come first
+	for(int i = FD_CHUNK - 1; i >= 0; i--)
+	{
+		chunk[i].next_free = fd_free;
+		fd_free = fd_capacity + i;
+	}
+	__atomic_store_n(&fd_chunks[fd_capacity / FD_CHUNK], chunk,
+			 __ATOMIC_RELEASE);
+	fd_capacity += FD_CHUNK;
+	return 0;
+}
+
+// take the free descriptor at the head of the list, adding a chunk if needed
+static int fd_alloc(void)
+{
+	if(fd_free == -1 && fd_grow() == -1) return -1;
+	int fd = fd_free;
+	fd_free = fd_get(fd)->next_free;
+	return fd;
+}
+
+// runs of the chain of @f, walked once until the chain changes
+static void extents_build(struct open_file *f)
+{
+	uint32_t blk = 0;
+
+	f->num_extents = 0;
+	for(uint16_t curr = root_dir[f->dirent].first_data_blk_index;
+	    curr != FAT_EOC; curr = fat_get(curr), blk++)
+	{
+		struct extent *e = f->num_extents ? &f->extents[f->num_extents - 1] : NULL;
+		if(e && e->start + e->len == curr && e->len < UINT16_MAX)
+		{
+			e->len++;
+			continue;
+		}
+		if(f->num_extents == f->max_extents)
+		{
+			f->max_extents = MAX(f->max_extents * 2, (size_t)16);
+			f->extents = stats_realloc(f->extents,
+					     f->max_extents * sizeof(struct extent));
+			assert(f->extents);
+		}
+		f->extents[f->num_extents++] = (struct extent){ blk, curr, 1 };
+	}
+	STATS_ADD(fat_walk_steps, blk);
+	f->extents_valid = 1;
+}
+
+uint16_t extent_lookup(struct open_file *f, size_t blk)
+{
+	if(!f->extents_valid) extents_build(f);
+
+	// last run starting at or before @blk
+	size_t lo = 0, hi = f->num_extents;
+	while(lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if(f->extents[mid].blk <= blk) lo = mid + 1;
+		else hi = mid;
+	}
+	if(lo == 0) return FAT_EOC;
+	struct extent *e = &f->extents[lo - 1];
+	return blk < e->blk + e->len ? e->start + (blk - e->blk) : FAT_EOC;
+}
+
+// last block of the chain of @f, FAT_EOC if empty
+static uint16_t extent_tail(struct open_file *f)
+{
+	if(!f->extents_valid) extents_build(f);
+	if(f->num_extents == 0) return FAT_EOC;
+	struct extent *e = &f->extents[f->num_extents - 1];
+	return e->start + e->len - 1;
+}
+
+void extents_drop(int dirent)
+{
+	open_files[dirent].extents_valid = 0;
+}
+
+// return the last block of the chain starting at @first, or FAT_EOC if empty
+uint16_t get_chain_tail(uint16_t first)
+{
+	uint16_t curr = first;
+	if(curr == FAT_EOC) return FAT_EOC;
+	while(fat_get(curr) != FAT_EOC)
+	{
+		curr = fat_get(curr);
+		STATS_ADD(fat_walk_steps, 1);
+	}
+	return curr;
+}
+
+// grab a spare FAT entry to stand for a hole, -1 if the FAT has none left
+int get_hole_index(void)
+{
+	static pthread_mutex_t hole_lock = PTHREAD_MUTEX_INITIALIZER;
+	int amt = MIN(super->amt_blk_FAT*FAT_PER_BLK, (size_t)FAT_EOC);
+	int index = -1;
+
+	pthread_mutex_lock(&hole_lock);
+	for(int i = super->amt_blk_data; i < amt; i++)
+	{
+		if(fat_get(i) == 0)
+		{
+			fat_set(i, FAT_EOC);
+			index = i;
 			break;
+		}
 	}
+	pthread_mutex_unlock(&hole_lock);
 	return index;
 }
 
-/* function that returns the index of the DB corresponding
- to the fd’s offset          						*/
-int get_DBindex_offset(int fd)
+// number of spare FAT entries still free to stand for holes
+int get_hole_count(void)
 {
-	enum type t = CURR_FILE;
-	int root_index = get_index(t, (const char *)fd_arr[fd].fileName);
-	if (root_index == -1) {
-		perror("get_root_index failed");
-		exit(1);
+	int amt = MIN(super->amt_blk_FAT*FAT_PER_BLK, (size_t)FAT_EOC);
+	int count = 0;
+
+	for(int i = super->amt_blk_data; i < amt; i++)
+	{
+		if(fat_get(i) == 0) count++;
 	}
+	return count;
+}
+
+/* Undo the blocks fill_gap() appended to file @root_index after @tail, its
+ last block before (FAT_EOC if it had none) */
+static void gap_undo(int root_index, uint16_t tail)
+{
+	uint16_t first;
+
+	if (tail == FAT_EOC) {
+		first = root_dir[root_index].first_data_blk_index;
+		root_dir[root_index].first_data_blk_index = FAT_EOC;
+	} else {
+		first = fat_get(tail);
+		fat_set(tail, FAT_EOC);
+	}
+	chain_release(first);
+	extents_drop(root_index);
+}
+
+/* Make the bytes between the current end of file and @to read as zeros:
+ clear them in the blocks the chain already holds (reserved or partially
+ used ones), then append holes until the chain has @num_blk blocks. When the
+ FAT has no spare entry left, a zeroed data block stands in for the hole.
+ @bounce_buf holds a block for the partial ones. On failure the chain is left
+ as long as it was. */
+int fill_gap(int root_index, size_t to, size_t num_blk, void *bounce_buf)
+{
+	size_t from = root_dir[root_index].size;
+	uint16_t prev = FAT_EOC;
+	size_t blk = 0;
+
+	/* Blocks are cleared and the tail is extended, none may be shared */
+	if (chain_unshare(root_index, SIZE_MAX, bounce_buf) == -1)
+		return -1;
+	extents_drop(root_index);
 	uint16_t curr = root_dir[root_index].first_data_blk_index;
-	size_t num_offset_block = fd_arr[fd].offset / BLOCK_SIZE;
 
-	for (size_t i = 0; i < num_offset_block; i++)
-		curr = fat[curr];
-	return curr;
+	for (; curr != FAT_EOC; prev = curr, curr = fat_get(curr), blk++) {
+		size_t start = blk << blk_shift;
+		STATS_ADD(fat_walk_steps, 1);
+		if (start + blk_size <= from || start >= to || IS_HOLE(curr))
+			continue;
+
+		size_t lo = MAX(from, start) - start;
+		size_t hi = MIN(to, start + blk_size) - start;
+		if (lo == 0 && hi == blk_size) {
+			if (block_write(super->data_blk_index + curr, zero_blk) == -1)
+				return -1;
+			csum_update(curr, zero_blk);
+		} else {
+			if (block_read(super->data_blk_index + curr, bounce_buf) == -1)
+				return -1;
+			STATS_ADD(rmw, 1);
+			memset(bounce_buf + lo, 0, hi - lo);
+			if (block_write(super->data_blk_index + curr, bounce_buf) == -1)
+				return -1;
+			csum_update(curr, bounce_buf);
+		}
+	}
+	if (blk >= num_blk)
+		return 0;
+
+	/* Every hole needs a spare entry or a data block, check before linking
+	 any of them */
+	if (num_blk - blk > (size_t)get_hole_count() + alloc_free_count()) {
+		perror("not enough free blocks\n");
+		return -1;
+	}
+
+	uint16_t tail = prev;
+	for (; blk < num_blk; blk++) {
+		int index = get_hole_index();
+		if (index == -1) {
+			enum type t = FAT;
+			index = get_index(t, "_placeholder");
+			/* Taken by another writer since the check */
+			if (index == -1) {
+				gap_undo(root_index, tail);
+				return -1;
+			}
+			if (block_write(super->data_blk_index + index, zero_blk) == -1) {
+				fat_set(index, 0);
+				gap_undo(root_index, tail);
+				return -1;
+			}
+			csum_update(index, zero_blk);
+		}
+
+		if (prev == FAT_EOC)
+			root_dir[root_index].first_data_blk_index = index;
+		else
+			fat_set(prev, index);
+		prev = index;
+	}
+	return 0;
+}
+
+// count the blocks in the chain starting at @first
+size_t get_chain_len(uint16_t first)
+{
+	size_t len = 0;
+	for(uint16_t curr = first; curr != FAT_EOC; curr = fat_get(curr))
+		len++;
+	STATS_ADD(fat_walk_steps, len);
+	return len;
+}
+
+/* Find @count contiguous free FAT entries, starting the search at @hint so
+ that an extension lands right after the existing tail when possible. Return
+ the first entry of the run or -1 if no run is long enough. */
+int get_free_run(size_t count, int hint)
+{
+	int amt = super->amt_blk_data;
+	if(count == 0 || count > (size_t)amt) return -1;
+	if(hint < 1 || hint >= amt) hint = 1;
+
+	for(int pass = 0; pass < 2; pass++)
+	{
+		int start = pass ? 1 : hint;
+		int end = pass ? hint : amt;
+		size_t run = 0;
+		for(int i = start; i < end; i++)
+		{
+			if(FAT_SLOT(i) == 0 && alloc_group_free(FAT_BLK(i)) == 0)
+			{
+				run = 0;
+				i += FAT_PER_BLK - 1;
+				continue;
+			}
+			run = fat_get(i) == 0 ? run + 1 : 0;
+			if(run == count) return i - (int)count + 1;
+		}
+	}
+	return -1;
+}
+
+/* Link @num_blk free data blocks into a new chain for a table of the file
+ system, and store its first block in @first. Return -1, taking nothing, if
+ there are not that many free blocks. */
+int chain_alloc(int num_blk, uint16_t *first)
+{
+	enum type t = FAT;
+	if(get_ratio(t) < num_blk) return -1;
+
+	// take a contiguous run when there is one
+	int run = get_free_run(num_blk, 1);
+	uint16_t prev = FAT_EOC;
+	for(int i = 0; i < num_blk; i++)
+	{
+		int index = run != -1 ? run + i : get_index(t, "_placeholder");
+		fat_set(index, FAT_EOC);
+		if(prev == FAT_EOC)
+			*first = index;
+		else
+			fat_set(prev, index);
+		prev = index;
+	}
+	return 0;
 }
 
 // counting number of free fat and free root dir
@@ -189,42 +459,91 @@ int get_ratio(enum type r)
 			break;
 
 		case FAT:
-			count = 0;
-			for(int i = 0; i < super->amt_blk_data; i++)
-			{
-				if(fat[i] == 0)
-				{
-					count++;
-				}
-			}
+			// kept current by fat_set(), see sum_account()
+			count = alloc_free_count();
 			break;
 
 		case CURR_FILE:
 			break;
-
-		case FREE_FD:
-			break;
 	}
 	return count;
 }
 
-// checking errors before initializing
-int init_super_check()
+// number of blocks taken by the checksum table, 4 bytes per data block
+int csum_blk_count(void)
 {
+	return (super->amt_blk_data*sizeof(uint32_t) + blk_size - 1)/blk_size;
+}
 
-	int num_fat_blk, root_index, data_index;
-	if(block_disk_count() >= 4096)
+/* Load the checksum table, or create an empty one when asked to and the
+ image has none. The table lives in a chain of data blocks of its own. */
+int csum_load(void)
+{
+	int num_blk = csum_blk_count();
+
+	csum_tab = NULL;
+	if(super->csum_blk == 0 && !mount_opts.csum) return 0;
+
+	csum_tab = block_buf_alloc(num_blk);
+	assert(csum_tab);
+	memset(csum_tab, 0, num_blk * blk_size);
+
+	if(super->csum_blk == 0)
 	{
-		num_fat_blk = block_disk_count()*2/4096;
+		uint16_t first;
+		if(chain_alloc(num_blk, &first) == -1)
+		{
+			perror("not enough free blocks for checksums\n");
+			free(csum_tab);
+			csum_tab = NULL;
+			return -1;
+		}
+		super->csum_blk = first;
+		return 0;
 	}
-	else
+
+	uint16_t curr = super->csum_blk;
+	for(int i = 0; i < num_blk && curr != FAT_EOC; i++, curr = fat_get(curr))
 	{
-		num_fat_blk = 1;
+		if(block_read(super->data_blk_index + curr,
+			      (uint8_t*)csum_tab + i*blk_size) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+// write the checksum table back to its chain
+int csum_flush(void)
+{
+	if(csum_tab == NULL) return 0;
+	uint16_t curr = super->csum_blk;
+	for(int i = 0; curr != FAT_EOC; i++, curr = fat_get(curr))
+	{
+		if(block_write(super->data_blk_index + curr,
+			       (uint8_t*)csum_tab + i*blk_size) == -1)
+			return -1;
 	}
+	return 0;
+}
+
+// number of FAT blocks needed for @amt_blk_data data blocks
+int fat_blk_count(int amt_blk_data, size_t block_size)
+{
+	return (amt_blk_data*2 + block_size - 1)/block_size;
+}
+
+// checking errors before initializing
+int init_super_check()
+{
+
+	int num_fat_blk, root_index, data_index;
+	// one FAT entry (2 bytes) per data block, rounded up to whole blocks;
+	// the formatter may reserve more for holes (spare entries)
+	num_fat_blk = super->amt_blk_FAT;
 	root_index = num_fat_blk+1;
 	data_index = num_fat_blk+2;
 
-	if(num_fat_blk == super->amt_blk_FAT &&
+	if(num_fat_blk >= fat_blk_count(super->amt_blk_data, blk_size) &&
 	   root_index == super->root_dir_index &&
 	   data_index == super->data_blk_index &&
 	   super->amt_blk_data == block_disk_count()-num_fat_blk-2)
@@ -238,14 +557,42 @@ int init_super_check()
 }
 
 
-int fs_mount(const char *diskname)
+// count the free data blocks again, reading every FAT block
+void sum_rebuild(void)
 {
-	
-	assert(block_disk_open(diskname) != -1);
-	super = malloc(sizeof(SuperBlock));
+	super->free_blk = 0;
+	super->next_free = super->amt_blk_data;
+	memset(super->region_free, 0, sizeof(super->region_free));
+	for(int i = 0; i < super->amt_blk_data; i++)
+	{
+		if(fat_get(i) != 0) continue;
+		super->free_blk++;
+		super->region_free[FAT_BLK(i)]++;
+		if(i < super->next_free) super->next_free = i;
+	}
+	super->sum_version = SUM_VERSION;
+}
+
+/* Trust the summary left by a clean unmount, otherwise rebuild it. Either way
+ the image is marked dirty on disk until the next fs_umount(). */
+int sum_load(void)
+{
+	if(super->sum_version != SUM_VERSION || !(super->sum_flags & SUM_CLEAN) ||
+	   super->free_blk >= super->amt_blk_data ||
+	   super->next_free > super->amt_blk_data)
+		sum_rebuild();
+	alloc_init();
+	super->sum_flags &= ~SUM_CLEAN;
+	return block_write(0,super);
+}
+
+// read the superblock and check that it describes the open disk
+int load_super(void)
+{
+	super = block_buf_alloc(1);
 	assert(super);
 
-	block_read(0,super);
+	if(block_read(0,super) == -1) return -1;
 
 	int i = 0;
 
@@ -258,65 +605,242 @@ int fs_mount(const char *diskname)
 		}
 		i++;
 	}
+
+	// the superblock is read in the smallest block size, switch the disk
+	// to the one it records and read it again as a whole block
+	size_t size = super->blk_size ? super->blk_size : BLOCK_SIZE;
+	if(size != BLOCK_SIZE)
+	{
+		if(block_disk_set_block_size(size) == -1) return -1;
+		free(super);
+		super = block_buf_alloc(1);
+		assert(super);
+		if(block_read(0,super) == -1) return -1;
+	}
+	blk_size = size;
+	blk_shift = __builtin_ctzl(size);
+
 	int total_blk = block_disk_count();
 	if(total_blk != super->amt_blk) return -1;
 
 	// make sure block numbers are accurate in super block
-	int status = init_super_check();
-	if(status == -1) return -1;
+	return init_super_check();
+}
 
+// read the root directory, the FAT blocks are read as they are needed
+int load_meta(void)
+{
 	// allocate memories for multiple entries of root_dir
-	root_dir = (RootDirectory*)malloc(sizeof(RootDirectory)*FS_FILE_MAX_COUNT);
+	root_dir = block_buf_alloc(1);
 	assert(root_dir);
 
 	// read to root dir
-	block_read(super->root_dir_index,root_dir);
+	if(block_read(super->root_dir_index,root_dir) == -1) return -1;
+
+	fat_pages = stats_calloc(super->amt_blk_FAT, sizeof(*fat_pages));
+	fat_dirty = stats_calloc(super->amt_blk_FAT, sizeof(*fat_dirty));
+	assert(fat_pages && fat_dirty);
+	return 0;
+}
 
-	int index;
-	uint16_t* data;
-	fat = malloc(sizeof(uint16_t)*super->amt_blk_FAT*4096);
-	assert(fat);
-	index = 0;
-	data = malloc(sizeof(uint16_t)*4096);
-	assert(data);
+// read FAT block @blk on its first access, each holds FAT_PER_BLK entries;
+// fat_get() has no way to fail, so a FAT block that cannot be read stops the
+// process rather than let a call go on with entries it does not have
+uint16_t *fat_load_page(int blk)
+{
+	uint16_t *page = block_buf_alloc(1);
+	assert(page);
+	if(block_read(blk+1,page) == -1)
+	{
+		fprintf(stderr, "cannot read FAT block %d\n", blk);
+		abort();
+	}
+	// a concurrent writer may have loaded it first, keep that copy
+	uint16_t *loaded = NULL;
+	if(!__atomic_compare_exchange_n(&fat_pages[blk], &loaded, page, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		free(page);
+		return loaded;
+	}
+	return page;
+}
 
+// read all the FAT blocks not loaded yet, before scanning the whole FAT
+int fat_load_all(void)
+{
 	for(int i = 0; i < super->amt_blk_FAT; i++)
 	{
-		// read in single data block and check if read success
-		status = block_read(i+1,data);
-		if(status == -1) return -1;
-		// then copy to fat and increment index to the next block
-		memcpy(fat+index,data,4096);
-		index += 4096;
+		if(fat_pages[i] != NULL) continue;
+		uint16_t *page = block_buf_alloc(1);
+		assert(page);
+		if(block_read(i+1,page) == -1)
+		{
+			free(page);
+			return -1;
+		}
+		fat_pages[i] = page;
+	}
+	return 0;
+}
+
+// write back the FAT blocks changed since they were read or last written
+int write_fat(void)
+{
+	for(int i = 0; i < super->amt_blk_FAT; i++)
+	{
+		if(!fat_dirty[i]) continue;
+		// cleared first, a change made while the block is written
+		// marks it again for the next write back
+		fat_dirty[i] = 0;
+		if(block_write(i+1,fat_pages[i]) == -1)
+		{
+			fat_dirty[i] = 1;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// release what load_super(), load_meta() and csum_load() allocated
+void free_meta(void)
+{
+	alloc_exit();
+	for(int i = 0; fat_pages != NULL && i < super->amt_blk_FAT; i++)
+		free(fat_pages[i]);
+	free(csum_tab);
+	free(ref_tab);
+	free(fat_pages);
+	free(fat_dirty);
+	free(root_dir);
+	free(super);
+	// descriptors still open go with the mount
+	for(int i = 0; i < fd_capacity; i++)
+		free(fd_get(i)->bounce);
+	for(int i = 0; i < fd_capacity / FD_CHUNK; i++)
+	{
+		free(fd_chunks[i]);
+		fd_chunks[i] = NULL;
+	}
+	fd_capacity = 0;
+	fd_free = -1;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+		free(open_files[i].extents);
+	memset(open_files, 0, sizeof(open_files));
+	csum_tab = NULL;
+	ref_tab = NULL;
+	fat_pages = NULL;
+	fat_dirty = NULL;
+	root_dir = NULL;
+	super = NULL;
+}
+
+int fs_mount(const char *diskname)
+{
+	return fs_mount_opts(diskname, NULL);
+}
+
+int fs_mount_opts(const char *diskname, const struct fs_mount_opts *opts)
+{
+	STATS_OP(FS_OP_MOUNT);
+
+	// default options: keep an existing checksum table, never verify
+	memset(&mount_opts, 0, sizeof(mount_opts));
+	if(opts) mount_opts = *opts;
+	if(mount_opts.sample_rate == 0) mount_opts.sample_rate = 1;
+	verify_count = 0;
+
+	if(block_disk_open_flags(diskname,
+				 mount_opts.direct ? BLOCK_DISK_DIRECT : 0) == -1)
+		return -1;
+
+	if(load_super() == -1 || load_meta() == -1 || sum_load() == -1 ||
+	   csum_load() == -1 || ref_load() == -1 || fd_grow() == -1 ||
+	   sync_start() == -1)
+	{
+		free_meta();
+		block_disk_close();
+		return -1;
 	}
 	return 0;
 }
 
 int fs_umount(void)
 {
-	
-	// check if we can write back super block to disk
-	assert(block_write(0,super) != -1);
-	if(block_disk_count() == -1) return -1;
+	STATS_OP(FS_OP_UMOUNT);
+
+	if(super == NULL) return -1;
+	// the workers may still be writing
+	aio_exit();
+	sync_exit();
+
+	// fs_sync() writes the superblock last, after everything it summarizes
+	super->sum_flags |= SUM_CLEAN;
+	if(fs_sync() == -1)
+	{
+		super->sum_flags &= ~SUM_CLEAN;
+		sync_start();
+		return -1;
+	}
+	assert(block_disk_close() != -1);
+	free_meta();
+	return 0;
+}
+
+// write the metadata back, see fs_sync() in sync.c
+int sync_meta(void)
+{
 	int status;
-	status = block_write(0,super);
+	status = write_fat();
 	if(status == -1) return -1;
-	status = block_write(1,fat);
+	status = block_write(super->root_dir_index,root_dir);
 	if(status == -1) return -1;
-	status = block_write(2,fat+4096);
+	status = csum_flush();
 	if(status == -1) return -1;
-	status = block_write(super->root_dir_index,root_dir);
+	status = ref_flush();
+	if(status == -1) return -1;
+	// the superblock (and its clean flag) must not reach the disk before
+	// the metadata it describes
+	status = block_disk_flush();
+	if(status == -1) return -1;
+	alloc_store();
+	super->free_dirent = get_ratio(ROOT);
+	status = block_write(0,super);
+	if(status == -1) return -1;
+	status = block_disk_flush();
 	if(status == -1) return -1;
-	assert(block_disk_close() != -1);
-	free(root_dir);
-	free(fat);
-	free(super);
 	return 0;
 }
 
-int fs_info(void)
+// append to the output of fs_info_str() and fs_ls_str(), which keep track
+// of its whole length in @len, like snprintf() does
+static void str_printf(char *buf, size_t size, size_t *len, const char *fmt, ...)
 {
-	
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = vsnprintf(*len < size ? buf + *len : NULL,
+			    *len < size ? size - *len : 0, fmt, ap);
+	va_end(ap);
+	if(ret > 0) *len += ret;
+}
+
+// print what fs_info_str() or fs_ls_str() formats
+static int str_print(int (*func)(char *, size_t))
+{
+	int len = func(NULL, 0);
+	if(len == -1) return -1;
+	char *buf = stats_malloc(len + 1);
+	assert(buf);
+	func(buf, len + 1);
+	fputs(buf, stdout);
+	free(buf);
+	return 0;
+}
+
+int fs_info_str(char *buf, size_t size)
+{
+	STATS_OP(FS_OP_INFO);
+
 	if(block_disk_count() == -1 || super == NULL)
 	{
 		return -1;
@@ -327,34 +851,34 @@ int fs_info(void)
 	t = ROOT;
 	int root_free = get_ratio(t);
 
-	// printing info
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", (int)super->amt_blk);
-	printf("fat_blk_count=%d\n", (int)super->amt_blk_FAT);
-	printf("rdir_blk=%d\n", (int)super->root_dir_index);
-	printf("data_blk=%d\n", (int)super->data_blk_index);
-	printf("data_blk_count=%d\n", (int)super->amt_blk_data);
-	printf("fat_free_ratio=%d/%d\n", fat_free, (int)super->amt_blk_data);
-	printf("rdir_free_ratio=%d/%d\n", root_free, FS_FILE_MAX_COUNT);
+	size_t len = 0;
+	if(size) buf[0] = '\0';
+	str_printf(buf, size, &len, "FS Info:\n");
+	str_printf(buf, size, &len, "total_blk_count=%d\n", (int)super->amt_blk);
+	str_printf(buf, size, &len, "fat_blk_count=%d\n", (int)super->amt_blk_FAT);
+	str_printf(buf, size, &len, "rdir_blk=%d\n", (int)super->root_dir_index);
+	str_printf(buf, size, &len, "data_blk=%d\n", (int)super->data_blk_index);
+	str_printf(buf, size, &len, "data_blk_count=%d\n", (int)super->amt_blk_data);
+	str_printf(buf, size, &len, "fat_free_ratio=%d/%d\n", fat_free,
+		   (int)super->amt_blk_data);
+	str_printf(buf, size, &len, "rdir_free_ratio=%d/%d\n", root_free,
+		   FS_FILE_MAX_COUNT);
+	str_printf(buf, size, &len, "blk_size=%zu\n", blk_size);
+	return len;
+}
 
-	return 0;
+int fs_info(void)
+{
+	return str_print(fs_info_str);
 }
 
 int fs_create(const char *filename)
 {
-	
-	if(filename == NULL)
-	{
-		return -1;
-	}
-	if(strlen(filename) <= 0)
-	{
-		perror("filename too short\n");
-		return -1;
-	}
-	if(strlen(filename) > FS_FILENAME_LEN)
+	STATS_OP(FS_OP_CREATE);
+	META_CHANGE();
+
+	if(!name_valid(filename))
 	{
-		perror("filename too long\n");
 		return -1;
 	}
 
@@ -369,57 +893,31 @@ int fs_create(const char *filename)
 	}
 
 	// if filename does not exist in root dir, get the first available
-	// free entry in root dir and fat
+	// free entry in root dir; the file starts empty, with no data block
 	const char* file = filename;
 	enum type t;
 	t = ROOT;
 	int root_index = get_index(t,file);
-	t = FAT;
-	int fat_index = get_index(t,file);
-
-	// get file size. Adapted from test_fs.c
-	int fd;
-	struct stat st;
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		perror("open");
-	if (fstat(fd, &st))
-		perror("fstat");
-	if (!S_ISREG(st.st_mode))
-		printf("Not a regular file: %s\n", filename);
-	
+
 	// if no available entries anymore, return -1
-	if(root_index == -1 || fat_index == -1)
+	if(root_index == -1)
 	{
 		return -1;
 	}
 
-	// if an empty entry is found, update new entry and modify its size
-	else
-	{
-		root_dir[root_index].size = 0;
-		strcpy((char*)root_dir[root_index].fileName,filename);
-		if (st.st_size == 0)
-			root_dir[root_index].first_data_blk_index = FAT_EOC;
-		else
-			root_dir[root_index].first_data_blk_index = fat_index;
-		close(fd);
-		return 0;
-	}
-	
+	root_dir[root_index].size = 0;
+	strcpy((char*)root_dir[root_index].fileName,filename);
+	root_dir[root_index].first_data_blk_index = FAT_EOC;
+	return 0;
 }
 
 int fs_delete(const char *filename)
 {
-	
-	if(filename == NULL)
+	STATS_OP(FS_OP_DELETE);
+	META_CHANGE();
+
+	if(!name_valid(filename))
 	{
-		perror("file not exist\n");
-		return -1;
-	}
-	if(strlen(filename) <= 0 || strlen(filename) > FS_FILENAME_LEN)
-	{
-		perror("filename too short/long\n");
 		return -1;
 	}
 	const char* file = filename;
@@ -427,156 +925,262 @@ int fs_delete(const char *filename)
 	int index = get_index(t,file);
 	if(index == -1) return -1;
 
-	// go thru file descriptors to see if file is already opened
-	int i = 0;
-	while(i < FS_OPEN_MAX_COUNT)
+	// the file cannot be deleted while it is open
+	if(open_files[index].open_count) return -1;
+
+	// finish checking all senarios, start deleting the file
+	int status = remove_file(index);
+	if(status == -1)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+int fs_create_many(const char **filenames, size_t count)
+{
+	STATS_OP(FS_OP_CREATE_MANY);
+	META_CHANGE();
+
+	if(super == NULL || filenames == NULL) return -1;
+	enum type t = ROOT;
+	if(count > (size_t)get_ratio(t)) return -1;
+
+	// check the whole batch before creating anything
+	for(size_t i = 0; i < count; i++)
 	{
-		if(strcmp(filename,(char*)fd_arr[i].fileName))
+		const char *name = filenames[i];
+		if(!name_valid(name)) return -1;
+		for(size_t j = 0; j < i; j++)
 		{
-			i++;
+			if(!strcmp(name, filenames[j])) return -1;
 		}
-		else
+	}
+
+	// one pass over the root directory for the existing names
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		if(root_dir[i].fileName[0] == '\0') continue;
+		for(size_t j = 0; j < count; j++)
 		{
-			return -1;
+			if(!strcmp(filenames[j], (char*)root_dir[i].fileName)) return -1;
 		}
 	}
 
-	// finish checking all senarios, start deleting the file
-	int status = remove_file(index);
-	if(status == -1)
+	// new files take the free entries in order, empty like with fs_create()
+	int root_index = 0;
+	for(size_t i = 0; i < count; i++)
 	{
-		return -1;
+		while(root_dir[root_index].fileName[0] != '\0') root_index++;
+		root_dir[root_index].size = 0;
+		strcpy((char*)root_dir[root_index].fileName, filenames[i]);
+		root_dir[root_index].first_data_blk_index = FAT_EOC;
 	}
 	return 0;
 }
 
-int fs_ls(void)
+int fs_delete_many(const char **filenames, size_t count)
 {
-	
+	STATS_OP(FS_OP_DELETE_MANY);
+	META_CHANGE();
+
+	int index[FS_FILE_MAX_COUNT];
+
+	if(super == NULL || filenames == NULL) return -1;
+	// more names than files means some are missing or repeated
+	if(count > FS_FILE_MAX_COUNT) return -1;
+
+	// check the whole batch before deleting anything
+	for(size_t i = 0; i < count; i++)
+	{
+		const char *name = filenames[i];
+		if(!name_valid(name)) return -1;
+		enum type t = CURR_FILE;
+		index[i] = get_index(t, name);
+		if(index[i] == -1) return -1;
+		for(size_t j = 0; j < i; j++)
+		{
+			if(index[j] == index[i]) return -1;
+		}
+		if(open_files[index[i]].open_count) return -1;
+	}
+
+	for(size_t i = 0; i < count; i++)
+		remove_file(index[i]);
+	return 0;
+}
+
+int fs_ls_str(char *buf, size_t size)
+{
+	STATS_OP(FS_OP_LS);
+
 	if(root_dir == NULL || super == NULL || block_disk_count() == -1)
 	{
 		return -1;
 	}
-	// printing
-	printf("FS Ls:\n");
+	size_t len = 0;
+	if(size) buf[0] = '\0';
+	str_printf(buf, size, &len, "FS Ls:\n");
 	int i = 0;
 	while(i < FS_FILE_MAX_COUNT)
 	{
 		/* if file in root_dir is not empty, print the info of the file */
 		if(root_dir[i].fileName[0] != '\0')
 		{
-			int size = (int)root_dir[i].size;
+			int file_size = (int)root_dir[i].size;
 			char *fileName = (char*)root_dir[i].fileName;
 			int data_blk_index = (int)root_dir[i].first_data_blk_index;
-			printf("file: %s, size: %d, data_blk: %d\n",fileName,size,data_blk_index);
+			str_printf(buf, size, &len, "file: %s, size: %d, data_blk: %d\n",
+				   fileName, file_size, data_blk_index);
 		}
 		i++;
 	}
-	return 0;
+	return len;
 }
 
-int fs_open(const char *filename)
+int fs_ls(void)
 {
-	
-	if (filename == NULL) {
-		perror("file not exist\n");
-		return -1;
+	return str_print(fs_ls_str);
+}
+
+int fs_list(char (*names)[FS_FILENAME_LEN], int max)
+{
+	STATS_OP(FS_OP_LIST);
+
+	if(root_dir == NULL || names == NULL) return -1;
+
+	int count = 0;
+	for(int i = 0; i < FS_FILE_MAX_COUNT && count < max; i++)
+	{
+		if(root_dir[i].fileName[0] == '\0') continue;
+		memcpy(names[count++], root_dir[i].fileName, FS_FILENAME_LEN);
 	}
+	return count;
+}
 
-	if (strlen(filename) <= 0 || strlen(filename) > FS_FILENAME_LEN) {
-		perror("filename too short/long\n");
+int fs_open(const char *filename)
+{
+	STATS_OP(FS_OP_OPEN);
+
+	if (!name_valid(filename))
 		return -1;
-	}
 
 	/* there is no file named @filename to open */
 	enum type t = CURR_FILE;
-	if (get_index(t, filename) == -1)
+	int root_index = get_index(t, filename);
+	if (root_index == -1)
 		return -1;
 	
 	/* there are already %FS_OPEN_MAX_COUNT files currently open */
-	t = FREE_FD;
-	int free_fd_index = get_index(t, filename);
-
-	
-	if (free_fd_index == -1)
+	int fd = fd_alloc();
+	if (fd == -1)
 		return -1;
-	
-	fd_arr[free_fd_index].offset = 0;
-	strcpy((char*)fd_arr[free_fd_index].fileName, filename);
-	fd_arr[free_fd_index].index = free_fd_index;
-	return free_fd_index;
+
+	/* Descriptors of one file share its open file object */
+	struct open_file *f = &open_files[root_index];
+	if (f->open_count++ == 0) {
+		f->dirent = root_index;
+		f->extents_valid = 0;
+		/* Room for the runs of a file written in a few pieces, so the
+		 map is built without allocating */
+		if (f->extents == NULL) {
+			f->max_extents = 16;
+			f->extents = stats_malloc(f->max_extents * sizeof(struct extent));
+			assert(f->extents);
+		}
+	}
+
+	FileDescriptor *d = fd_get(fd);
+	if (d->bounce == NULL) {
+		d->bounce = block_buf_alloc(1);
+		assert(d->bounce);
+	}
+	d->offset = 0;
+	d->file = f;
+	return fd;
 }
 
 int fs_close(int fd)
 {
-	
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+	STATS_OP(FS_OP_CLOSE);
+
+	FileDescriptor *d = fd_get(fd);
+	if (d == NULL) {
 		perror("fd out of bounds\n");
 		return -1;
 	}
 
-	if (fd_arr[fd].fileName[0] == '\0') {
+	if (d->file == NULL) {
 		perror("fd not currently open\n");
 		return -1;
 	}
 
-	fd_arr[fd].offset = 0;
-	char* default_file_name = malloc(0);
-	strcpy((char *)fd_arr[fd].fileName, default_file_name);
-	free(default_file_name);
+	d->file->open_count--;
+	d->file = NULL;
+	d->offset = 0;
+	d->next_free = fd_free;
+	fd_free = fd;
+	if (mount_opts.durability == FS_DURABLE_CLOSE)
+		return fs_sync();
 	return 0;
 }
 
 int fs_stat(int fd)
 {
-	
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+	STATS_OP(FS_OP_STAT);
+
+	FileDescriptor *d = fd_get(fd);
+	if (d == NULL) {
 		perror("fd out of bounds\n");
 		return -1;
 	}
 
-	if (fd_arr[fd].fileName[0] == '\0') {
+	if (d->file == NULL) {
 		perror("fd not currently open\n");
 		return -1;
 	}
 
-	enum type t = CURR_FILE;
-	int root_index = get_index(t, (char*)fd_arr[fd].fileName);
+	/* Files of 2 GiB and more, possible with large blocks, do not fit */
+	int root_index = d->file->dirent;
+	if (root_dir[root_index].size > INT_MAX) {
+		perror("file size does not fit in an int\n");
+		return -1;
+	}
 	return root_dir[root_index].size;
 }
 
 int fs_lseek(int fd, size_t offset)
 {
-	
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+	STATS_OP(FS_OP_LSEEK);
+
+	FileDescriptor *d = fd_get(fd);
+	if (d == NULL) {
 		perror("fd out of bounds\n");
 		return -1;
 	}
 
-	if (fd_arr[fd].fileName[0] == '\0') {
+	if (d->file == NULL) {
 		perror("fd not currently open\n");
 		return -1;
 	}
 
-	/* if @offset is larger than the current file size */
-	if (offset > (long unsigned int)fs_stat(fd)) {
-		perror("offset is larger than the current file size\n");
-		return -1;
-	}
-
-	fd_arr[fd].offset = offset;
+	/* Seeking past the end is fine, a later write leaves a hole behind */
+	d->offset = offset;
 	return 0;
 }
 
 int fs_write(int fd, void *buf, size_t count)
 {
-	
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+	STATS_OP(FS_OP_WRITE);
+	META_CHANGE();
+
+	FileDescriptor *d = fd_get(fd);
+	if (d == NULL) {
 		perror("fd out of bounds\n");
 		return -1;
 	}
 
-	if (fd_arr[fd].fileName[0] == '\0') {
+	if (d->file == NULL) {
 		perror("fd not currently open\n");
 		return -1;
 	}
@@ -591,68 +1195,116 @@ int fs_write(int fd, void *buf, size_t count)
 	if (count == 0)
 		return num_bytes_written;
 	
-	size_t front_mismatch = fd_arr[fd].offset % BLOCK_SIZE;
+	size_t front_mismatch = d->offset & (blk_size - 1);
 	size_t rear_mismatch;
 	
 	size_t num_blk_to_write;
-	if ((count + front_mismatch) % BLOCK_SIZE == 0)
-		/* bytes needed to be written match excatly for whole blocks of BLOCK_SIZE */
-		num_blk_to_write = (count + front_mismatch) / BLOCK_SIZE;
+	if (((count + front_mismatch) & (blk_size - 1)) == 0)
+		/* bytes needed to be written match excatly for whole blocks */
+		num_blk_to_write = (count + front_mismatch) >> blk_shift;
 	else
 		/* write one more block to include the last portion of user buf for later 
 		insertion */
-		num_blk_to_write = (count + front_mismatch) / BLOCK_SIZE + 1;
+		num_blk_to_write = ((count + front_mismatch) >> blk_shift) + 1;
 
 	if (num_blk_to_write > 1)
 		rear_mismatch = 0;
+	/* Taken now, front_mismatch is cleared after the first block */
+	size_t last_rear_mismatch = (num_blk_to_write << blk_shift) - (count + front_mismatch);
 	
-	void *bounce_buf = (void *)malloc(BLOCK_SIZE);
+	struct open_file *f = d->file;
+	int root_index = f->dirent;
+
+	/* Writing past the end of the file: zero the gap, holes for whole blocks */
+	if (d->offset > root_dir[root_index].size &&
+	    fill_gap(root_index, d->offset, d->offset >> blk_shift,
+		     d->bounce) == -1)
+		return num_bytes_written;
+
+	/* Blocks shared with a copy are copied before being written, along with
+	 the ones before them, which link to them */
+	if (chain_unshare(root_index, (d->offset + count - 1) >> blk_shift,
+			  d->bounce) == -1)
+		return num_bytes_written;
+
+	void *bounce_buf = d->bounce;
 	size_t num_bytes;
-	int DB_index = get_DBindex_offset(fd);
+	int DB_index = extent_lookup(f, d->offset >> blk_shift);
 	int prev_DB_index = DB_index;
-	enum type t;
-	int root_index;
+	int fresh;
 	size_t i = 1;
+
+	/* Appending at a block boundary: new blocks hang off the chain tail */
+	if (DB_index == FAT_EOC)
+		prev_DB_index = extent_tail(f);
 	while (i <= num_blk_to_write) {
 		/* While loop hit the last block, update rear mismatch for possible
 		extraction */
 		if (i == num_blk_to_write) 
-			rear_mismatch = num_blk_to_write * BLOCK_SIZE - (count + front_mismatch);
+			rear_mismatch = last_rear_mismatch;
+
+		/* A block we just allocated has no content worth reading back */
+		fresh = 0;
 
 		/* Write past the end of the file, the file is automatically extended to hold 
 		the additional bytes */
 		if (DB_index == FAT_EOC) {
-			t = FAT;
-
-			/* get_index() also updates (End-of-Chain) value for FAT array */
-			DB_index = get_index(t, "_placeholder");
+			/* Next to the tail if possible, alloc_block() also sets the
+			new entry to End-of-Chain */
+			DB_index = alloc_block(prev_DB_index);
 
 			/* Disk is full */
-			if (DB_index == -1)
+			if (DB_index == -1) {
+				STATS_BYTES(num_bytes_written);
 				return num_bytes_written;
+			}
 
 			/* Link new DB in FAT array */
 			if (prev_DB_index != FAT_EOC)
-				fat[prev_DB_index] = DB_index;
+				fat_set(prev_DB_index, DB_index);
 			
 			/* If we have an empty file, we need to update root dire */ 
-			if (i == 1) {
-				t = CURR_FILE;
-				root_index = get_index(t, (const char *)fd_arr[fd].fileName);
+			if (prev_DB_index == FAT_EOC)
 				root_dir[root_index].first_data_blk_index = DB_index;
+			fresh = 1;
+		} else if (IS_HOLE(DB_index)) {
+			/* Writing into a hole: a real block takes its place in the chain */
+			int hole_index = DB_index;
+			DB_index = alloc_block(prev_DB_index);
+			if (DB_index == -1) {
+				STATS_BYTES(num_bytes_written);
+				return num_bytes_written;
 			}
+
+			fat_set(DB_index, fat_get(hole_index));
+			fat_set(hole_index, 0);
+			if (prev_DB_index == FAT_EOC)
+				root_dir[root_index].first_data_blk_index = DB_index;
+			else
+				fat_set(prev_DB_index, DB_index);
+			fresh = 1;
 		}
+		/* The chain changed, its runs get walked again on next use */
+		if (fresh)
+			f->extents_valid = 0;
 		
 		/* For block that doesn't span the whole block */
 		if (front_mismatch != 0 || rear_mismatch != 0) {
-		    num_bytes = BLOCK_SIZE - front_mismatch - rear_mismatch;
-			block_read(super->data_blk_index + DB_index, bounce_buf);
+		    num_bytes = blk_size - front_mismatch - rear_mismatch;
+			if (fresh)
+				memset(bounce_buf, 0, blk_size);
+			else {
+				block_read(super->data_blk_index + DB_index, bounce_buf);
+				STATS_ADD(rmw, 1);
+			}
 			memcpy(bounce_buf + front_mismatch, buf + num_bytes_written, num_bytes);
 			block_write(super->data_blk_index + DB_index, bounce_buf);
+			csum_update(DB_index, bounce_buf);
 			num_bytes_written += num_bytes;
 		} else { /* For whole block */
 			block_write(super->data_blk_index + DB_index, buf + num_bytes_written);
-			num_bytes_written += BLOCK_SIZE;
+			csum_update(DB_index, buf + num_bytes_written);
+			num_bytes_written += blk_size;
 		}
 
 		/* If there is more than 1 data block to be written, the front mismatch for
@@ -661,31 +1313,32 @@ int fs_write(int fd, void *buf, size_t count)
 			front_mismatch = 0;
 		
 		prev_DB_index = DB_index;
-		DB_index = fat[DB_index];
+		DB_index = fat_get(DB_index);
+		STATS_ADD(fat_walk_steps, 1);
 		
 		i++;
 	}
-	free(bounce_buf);
 	/* The file offset of the file descriptor is implicitly incremented by the 
 	   number of bytes that were actually written */
-	fd_arr[fd].offset += num_bytes_written;
+	d->offset += num_bytes_written;
 
 	/* Update root dir size */
-	t = CURR_FILE;
-	root_index = get_index(t, (const char *)fd_arr[fd].fileName);
-	root_dir[root_index].size = MAX(fd_arr[fd].offset, (size_t)fs_stat(fd));
+	root_dir[root_index].size = MAX(d->offset, (size_t)root_dir[root_index].size);
+	STATS_BYTES(num_bytes_written);
 	return num_bytes_written;
 }
 
 int fs_read(int fd, void *buf, size_t count)
 {
-	
-	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+	STATS_OP(FS_OP_READ);
+
+	FileDescriptor *d = fd_get(fd);
+	if (d == NULL) {
 		perror("fd out of bounds\n");
 		return -1;
 	}
 
-	if (fd_arr[fd].fileName[0] == '\0') {
+	if (d->file == NULL) {
 		perror("fd not currently open\n");
 		return -1;
 	}
@@ -700,51 +1353,79 @@ int fs_read(int fd, void *buf, size_t count)
 	/* The number of bytes read can be smaller than @count if there are less than
 	@count bytes until the end of the file (it can even be 0 if the file offset
 	is at the end of the file) */
-	count = MIN(fs_stat(fd) - fd_arr[fd].offset, count);
+	int root_index = d->file->dirent;
+	size_t size = root_dir[root_index].size;
+	if (d->offset >= size)
+		return num_bytes_read;
+	count = MIN(size - d->offset, count);
 	if (count == 0)
 		return num_bytes_read;
 	
 	/* Front mismatch off fd.offset in the first block for later calculation of 
 	num_blk_to_read */
-	size_t front_mismatch = fd_arr[fd].offset % BLOCK_SIZE;
+	size_t front_mismatch = d->offset & (blk_size - 1);
 	size_t rear_mismatch;
 	
 	size_t num_blk_to_read;
-	if ((count + front_mismatch) % BLOCK_SIZE == 0)
-		/* bytes needed to be read match excatly for whole blocks of BLOCK_SIZE */
-		num_blk_to_read = (count + front_mismatch) / BLOCK_SIZE;
+	if (((count + front_mismatch) & (blk_size - 1)) == 0)
+		/* bytes needed to be read match excatly for whole blocks */
+		num_blk_to_read = (count + front_mismatch) >> blk_shift;
 	else
 		/* read one more block to include the last portion of data for later 
 		extraction */
-		num_blk_to_read = (count + front_mismatch) / BLOCK_SIZE + 1;
+		num_blk_to_read = ((count + front_mismatch) >> blk_shift) + 1;
 
 	/* If there is more than 1 data block to be read, the rear mismatch for 
 	first block doesn't exist */
 	if (num_blk_to_read > 1)
 		rear_mismatch = 0;
+	size_t last_rear_mismatch = (num_blk_to_read << blk_shift) - (count + front_mismatch);
 
 	/* Use block_read to read data block into buf one block at a time and 
 	extract non-whole block based on the scenarios */ 
-	void *bounce_buf = (void *)malloc(BLOCK_SIZE);
+	void *bounce_buf = d->bounce;
 	size_t num_bytes;
 	/* Index of where the offset is at in terms of DB */
-	uint16_t DB_index = get_DBindex_offset(fd);
+	uint16_t DB_index = extent_lookup(d->file, d->offset >> blk_shift);
 	size_t i = 1;
 	while (i <= num_blk_to_read) {
 		/* While loop hit the last block, update rear mismatch for possible
 		extraction */
 		if (i == num_blk_to_read) 
-			rear_mismatch = num_blk_to_read * BLOCK_SIZE - (count + front_mismatch);
+			rear_mismatch = last_rear_mismatch;
 		
-		/* For block that doesn't span the whole block */
-		if (front_mismatch != 0 || rear_mismatch != 0) {
-			num_bytes = BLOCK_SIZE - front_mismatch - rear_mismatch;
+		/* Holes read as zeros without touching the disk */
+		if (IS_HOLE(DB_index)) {
+			num_bytes = blk_size - front_mismatch - rear_mismatch;
+			memset(buf + num_bytes_read, 0, num_bytes);
+			num_bytes_read += num_bytes;
+		} else if (front_mismatch != 0 || rear_mismatch != 0) {
+			/* For block that doesn't span the whole block */
+			num_bytes = blk_size - front_mismatch - rear_mismatch;
 			block_read(super->data_blk_index + DB_index, bounce_buf);
+			if (csum_verify(DB_index, bounce_buf) == -1) {
+				return -1;
+			}
 			memcpy(buf + num_bytes_read, bounce_buf + front_mismatch, num_bytes);
 			num_bytes_read += num_bytes;
-		} else { /* For whole block */
-			block_read(super->data_blk_index + DB_index, buf + num_bytes_read);
-			num_bytes_read += BLOCK_SIZE;
+		} else { /* For whole blocks, a run of consecutive ones at once */
+			size_t run = 1;
+			while (i + run <= num_blk_to_read &&
+			       (i + run < num_blk_to_read || last_rear_mismatch == 0) &&
+			       fat_get(DB_index + run - 1) == DB_index + run &&
+			       !IS_HOLE(DB_index + run))
+				run++;
+
+			block_read_range(super->data_blk_index + DB_index, run,
+					 buf + num_bytes_read);
+			for (size_t j = 0; j < run; j++) {
+				if (csum_verify(DB_index + j, buf + num_bytes_read) == -1) {
+					return -1;
+				}
+				num_bytes_read += blk_size;
+			}
+			DB_index += run - 1;
+			i += run - 1;
 		}
 
 		/* If there is more than 1 data block to be read, the front mismatch for
@@ -752,13 +1433,163 @@ int fs_read(int fd, void *buf, size_t count)
 		if (i == 1)
 			front_mismatch = 0;
 		
-		DB_index = fat[DB_index];
+		DB_index = fat_get(DB_index);
+		STATS_ADD(fat_walk_steps, 1);
 		i++;
 	}
-	free(bounce_buf);
 	/* The file offset of the file descriptor is implicitly incremented by the 
 	   number of bytes that were actually read*/
-	fd_arr[fd].offset += num_bytes_read;
+	d->offset += num_bytes_read;
+	STATS_BYTES(num_bytes_read);
 	return num_bytes_read;
 }
 
+
+int fs_truncate(int fd, size_t size)
+{
+	STATS_OP(FS_OP_TRUNCATE);
+	META_CHANGE();
+
+	if (super == NULL)
+		return -1;
+
+	FileDescriptor *d = fd_get(fd);
+	if (d == NULL) {
+		perror("fd out of bounds\n");
+		return -1;
+	}
+
+	if (d->file == NULL) {
+		perror("fd not currently open\n");
+		return -1;
+	}
+
+	int root_index = d->file->dirent;
+	size_t num_blk_keep = (size + blk_size - 1) >> blk_shift;
+
+	/* Growing the file only adds holes */
+	if (size > root_dir[root_index].size) {
+		if (fill_gap(root_index, size, num_blk_keep, d->bounce) == -1)
+			return -1;
+		root_dir[root_index].size = size;
+		return 0;
+	}
+
+	/* Find the last block to keep and cut the chain right after it, the
+	 blocks up to it must be our own */
+	if (num_blk_keep > 0 &&
+	    chain_unshare(root_index, num_blk_keep - 1, d->bounce) == -1)
+		return -1;
+	uint16_t curr = root_dir[root_index].first_data_blk_index;
+	uint16_t next;
+	if (num_blk_keep == 0) {
+		root_dir[root_index].first_data_blk_index = FAT_EOC;
+	} else {
+		curr = extent_lookup(d->file, num_blk_keep - 1);
+		next = fat_get(curr);
+		fat_set(curr, FAT_EOC);
+		curr = next;
+	}
+	d->file->extents_valid = 0;
+
+	/* Release the tail (including any preallocated blocks) in one pass,
+	 or what of it is not shared with a copy */
+	chain_release(curr);
+	root_dir[root_index].size = size;
+	return 0;
+}
+
+int fs_fallocate(int fd, size_t size)
+{
+	STATS_OP(FS_OP_FALLOCATE);
+	META_CHANGE();
+
+	if (super == NULL)
+		return -1;
+
+	FileDescriptor *d = fd_get(fd);
+	if (d == NULL) {
+		perror("fd out of bounds\n");
+		return -1;
+	}
+
+	if (d->file == NULL) {
+		perror("fd not currently open\n");
+		return -1;
+	}
+
+	int root_index = d->file->dirent;
+	size_t num_blk_have = get_chain_len(root_dir[root_index].first_data_blk_index);
+	size_t num_blk_want = (size + blk_size - 1) >> blk_shift;
+
+	if (num_blk_want <= num_blk_have)
+		return 0;
+	size_t num_blk_need = num_blk_want - num_blk_have;
+
+	/* The tail gets linked to the new blocks */
+	if (chain_unshare(root_index, SIZE_MAX, d->bounce) == -1)
+		return -1;
+
+	enum type t = FAT;
+	if ((size_t)get_ratio(t) < num_blk_need) {
+		perror("not enough free blocks\n");
+		return -1;
+	}
+
+	/* Prefer one contiguous run right after the current tail, otherwise
+	 take the free blocks in order so the reservation still succeeds */
+	uint16_t tail = extent_tail(d->file);
+	d->file->extents_valid = 0;
+	int run = get_free_run(num_blk_need, tail == FAT_EOC ? 1 : tail + 1);
+	uint16_t prev = tail;
+	for (size_t i = 0; i < num_blk_need; i++) {
+		int DB_index;
+		if (run != -1) {
+			DB_index = run + i;
+			fat_set(DB_index, FAT_EOC);
+		} else {
+			DB_index = get_index(t, "_placeholder");
+		}
+
+		if (prev == FAT_EOC)
+			root_dir[root_index].first_data_blk_index = DB_index;
+		else
+			fat_set(prev, DB_index);
+		prev = DB_index;
+	}
+	return 0;
+}
+
+int fs_stat_alloc(int fd)
+{
+	STATS_OP(FS_OP_STAT_ALLOC);
+
+	if (super == NULL)
+		return -1;
+
+	FileDescriptor *d = fd_get(fd);
+	if (d == NULL) {
+		perror("fd out of bounds\n");
+		return -1;
+	}
+
+	if (d->file == NULL) {
+		perror("fd not currently open\n");
+		return -1;
+	}
+
+	/* Only blocks backed by the disk count, holes are free */
+	int root_index = d->file->dirent;
+	size_t num_blk = 0;
+	uint16_t curr = root_dir[root_index].first_data_blk_index;
+	for (; curr != FAT_EOC; curr = fat_get(curr)) {
+		if (!IS_HOLE(curr))
+			num_blk++;
+		STATS_ADD(fat_walk_steps, 1);
+	}
+	if (num_blk > (size_t)INT_MAX >> blk_shift) {
+		perror("allocated size does not fit in an int\n");
+		return -1;
+	}
+	return num_blk << blk_shift;
+}
@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
 
 #define SIGNATURE "ECS150FS"
 
@@ -12,10 +13,87 @@
 #define FS_FILE_MAX_COUNT 128
 
 /** Maximum number of open files */
-#define FS_OPEN_MAX_COUNT 32
+#define FS_OPEN_MAX_COUNT 16384
 
 
 
+/** When fs_read() checks data blocks against the checksum table */
+enum fs_verify {
+	/* Checksums are kept up to date but never checked */
+	FS_VERIFY_NEVER,
+	/* One block read out of @sample_rate is checked */
+	FS_VERIFY_SAMPLED,
+	/* Every block read is checked */
+	FS_VERIFY_ALWAYS,
+};
+
+/** When changes reach stable storage, besides fs_sync() and fs_umount() */
+enum fs_durability {
+	/* Only when the application asks for it */
+	FS_DURABLE_NONE,
+	/* Every @sync_interval_ms, from a background thread */
+	FS_DURABLE_PERIODIC,
+	/* On every fs_close() as well */
+	FS_DURABLE_CLOSE,
+};
+
+/** Per-mount options, see fs_mount_opts() */
+struct fs_mount_opts {
+	/* Create the checksum table if the file system has none */
+	int csum;
+	/* Checksum verification mode on read */
+	enum fs_verify verify;
+	/* Sampling period for %FS_VERIFY_SAMPLED (0 means 1) */
+	unsigned int sample_rate;
+	/* Open the disk with O_DIRECT, bypassing the host page cache */
+	int direct;
+	/* Workers serving fs_read_async() and fs_write_async() (0 means one
+	 * per CPU) */
+	unsigned int aio_threads;
+	/* When changes are flushed without an fs_sync() */
+	enum fs_durability durability;
+	/* Period of %FS_DURABLE_PERIODIC (0 means 1000) */
+	unsigned int sync_interval_ms;
+};
+
+/** Geometry of a new file system, see fs_format() */
+struct fs_format_opts {
+	/* Number of data blocks */
+	size_t data_blocks;
+	/* FAT blocks on top of those the data blocks need. Their entries have
+	 * no data block and mark the holes of sparse files. */
+	int fat_reserve;
+	/* Create the data block checksum table */
+	int csum;
+	/* Allocate the whole image on the host instead of leaving it sparse */
+	int preallocate;
+	/* Block size in bytes, a power of two from 4096 to 65536 (0 means
+	 * 4096). Large blocks shrink the FAT and the chains of large files. */
+	size_t block_size;
+};
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @opts: Geometry and features of the file system
+ *
+ * Create virtual disk file @diskname, replacing any existing file, and write
+ * an empty file system in it: the superblock, the FAT and the root directory.
+ * The rest of the image is left as a sparse hole, so formatting takes the
+ * same time whatever the size.
+ *
+ * The FAT entries past the data blocks mark the holes of sparse files. When
+ * the data blocks leave fewer than a few hundred of them in the last FAT
+ * block, an extra FAT block is added, unless the image is at the limits of
+ * the format.
+ *
+ * Return: -1 if a file system is mounted, if the geometry does not fit in the
+ * on-disk format (at most 65534 data blocks, 255 FAT blocks and 65535 blocks
+ * in total, a valid block size), or if @diskname cannot be created or
+ * written. 0 otherwise.
+ */
+int fs_format(const char *diskname, const struct fs_format_opts *opts);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -24,22 +102,69 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * After a clean fs_umount(), the free space summary kept in the superblock is
+ * used as is. Otherwise (crash, older image) every FAT block is read to
+ * rebuild it.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_opts - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults
+ *
+ * Same as fs_mount(), which is fs_mount_opts(@diskname, NULL). If the file
+ * system holds a table of data block checksums (CRC32C), fs_write() keeps it
+ * up to date and fs_read() checks the blocks it reads according to
+ * @opts->verify. With @opts->csum set, a table is created on a file system
+ * that has none yet; it takes 4 bytes per data block out of the data blocks.
+ * With @opts->direct set, the disk is opened with %BLOCK_DISK_DIRECT: blocks
+ * are not kept in the host page cache as well. @opts->durability adds flushes
+ * to the explicit ones: every @opts->sync_interval_ms from a background
+ * thread (%FS_DURABLE_PERIODIC), or on every fs_close() (%FS_DURABLE_CLOSE).
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located, or if there is no room for a new checksum table.
+ * 0 otherwise.
+ */
+int fs_mount_opts(const char *diskname, const struct fs_mount_opts *opts);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. Asynchronous requests still pending are completed first.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
  * closed, or if there are still open file descriptors. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write back file system metadata
+ *
+ * Write the superblock, the FAT, the root directory and the checksum table of
+ * the mounted file system to the virtual disk, as fs_umount() does, but keep
+ * the file system mounted. Until then, changes to the metadata only live in
+ * memory. The superblock is written last, with a flush (fdatasync) before
+ * and after it, and the data written so far is on stable storage on return.
+ *
+ * Concurrent callers commit as a group: a call that finds a write back in
+ * progress waits for it, then one write back covers every caller that came
+ * meanwhile, so they share its flushes.
+ *
+ * fs_sync() may also run at the same time as fs_read(), fs_write() and the
+ * calls that change files: the write back waits for the changes under way to
+ * complete and holds new ones off until it is done, so that it saves the
+ * metadata as it was at one moment.
+ *
+ * Return: -1 if no FS is currently mounted or if writing fails. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -49,6 +174,20 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_info_str - Format information about file system
+ * @buf: Where to write the output of fs_info(), NUL-terminated
+ * @size: Size of @buf, output that does not fit is cut
+ *
+ * Same as fs_info(), but the output goes to @buf instead of stdout, as with
+ * snprintf(). Calling it with a NULL @buf and a @size of 0 gives the size to
+ * allocate, minus the NUL character.
+ *
+ * Return: -1 if no underlying virtual disk was opened. Otherwise return the
+ * length of the whole output.
+ */
+int fs_info_str(char *buf, size_t size);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -77,6 +216,56 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_create_many - Create several new files
+ * @filenames: Array of file names
+ * @count: Number of entries in @filenames
+ *
+ * Create @count new and empty files at once, as fs_create() would one by
+ * one, but checking all names in a single pass over the root directory. Either
+ * all files are created or none is. As with the other calls, the metadata is
+ * only written back by fs_umount(), so a batch costs one metadata flush.
+ *
+ * Return: -1 if no FS is currently mounted, or if a name is invalid or too
+ * long, or if a file with one of the names already exists or a name appears
+ * twice, or if the root directory does not have @count free entries. 0
+ * otherwise.
+ */
+int fs_create_many(const char **filenames, size_t count);
+
+/**
+ * fs_delete_many - Delete several files
+ * @filenames: Array of file names
+ * @count: Number of entries in @filenames
+ *
+ * Delete @count files at once, as fs_delete() would one by one. Either all
+ * files are deleted or none is.
+ *
+ * Return: -1 if no FS is currently mounted, or if a name is invalid, or if
+ * there is no file with one of the names, or if one of the files is currently
+ * open. 0 otherwise.
+ */
+int fs_delete_many(const char **filenames, size_t count);
+
+/**
+ * fs_copy - Copy a file without copying its data
+ * @src: Name of the file to copy
+ * @dst: Name of the new file
+ *
+ * Create file @dst with the size and content of file @src. The two files share
+ * the data blocks of @src, only the root directory entry and a reference count
+ * per shared block are written, whatever the size. Writing to or truncating
+ * either file later gives it copies of the shared blocks it changes (and of
+ * those before them in the file), deleting one leaves the blocks to the other.
+ * The first copy on an image takes a few data blocks for the reference counts.
+ *
+ * Return: -1 if no FS is currently mounted, or if a name is invalid or too
+ * long, or if there is no file named @src, or if a file named @dst already
+ * exists, or if the root directory is full, or if there is no room for the
+ * reference counts. 0 otherwise.
+ */
+int fs_copy(const char *src, const char *dst);
+
 /**
  * fs_ls - List files on file system
  *
@@ -86,6 +275,32 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_ls_str - Format the list of files on file system
+ * @buf: Where to write the output of fs_ls(), NUL-terminated
+ * @size: Size of @buf, output that does not fit is cut
+ *
+ * Same as fs_ls(), with the output going to @buf, see fs_info_str().
+ *
+ * Return: -1 if no FS is currently mounted. Otherwise return the length of the
+ * whole output.
+ */
+int fs_ls_str(char *buf, size_t size);
+
+/**
+ * fs_list - Get the names of the files on file system
+ * @names: Array to fill with file names
+ * @max: Number of entries in @names
+ *
+ * Copy the names of the files located in the root directory into @names, at
+ * most @max of them, for programs that need to walk the files rather than
+ * print them like fs_ls().
+ *
+ * Return: -1 if no FS is currently mounted or if @names is NULL. Otherwise,
+ * the number of names copied.
+ */
+int fs_list(char (*names)[FS_FILENAME_LEN], int max);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -109,10 +324,12 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. If the file system was mounted with
+ * %FS_DURABLE_CLOSE, fs_sync() follows.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
+ * invalid (out of bounds or not currently open), or if the fs_sync() that
+ * follows fails. 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -123,11 +340,29 @@ int fs_close(int fd);
  * Get the current size of the file pointed by file descriptor @fd.
  *
  * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
- * invalid (out of bounds or not currently open). Otherwise return the current
- * size of file.
+ * invalid (out of bounds or not currently open), or if the size is 2 GiB or
+ * more and does not fit in the return value (files can be that large with
+ * block sizes over 32 KiB). Otherwise return the current size of file.
  */
 int fs_stat(int fd);
 
+/**
+ * fs_stat_alloc - Get file allocated size
+ * @fd: File descriptor
+ *
+ * Get the number of bytes of disk space held by the file pointed by file
+ * descriptor @fd, i.e. its data blocks times the block size. Holes left by
+ * writing past the end of the file take no space, so this can be smaller than
+ * the size reported by fs_stat(). Blocks reserved with fs_fallocate() make it
+ * larger.
+ *
+ * Return: -1 if no FS is currently mounted, of if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the allocated size is
+ * 2 GiB or more, like with fs_stat(). Otherwise return the allocated size of
+ * file.
+ */
+int fs_stat_alloc(int fd);
+
 /**
  * fs_lseek - Set file offset
  * @fd: File descriptor
@@ -137,9 +372,12 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * @offset may be past the end of the file. Reading there returns nothing, and
+ * writing there extends the file, leaving a hole in between that reads back as
+ * zeros but uses no data blocks.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * invalid (i.e., out of bounds, or not currently open). 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -159,6 +397,13 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
+ * New blocks are taken next to the end of the file or else in the allocation
+ * group of the calling thread. Several threads may call fs_write() and
+ * fs_read() at the same time on descriptors of different files, and
+ * fs_sync() at any time; fs_open() and fs_close() of other descriptors may run
+ * alongside them from a single thread; any other call must not run
+ * concurrently with them.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually written.
@@ -181,9 +426,415 @@ int fs_write(int fd, void *buf, size_t count);
  * implicitly incremented by the number of bytes that were actually read.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually read.
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if a
+ * data block fails checksum verification. Otherwise return the number of bytes
+ * actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/** Completion callback of fs_read_async() and fs_write_async() */
+typedef void (*fs_aio_cb)(int fd, int result, void *arg);
+
+/** Completed request without a callback, see fs_aio_reap() */
+struct fs_aio_event {
+	/* Descriptor of the request */
+	int fd;
+	/* What fs_read() or fs_write() returned */
+	int result;
+	/* Argument given with the request */
+	void *arg;
+};
+
+/**
+ * fs_read_async - Read from a file without waiting
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @cb: Completion callback, or NULL
+ * @arg: Argument passed back on completion
+ *
+ * Queue a fs_read() of @count bytes from file descriptor @fd into @buf and
+ * return at once. A pool of worker threads, started on first use, serves the
+ * requests: those on one file run one at a time in submission order, so the
+ * requests of a descriptor see the offsets they would see if made in turn,
+ * while requests on different files run in parallel. @buf must stay valid
+ * until completion, and @fd open; fs_lseek() on @fd must wait for its requests.
+ * While requests are in flight, the submitting thread may fs_open() and
+ * fs_close() other descriptors, of the same file or not.
+ *
+ * On completion, @cb is called on a worker thread with @fd, the return value of
+ * fs_read() and @arg. It must not block on other requests. Without @cb, the
+ * completion is queued for fs_aio_reap() and the eventfd of fs_aio_fd()
+ * becomes readable.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if the
+ * workers cannot be started. 0 otherwise.
+ */
+int fs_read_async(int fd, void *buf, size_t count, fs_aio_cb cb, void *arg);
+
+/**
+ * fs_write_async - Write to a file without waiting
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @cb: Completion callback, or NULL
+ * @arg: Argument passed back on completion
+ *
+ * Same as fs_read_async() for a fs_write() of @count bytes from @buf.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if the
+ * workers cannot be started. 0 otherwise.
+ */
+int fs_write_async(int fd, void *buf, size_t count, fs_aio_cb cb, void *arg);
+
+/**
+ * fs_aio_fd - Get the completion eventfd
+ *
+ * Get a non-blocking eventfd, for poll() or epoll, whose counter goes up by one
+ * for each completed request without a callback. After reading it, call
+ * fs_aio_reap() until it returns 0. It stays valid until fs_umount().
+ *
+ * Return: -1 if no FS is currently mounted or if the workers cannot be
+ * started. The file descriptor otherwise.
+ */
+int fs_aio_fd(void);
+
+/**
+ * fs_aio_reap - Collect completed requests
+ * @events: Array to fill with completions
+ * @max: Number of entries in @events
+ *
+ * Move up to @max completions of requests made without a callback into
+ * @events, oldest first.
+ *
+ * Return: -1 if @events is NULL or @max negative. The number of completions
+ * collected otherwise.
+ */
+int fs_aio_reap(struct fs_aio_event *events, int max);
+
+/**
+ * fs_aio_wait - Wait for asynchronous requests
+ *
+ * Wait until every request submitted so far has completed, callbacks
+ * included. It must not be called from a callback.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_aio_wait(void);
+
+/**
+ * fs_truncate - Change the size of a file
+ * @fd: File descriptor
+ * @size: New file size
+ *
+ * Cut the file referenced by file descriptor @fd down to @size bytes. Every
+ * data block past the new end of the file, including blocks reserved with
+ * fs_fallocate(), is released in a single pass over the chain. Descriptors of
+ * this file keep their offset, which may now be past the end of the file, as
+ * after fs_lseek().
+ *
+ * If @size is larger than the current file size, the file is extended with a
+ * hole instead. Each block of the hole takes a spare FAT entry (see
+ * fs_format()); once there are none left, the remaining blocks are taken
+ * from the free data blocks and zeroed, so growing a file may then run out of
+ * space.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the file cannot be
+ * extended. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t size);
+
+/**
+ * fs_fallocate - Reserve data blocks for a file
+ * @fd: File descriptor
+ * @size: Expected file size
+ *
+ * Make sure the file referenced by file descriptor @fd owns enough data blocks
+ * to hold @size bytes, without writing them and without changing the file
+ * size. The missing blocks are taken as one contiguous run (right after the
+ * current last block when possible), so that a later fs_write() up to @size
+ * does not need to allocate and reads the file sequentially.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the disk does not have
+ * enough free blocks. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t size);
+
+/** Findings of fs_check() */
+struct fs_check_report {
+	/* Files in the root directory */
+	int files;
+	/* Data blocks owned by a file or by the checksum or reference table */
+	int used_blocks;
+	/* Chains that loop back on themselves */
+	int cycles;
+	/* Chains linking to a free, reserved or out of range FAT entry */
+	int bad_links;
+	/* Files (or checksum table) longer than their chain */
+	int size_mismatches;
+	/* FAT entries in use but owned by no chain */
+	int leaked_blocks;
+	/* FAT entries linked from more chains than their reference count says */
+	int cross_links;
+	/* FAT entries with a reference count above the chains linking to them */
+	int bad_refs;
+	/* Allocation summary of a cleanly unmounted image not matching a sound FAT */
+	int stale_summary;
+	/* Total number of problems found */
+	int errors;
+	/* Number of fixes applied, with @repair only */
+	int repaired;
+};
+
+/**
+ * fs_check - Check the consistency of a file system
+ * @diskname: Name of the virtual disk file
+ * @repair: Fix the problems found
+ * @num_threads: Number of threads walking the FAT chains
+ * @report: Findings
+ *
+ * Check the file system in virtual disk file @diskname, which must not be
+ * mounted. The superblock must pass the same checks as fs_mount(). Every
+ * chain (one per file, plus the checksum table) is walked, in parallel on
+ * @num_threads threads, looking for cycles and links to unusable FAT entries,
+ * and the FAT is then scanned for entries owned by no chain or by several.
+ * Each problem is described on stdout and counted in @report.
+ *
+ * With @repair, chains are cut before a cycle, a bad link, or a block already
+ * owned by a previous file, file sizes are shrunk to what their chain holds,
+ * a damaged checksum table is dropped, and orphaned entries are freed.
+ *
+ * Return: -1 if a file system is mounted, if virtual disk file @diskname
+ * cannot be opened, if its superblock is invalid, or if the repaired metadata
+ * cannot be written back. 0 otherwise, whether problems were found or not.
+ */
+int fs_check(const char *diskname, int repair, int num_threads,
+	     struct fs_check_report *report);
+
+/**
+ * fs_dump - Write a file system to a stream
+ * @diskname: Name of the virtual disk file
+ * @fd: Host file descriptor to write to, a pipe or socket will do
+ *
+ * Write the file system in virtual disk file @diskname, which must not be
+ * mounted, to @fd: a short header, the superblock, the FAT and the root
+ * directory, then the data blocks in use and a CRC32C of the whole stream.
+ * Free blocks are left out. Blocks in use are read in ascending order, runs
+ * of them in single transfers, and written out in batches of 1 MiB.
+ *
+ * Return: -1 if a file system is mounted, if virtual disk file @diskname
+ * cannot be opened, if its superblock is invalid, or on I/O error. 0
+ * otherwise.
+ */
+int fs_dump(const char *diskname, int fd);
+
+/**
+ * fs_restore - Rebuild a file system from a stream
+ * @fd: Host file descriptor to read from, positioned at the start of a dump
+ * @diskname: Name of the virtual disk file to create
+ *
+ * Create virtual disk file @diskname (which may be a stripe set, see
+ * block_stripe_create()) from a stream written by fs_dump(), with the same
+ * geometry, metadata and blocks in use. Blocks that were free are left as
+ * holes. The stream is read in batches of 1 MiB, each written to the disk in
+ * ascending order, a run of consecutive blocks per transfer.
+ *
+ * The metadata is only written once the checksum of the whole stream has
+ * matched, the superblock last. If the stream turns out to be truncated or
+ * corrupt, @diskname is left without a file system, which fs_mount() and
+ * fs_check() refuse, rather than with a FAT that does not match its data.
+ *
+ * Return: -1 if a file system is mounted, if the stream is not a valid dump
+ * (or is truncated, or its checksum does not match), or if @diskname cannot
+ * be created or written. 0 otherwise.
+ */
+int fs_restore(int fd, const char *diskname);
+
+/** Layout of a file, see fs_fragmentation() */
+struct fs_frag {
+	/* Data blocks held by the file (holes excluded) */
+	size_t blocks;
+	/* Runs of consecutive data blocks */
+	size_t extents;
+};
+
+/**
+ * fs_fragmentation - Measure how scattered a file is
+ * @filename: File name
+ * @frag: Layout of the file
+ *
+ * Fill @frag with the number of data blocks of file @filename and the number
+ * of runs of consecutive blocks they form. A contiguous file has one extent,
+ * and the average run length is @frag->blocks / @frag->extents.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename. 0 otherwise.
+ */
+int fs_fragmentation(const char *filename, struct fs_frag *frag);
+
+/**
+ * fs_frag_report - Display the layout of all files
+ *
+ * List the number of data blocks, extents and average run length of every
+ * file in the root directory, then the totals for the file system.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_frag_report(void);
+
+/**
+ * fs_defrag - Make a file contiguous
+ * @filename: File name
+ *
+ * Copy the data blocks of file @filename into a free run of consecutive
+ * blocks and release the old ones. The metadata is written to disk as the
+ * relocation goes, in an order that leaves a consistent file system if the
+ * process stops at any point (at worst, blocks used by no file that fs_check()
+ * reclaims). Files with no free run large enough, and files sharing blocks
+ * with a copy (see fs_copy()), are left as they are.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename, or on I/O error. 1 if the file was moved,
+ * 0 otherwise.
+ */
+int fs_defrag(const char *filename);
+
+/**
+ * fs_defrag_all - Make all files contiguous
+ *
+ * Run fs_defrag() on every file of the root directory, largest first, until
+ * all are done or fs_defrag_cancel() is called.
+ *
+ * Return: -1 if no FS is currently mounted or on I/O error. Otherwise, the
+ * number of files moved.
+ */
+int fs_defrag_all(void);
+
+/**
+ * fs_defrag_cancel - Stop a running defragmentation
+ *
+ * Make fs_defrag() or fs_defrag_all() return after the file currently being
+ * moved, or before its metadata changes if that has not started yet. This
+ * only sets a flag and can be called from a signal handler.
+ */
+void fs_defrag_cancel(void);
+
+/** Operations counted by fs_stats(), one per entry point of this file. Block
+ * traces store these numbers, new operations go at the end. */
+enum fs_op {
+	FS_OP_MOUNT,
+	FS_OP_UMOUNT,
+	FS_OP_INFO,
+	FS_OP_CREATE,
+	FS_OP_DELETE,
+	FS_OP_LS,
+	FS_OP_OPEN,
+	FS_OP_CLOSE,
+	FS_OP_STAT,
+	FS_OP_LSEEK,
+	FS_OP_WRITE,
+	FS_OP_READ,
+	FS_OP_TRUNCATE,
+	FS_OP_FALLOCATE,
+	FS_OP_STAT_ALLOC,
+	FS_OP_FORMAT,
+	FS_OP_CHECK,
+	FS_OP_FRAG,
+	FS_OP_DEFRAG,
+	FS_OP_CREATE_MANY,
+	FS_OP_DELETE_MANY,
+	FS_OP_LIST,
+	FS_OP_SYNC,
+	FS_OP_COPY,
+	FS_OP_DUMP,
+	FS_OP_RESTORE,
+	FS_OP_COUNT,
+};
+
+/** Latency histogram buckets: 4 per power of two, from 1ns up to ~2^40ns */
+#define FS_STATS_BUCKETS 160
+
+/** Counters of one operation */
+struct fs_op_stats {
+	/* Number of calls, failed ones included */
+	uint64_t calls;
+	/* Bytes transferred (fs_read() and fs_write() only) */
+	uint64_t bytes;
+	/* Total time spent in the calls */
+	uint64_t total_ns;
+	/* Call latencies, bucket i counts those in
+	 * [fs_stats_bucket_ns(i), fs_stats_bucket_ns(i+1)) */
+	uint64_t hist[FS_STATS_BUCKETS];
+};
+
+/** Library-wide counters, see fs_stats() */
+struct fs_stats {
+	struct fs_op_stats ops[FS_OP_COUNT];
+	/* Blocks transferred to and from the virtual disk */
+	uint64_t block_reads;
+	uint64_t block_writes;
+	/* Partial block writes that had to read the block first */
+	uint64_t rmw;
+	/* FAT entries followed while walking file chains */
+	uint64_t fat_walk_steps;
+	/* Shared blocks copied before being written, see fs_copy() */
+	uint64_t cow_copies;
+	/* Flushes to stable storage (fdatasync) and their latency */
+	struct fs_op_stats flush;
+	/* fs_sync() calls served by the write back of another caller */
+	uint64_t sync_shared;
+	/* Heap allocations made by the library */
+	uint64_t heap_allocs;
+};
+
+/**
+ * fs_stats - Get operation counters
+ * @stats: Where to copy the counters
+ *
+ * Copy the counters accumulated since the program started or since the last
+ * fs_stats_reset(). They are only kept when the library is built with
+ * FS_STATS defined (the default, `make STATS=0` leaves them out along with
+ * their cost). Rates, such as flushes per second, are left to the caller to
+ * compute over its own interval.
+ *
+ * Return: -1 if @stats is NULL or if the library keeps no counters. 0
+ * otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/**
+ * fs_stats_reset - Clear operation counters
+ */
+void fs_stats_reset(void);
+
+/**
+ * fs_stats_op_name - Get operation name
+ * @op: Operation
+ *
+ * Return: a short name for @op ("read", "write", ...), NULL if @op is invalid.
+ */
+const char *fs_stats_op_name(enum fs_op op);
+
+/**
+ * fs_stats_bucket_ns - Get histogram bucket bound
+ * @bucket: Bucket index, up to %FS_STATS_BUCKETS
+ *
+ * Return: the smallest latency in nanoseconds counted in bucket @bucket.
+ */
+uint64_t fs_stats_bucket_ns(int bucket);
+
+/**
+ * fs_stats_percentile - Estimate a latency percentile
+ * @op: Counters of an operation
+ * @pct: Percentile, between 0 and 100
+ *
+ * Return: an upper bound in nanoseconds of the latency under which @pct
+ * percent of the calls of @op fall, 0 if there was no call.
+ */
+uint64_t fs_stats_percentile(const struct fs_op_stats *op, double pct);
+
 #endif /* _FS_H */
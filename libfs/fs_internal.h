@@ -0,0 +1,256 @@
+#ifndef _FS_INTERNAL_H
+#define _FS_INTERNAL_H
+
+/*
+ * On-disk layout and helpers shared by the libfs modules. Not part of the
+ * public API, applications only include fs.h.
+ */
+
+#include <pthread.h>
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+#include "disk.h"
+#include "fs.h"
+
+#define FAT_EOC 0xFFFF
+
+/* FAT entries past the data area have no block behind them. A file chain
+ goes through them to mark a hole, which reads back as zeros. */
+#define IS_HOLE(i) ((i) != FAT_EOC && (i) >= super->amt_blk_data)
+
+/* Spare entries fs_format() keeps for holes when the FAT has room for them.
+ Once they are all taken, holes cost a zeroed data block each. */
+#define HOLE_MIN 256
+
+/* https://stackoverflow.com/questions/3437404/min-and-max-in-c */
+ #define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+ #define MAX(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a > _b ? _a : _b; })
+
+/* Block size of the mounted file system, a power of two from BLOCK_SIZE to
+ BLOCK_SIZE_MAX, and its log2. Offsets are split with shifts and masks, which
+ costs the same for every size. */
+extern size_t blk_size;
+extern int blk_shift;
+
+/* FAT entries per FAT block, FAT block and slot of entry @i */
+#define FAT_PER_BLK (blk_size/2)
+#define FAT_BLK(i) ((int)((i) >> (blk_shift - 1)))
+#define FAT_SLOT(i) ((i) & (FAT_PER_BLK - 1))
+
+enum type {FAT,ROOT,CURR_FILE};
+
+/* Allocation summary kept in the superblock, one region per FAT block */
+#define SUM_VERSION 1
+#define SUM_CLEAN 0x01
+#define SUM_REGIONS ((FAT_EOC + BLOCK_SIZE/2 - 1) / (BLOCK_SIZE/2))
+
+/*
+ * 								*
+ * Superblock:							*
+ * - Using "__attribute__" to pack data	so that	insist particu-	*
+ *   lar sized padding, also avoid meaningless bytes allocated	*
+ * - Superblock contains 7 pieces of data: Signature, total amt *
+ *   of blocks of virtual disk, root dir block index, data block*
+ *   start index, amt of data blocks, num of blocks for FAT, as	*
+ *   well as unused/padding.					*
+ * - csum_blk is the first data block of the checksum table chain *
+ *   (0 if the image has none, data block 0 is never allocated).	*
+ * - blk_size is the block size (0 on older images: BLOCK_SIZE).	*
+ *   The superblock and root directory take the first BLOCK_SIZE	*
+ *   bytes of their block.					*
+ * - ref_blk is the first data block of the reference count	*
+ *   table chain, 0 until the first fs_copy().			*
+ * - The allocation summary (free data blocks, free root entries,*
+ *   lowest free FAT entry and free blocks per FAT block) is	*
+ *   only trusted when sum_version matches and SUM_CLEAN is set,	*
+ *   which fs_umount() does last. Mounting clears it on disk.	*
+ *   								*
+ */
+
+// attribute ref: 
+typedef struct {
+	uint8_t sig[8];
+	uint16_t amt_blk;
+	uint16_t root_dir_index;
+	uint16_t data_blk_index;
+	uint16_t amt_blk_data;
+	uint8_t amt_blk_FAT;
+	uint16_t csum_blk;
+	uint8_t sum_version;
+	uint8_t sum_flags;
+	uint16_t free_blk;
+	uint8_t free_dirent;
+	uint16_t next_free;
+	uint16_t region_free[SUM_REGIONS];
+	uint32_t blk_size;
+	uint16_t ref_blk;
+	uint8_t unused[4000];
+}__attribute__((packed)) SuperBlock;
+
+_Static_assert(sizeof(SuperBlock) == BLOCK_SIZE, "superblock must fill a block");
+
+/*	Root Directory 		*/
+typedef struct {
+	uint8_t fileName[FS_FILENAME_LEN];
+	uint32_t size;
+	uint16_t first_data_blk_index;
+	uint8_t unused[10];
+}__attribute__((packed)) RootDirectory;
+
+_Static_assert(sizeof(RootDirectory) * FS_FILE_MAX_COUNT == BLOCK_SIZE,
+	       "root directory must fill a block");
+
+/* Run of consecutive FAT entries in a chain */
+struct extent {
+	/* First block of the run in the file */
+	uint32_t blk;
+	/* FAT entry of that block */
+	uint16_t start;
+	uint16_t len;
+};
+
+/* In-memory state of a file that has open descriptors, one per root dir
+ entry. The size stays in the root dir entry, which is in memory too. */
+struct open_file {
+	/* Descriptors open on the file, the object is unused at 0 */
+	int open_count;
+	/* Root dir entry of the file */
+	int dirent;
+	/* Runs of the chain, built on first use after the chain changed */
+	struct extent *extents;
+	size_t num_extents, max_extents;
+	int extents_valid;
+};
+
+/*	File Descriptor		*/
+typedef struct {
+	size_t offset;
+	/* NULL while the descriptor is free */
+	struct open_file *file;
+	/* Next free descriptor, -1 for the last one */
+	int next_free;
+	/* A block for partial block transfers, set up the first time the
+	 descriptor is opened and kept until unmount, free or not. Callers on
+	 different descriptors never share one. */
+	void *bounce;
+} FileDescriptor;
+
+/* Metadata of the mounted file system (fs.c) */
+extern SuperBlock *super;
+extern struct fs_mount_opts mount_opts;
+/* The FAT is read one block at a time on first access, and only the blocks
+ changed since are written back */
+extern uint16_t **fat_pages;
+extern uint8_t *fat_dirty;
+extern RootDirectory *root_dir;
+/* CRC32C of every data block, 0 when unknown. NULL if the image has no
+ checksum table. */
+extern uint32_t *csum_tab;
+
+/* Extra links to every FAT entry, see reflink.c. NULL if no file was ever
+ copied on the image. */
+extern uint16_t *ref_tab;
+
+/* Metadata loading, see fs_mount() */
+int load_super(void);
+int load_meta(void);
+int csum_load(void);
+void free_meta(void);
+int write_fat(void);
+uint16_t *fat_load_page(int blk);
+int fat_load_all(void);
+int csum_flush(void);
+int init_super_check(void);
+int fat_blk_count(int amt_blk_data, size_t block_size);
+int sum_load(void);
+void sum_rebuild(void);
+
+/* Descriptor @fd, NULL if out of bounds. It may be free. */
+FileDescriptor *fd_get(int fd);
+/* FAT entry of block @blk of open file @f, FAT_EOC past its chain */
+uint16_t extent_lookup(struct open_file *f, size_t blk);
+/* Forget the runs of the chain of root dir entry @dirent after changing it */
+void extents_drop(int dirent);
+
+/* Checksums of data blocks */
+void csum_update(uint16_t index, const void *data);
+int csum_verify(uint16_t index, const void *data);
+
+/* Shared chains (reflink.c) */
+int ref_blk_count(void);
+int ref_load(void);
+int ref_flush(void);
+void ref_rebuild(void);
+int chain_unshare(int root_index, size_t upto, void *bounce_buf);
+void chain_release(uint16_t first);
+int chain_shared(int root_index);
+
+/* Asynchronous requests (aio.c) */
+void aio_exit(void);
+
+/* Write back and durability modes (sync.c) */
+extern pthread_rwlock_t meta_lock;
+void meta_unlock(int *held);
+/* Keep fs_sync() from writing the metadata back until the function returns */
+#define META_CHANGE() \
+	int _meta_held __attribute__((cleanup(meta_unlock))) = \
+		pthread_rwlock_rdlock(&meta_lock)
+int sync_meta(void);
+int sync_start(void);
+void sync_exit(void);
+
+/* Allocation groups (alloc.c) */
+void alloc_init(void);
+void alloc_store(void);
+void alloc_exit(void);
+int alloc_block(uint16_t near);
+int alloc_free_count(void);
+int alloc_group_free(int g);
+void sum_account(uint16_t i, int freed);
+
+/* Whether @filename fits in a root dir entry, see fs_create() */
+int name_valid(const char *filename);
+
+/* Chain and allocation helpers */
+int get_index(enum type t, const char* file);
+int get_ratio(enum type r);
+int get_free_run(size_t count, int hint);
+int chain_alloc(int num_blk, uint16_t *first);
+int get_hole_index(void);
+int get_hole_count(void);
+uint16_t get_chain_tail(uint16_t first);
+size_t get_chain_len(uint16_t first);
+int csum_blk_count(void);
+
+/* FAT entry accessors, loading the FAT block that holds entry @i if needed */
+static inline uint16_t *fat_entry(uint16_t i)
+{
+	uint16_t *page = __atomic_load_n(&fat_pages[FAT_BLK(i)], __ATOMIC_ACQUIRE);
+	if (page == NULL)
+		page = fat_load_page(FAT_BLK(i));
+	return page + FAT_SLOT(i);
+}
+
+static inline uint16_t fat_get(uint16_t i)
+{
+	return *fat_entry(i);
+}
+
+static inline void fat_set(uint16_t i, uint16_t val)
+{
+	uint16_t *entry = fat_entry(i);
+	if (i < super->amt_blk_data && (*entry == 0) != (val == 0))
+		sum_account(i, val == 0);
+	*entry = val;
+	fat_dirty[FAT_BLK(i)] = 1;
+}
+
+#endif /* _FS_INTERNAL_H */
@@ -0,0 +1,427 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+#include "stats.h"
+
+/* Chain ids of the checksum and reference tables, files use their root dir
+ index */
+#define CSUM_CHAIN FS_FILE_MAX_COUNT
+#define REF_CHAIN (FS_FILE_MAX_COUNT + 1)
+#define NUM_CHAINS (FS_FILE_MAX_COUNT + 2)
+
+enum chain_state {CHAIN_OK, CHAIN_CYCLE, CHAIN_BAD_LINK};
+
+/* What a walk found in one chain */
+struct chain_result {
+	enum chain_state state;
+	/* blocks in the chain, up to the problem if any */
+	size_t len;
+	/* last good block (FAT_EOC if the first one is bad) and the bad link */
+	uint16_t last;
+	uint16_t bad;
+};
+
+/* State shared by the checker threads */
+static struct {
+	int num_entries;
+	/* how many chains go through each FAT entry */
+	uint16_t *refs;
+	/* how many root dir entries and FAT entries in use link to each one */
+	uint16_t *links;
+	struct chain_result results[NUM_CHAINS];
+	int next_chain;
+	int num_threads;
+	/* per-thread totals of the FAT scan */
+	int leaked[64];
+	int crossed[64];
+	int bad_refs[64];
+	int used[64];
+} ck;
+
+// first block of chain @id, FAT_EOC for unused entries
+static uint16_t chain_first(int id)
+{
+	if(id == CSUM_CHAIN)
+		return super->csum_blk ? super->csum_blk : FAT_EOC;
+	if(id == REF_CHAIN)
+		return super->ref_blk ? super->ref_blk : FAT_EOC;
+	if(root_dir[id].fileName[0] == '\0')
+		return FAT_EOC;
+	return root_dir[id].first_data_blk_index;
+}
+
+/* Walk chain @id, counting each block in ck.refs. @seen is private to the
+ thread and stamped with @id + 1, so meeting our own stamp again is a cycle. */
+static void check_chain(int id, uint16_t *seen)
+{
+	struct chain_result *r = &ck.results[id];
+	uint16_t curr = chain_first(id);
+
+	memset(r, 0, sizeof(*r));
+	r->last = FAT_EOC;
+	while(curr != FAT_EOC)
+	{
+		if(curr == 0 || curr >= ck.num_entries || fat_get(curr) == 0)
+		{
+			r->state = CHAIN_BAD_LINK;
+			r->bad = curr;
+			return;
+		}
+		if(seen[curr] == id + 1)
+		{
+			r->state = CHAIN_CYCLE;
+			r->bad = curr;
+			return;
+		}
+		seen[curr] = id + 1;
+		__atomic_fetch_add(&ck.refs[curr], 1, __ATOMIC_RELAXED);
+		r->len++;
+		r->last = curr;
+		curr = fat_get(curr);
+	}
+}
+
+static void *chain_worker(void *arg)
+{
+	(void)arg;
+	uint16_t *seen = stats_calloc(ck.num_entries, sizeof(uint16_t));
+	if(seen == NULL) return NULL;
+
+	int id;
+	while((id = __atomic_fetch_add(&ck.next_chain, 1, __ATOMIC_RELAXED)) < NUM_CHAINS)
+		check_chain(id, seen);
+
+	free(seen);
+	return NULL;
+}
+
+// count the links from the entries of a slice of the FAT that chains go through
+static void *link_worker(void *arg)
+{
+	int t = (int)(intptr_t)arg;
+	int slice = (ck.num_entries + ck.num_threads - 1) / ck.num_threads;
+	int start = MAX(t * slice, 1);
+	int end = MIN((t + 1) * slice, ck.num_entries);
+
+	for(int i = start; i < end; i++)
+	{
+		uint16_t next = fat_get(i);
+		if(ck.refs[i] > 0 && next != FAT_EOC && next < ck.num_entries)
+			__atomic_fetch_add(&ck.links[next], 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/* Scan a slice of the FAT for entries used by no chain (leaked), linked to
+ more often than their reference count says (cross-linked, files sharing
+ blocks fs_copy() did not share) or less often (bad reference count) */
+static void *scan_worker(void *arg)
+{
+	int t = (int)(intptr_t)arg;
+	int slice = (ck.num_entries + ck.num_threads - 1) / ck.num_threads;
+	int start = MAX(t * slice, 1);
+	int end = MIN((t + 1) * slice, ck.num_entries);
+
+	for(int i = start; i < end; i++)
+	{
+		int extra = ref_tab ? ref_tab[i] : 0;
+		if(ck.refs[i] > 0 && i < super->amt_blk_data)
+			ck.used[t]++;
+		if(fat_get(i) != 0 && ck.refs[i] == 0)
+			ck.leaked[t]++;
+		if(ck.links[i] > 1 + extra)
+			ck.crossed[t]++;
+		else if(extra && ck.links[i] < 1 + extra)
+			ck.bad_refs[t]++;
+	}
+	return NULL;
+}
+
+// run @func on ck.num_threads threads, the thread index being the argument
+static void run_threads(void *(*func)(void *))
+{
+	pthread_t threads[64];
+	for(int t = 0; t < ck.num_threads; t++)
+		pthread_create(&threads[t], NULL, func, (void *)(intptr_t)t);
+	for(int t = 0; t < ck.num_threads; t++)
+		pthread_join(threads[t], NULL);
+}
+
+static const char *chain_name(int id)
+{
+	if(id == CSUM_CHAIN) return "checksum table";
+	if(id == REF_CHAIN) return "reference table";
+	return (const char *)root_dir[id].fileName;
+}
+
+/* Make every chain sound again, in root dir order: cut cycles, bad links and
+ cross-links (the first chain keeps the shared blocks, unless the reference
+ table says they are shared), shrink files whose chain got too short, then
+ free whatever no chain owns */
+static int repair(void)
+{
+	int fixed = 0;
+	// id + 1 of the chain that went through each entry first
+	uint8_t *claimed = stats_calloc(ck.num_entries, 1);
+	if(claimed == NULL) return 0;
+
+	// a damaged reference table is dropped, its blocks get freed below
+	struct chain_result *r = &ck.results[REF_CHAIN];
+	if(super->ref_blk &&
+	   (r->state != CHAIN_OK || r->len < (size_t)ref_blk_count()))
+	{
+		free(ref_tab);
+		ref_tab = NULL;
+		super->ref_blk = 0;
+	}
+
+	for(int id = 0; id < NUM_CHAINS; id++)
+	{
+		uint16_t curr = chain_first(id);
+		uint16_t prev = FAT_EOC;
+		size_t len = 0;
+
+		while(curr != FAT_EOC)
+		{
+			// the rest of a shared chain is sound, an earlier file took it
+			if(curr > 0 && curr < ck.num_entries && claimed[curr] &&
+			   claimed[curr] != id + 1 && ref_tab && ref_tab[curr])
+			{
+				len += get_chain_len(curr);
+				break;
+			}
+			if(curr == 0 || curr >= ck.num_entries || fat_get(curr) == 0 ||
+			   claimed[curr])
+			{
+				if(id == CSUM_CHAIN)
+				{
+					// a damaged table is dropped, not trusted
+					super->csum_blk = 0;
+				}
+				else if(prev == FAT_EOC)
+					root_dir[id].first_data_blk_index = FAT_EOC;
+				else
+					fat_set(prev, FAT_EOC);
+				fixed++;
+				break;
+			}
+			claimed[curr] = id + 1;
+			len++;
+			prev = curr;
+			curr = fat_get(curr);
+		}
+
+		if(id != CSUM_CHAIN && root_dir[id].fileName[0] != '\0' &&
+		   root_dir[id].size > len * blk_size)
+		{
+			root_dir[id].size = len * blk_size;
+			fixed++;
+		}
+	}
+
+	// the dropped checksum table must not stay claimed
+	if(super->csum_blk == 0)
+	{
+		memset(claimed, 0, ck.num_entries);
+		for(int id = 0; id < NUM_CHAINS; id++)
+			for(uint16_t curr = chain_first(id); curr != FAT_EOC; curr = fat_get(curr))
+				claimed[curr] = 1;
+	}
+
+	for(int i = 1; i < ck.num_entries; i++)
+	{
+		if(fat_get(i) != 0 && !claimed[i])
+		{
+			fat_set(i, 0);
+			fixed++;
+		}
+	}
+	if(fat_get(0) != FAT_EOC)
+	{
+		fat_set(0, FAT_EOC);
+		fixed++;
+	}
+
+	free(claimed);
+	return fixed;
+}
+
+// a cleanly unmounted image must carry the summary its FAT gives
+static int check_summary(void)
+{
+	if(super->sum_version != SUM_VERSION || !(super->sum_flags & SUM_CLEAN))
+		return 0;
+
+	SuperBlock saved = *super;
+	sum_rebuild();
+	// next_free may lag behind, but never pass a free entry
+	int stale = saved.free_blk != super->free_blk ||
+		saved.next_free > super->next_free ||
+		saved.free_dirent != get_ratio(ROOT) ||
+		memcmp(saved.region_free, super->region_free, sizeof(saved.region_free));
+	*super = saved;
+	return stale;
+}
+
+// write the repaired superblock, FAT and root directory back
+static int write_meta(void)
+{
+	if(block_write(0,super) == -1) return -1;
+	if(write_fat() == -1) return -1;
+	if(ref_flush() == -1) return -1;
+	return block_write(super->root_dir_index,root_dir);
+}
+
+int fs_check(const char *diskname, int repair_fs, int num_threads,
+	     struct fs_check_report *report)
+{
+	STATS_OP(FS_OP_CHECK);
+
+	if(report == NULL || super != NULL)
+	{
+		fprintf(stderr, "fs_check: no report or a file system is mounted\n");
+		return -1;
+	}
+	memset(report, 0, sizeof(*report));
+
+	if(block_disk_open(diskname) == -1) return -1;
+
+	if(load_super() == -1)
+	{
+		printf("superblock: invalid signature or geometry\n");
+		report->errors++;
+		free_meta();
+		block_disk_close();
+		return -1;
+	}
+	// every FAT block gets scanned, and the workers must not load any
+	if(load_meta() == -1 || fat_load_all() == -1 || ref_load() == -1)
+	{
+		free_meta();
+		block_disk_close();
+		return -1;
+	}
+
+	memset(&ck, 0, sizeof(ck));
+	ck.num_entries = MIN(super->amt_blk_FAT*FAT_PER_BLK, (size_t)FAT_EOC);
+	ck.num_threads = MIN(MAX(num_threads, 1), 64);
+	ck.refs = stats_calloc(ck.num_entries, sizeof(uint16_t));
+	ck.links = stats_calloc(ck.num_entries, sizeof(uint16_t));
+	if(ck.refs == NULL || ck.links == NULL)
+	{
+		free(ck.refs);
+		free(ck.links);
+		free_meta();
+		block_disk_close();
+		return -1;
+	}
+
+	if(fat_get(0) != FAT_EOC)
+	{
+		printf("fat[0]: reserved entry is %d, expected %d\n", fat_get(0), FAT_EOC);
+		report->errors++;
+	}
+
+	// walk every chain in parallel, then scan the FAT in parallel
+	run_threads(chain_worker);
+	for(int id = 0; id < NUM_CHAINS; id++)
+	{
+		uint16_t first = chain_first(id);
+		if(first != FAT_EOC && first < ck.num_entries)
+			ck.links[first]++;
+	}
+	run_threads(link_worker);
+	run_threads(scan_worker);
+
+	for(int id = 0; id < NUM_CHAINS; id++)
+	{
+		struct chain_result *r = &ck.results[id];
+		if(id != CSUM_CHAIN && root_dir[id].fileName[0] != '\0')
+			report->files++;
+
+		if(r->state == CHAIN_CYCLE)
+		{
+			printf("%s: cycle back to block %d after block %d\n",
+			       chain_name(id), r->bad, r->last);
+			report->cycles++;
+		}
+		else if(r->state == CHAIN_BAD_LINK)
+		{
+			printf("%s: bad link to block %d after block %d\n",
+			       chain_name(id), r->bad, r->last);
+			report->bad_links++;
+		}
+
+		if(id != CSUM_CHAIN && root_dir[id].fileName[0] != '\0' &&
+		   root_dir[id].size > r->len * blk_size)
+		{
+			printf("%s: size %u but only %zu blocks in chain\n",
+			       chain_name(id), root_dir[id].size, r->len);
+			report->size_mismatches++;
+		}
+	}
+	if(super->csum_blk && ck.results[CSUM_CHAIN].len < (size_t)csum_blk_count())
+	{
+		printf("checksum table: %zu blocks, expected %d\n",
+		       ck.results[CSUM_CHAIN].len, csum_blk_count());
+		report->size_mismatches++;
+	}
+	if(super->ref_blk && ck.results[REF_CHAIN].len < (size_t)ref_blk_count())
+	{
+		printf("reference table: %zu blocks, expected %d\n",
+		       ck.results[REF_CHAIN].len, ref_blk_count());
+		report->size_mismatches++;
+	}
+
+	for(int t = 0; t < ck.num_threads; t++)
+	{
+		report->used_blocks += ck.used[t];
+		report->leaked_blocks += ck.leaked[t];
+		report->cross_links += ck.crossed[t];
+		report->bad_refs += ck.bad_refs[t];
+	}
+	if(report->leaked_blocks)
+		printf("fat: %d entries used by no file\n", report->leaked_blocks);
+	if(report->cross_links)
+		printf("fat: %d entries shared by several chains\n", report->cross_links);
+	if(report->bad_refs)
+		printf("fat: %d entries with a reference count above their links\n",
+		       report->bad_refs);
+
+	report->errors += report->cycles + report->bad_links +
+		report->size_mismatches + report->leaked_blocks +
+		report->cross_links + report->bad_refs;
+
+	// a broken FAT disagrees with the summary anyway, and repairing it
+	// rebuilds the summary
+	if(report->errors == 0 && check_summary())
+	{
+		printf("superblock: allocation summary does not match the FAT\n");
+		report->stale_summary = 1;
+		report->errors++;
+	}
+
+	int status = 0;
+	if(repair_fs && report->errors)
+	{
+		report->repaired = repair() + report->bad_refs + report->stale_summary;
+		// the repaired FAT gets a fresh summary and reference counts, the
+		// image is clean again
+		sum_rebuild();
+		ref_rebuild();
+		super->free_dirent = get_ratio(ROOT);
+		super->sum_flags |= SUM_CLEAN;
+		status = write_meta();
+	}
+
+	free(ck.refs);
+	free(ck.links);
+	free_meta();
+	block_disk_close();
+	return status;
+}
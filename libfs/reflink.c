@@ -0,0 +1,276 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+#include "stats.h"
+
+/*
+ * Shared chains: fs_copy() points the new root dir entry at the chain of the
+ * source file, so the two files share every block of it. Chains only branch
+ * towards their head, a block shared by two files shares its successors too,
+ * so a chain is owned by its file up to its first shared block and shared from
+ * there on. ref_tab counts, for every FAT entry, the links to it (a root dir
+ * entry or the FAT entry of another block) beyond the first one.
+ *
+ * Writing to a file copies its shared blocks up to the one written
+ * (chain_unshare()), deleting or truncating it drops one link from its shared
+ * part and frees only what it owned (chain_release()).
+ */
+
+/* Extra links to every FAT entry, NULL if the image has no shared chain yet */
+uint16_t *ref_tab;
+/* FAT entries with extra links, writers skip unsharing when there is none */
+static int ref_shared;
+/* Serializes the writers walking shared chains */
+static pthread_mutex_t ref_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// FAT entries covered by the table, holes included
+static int ref_entry_count(void)
+{
+	return MIN(super->amt_blk_FAT*FAT_PER_BLK, (size_t)FAT_EOC);
+}
+
+// number of blocks taken by the reference table, 2 bytes per FAT entry
+int ref_blk_count(void)
+{
+	return (ref_entry_count()*sizeof(uint16_t) + blk_size - 1)/blk_size;
+}
+
+// load the reference table of an image that has one
+int ref_load(void)
+{
+	ref_tab = NULL;
+	ref_shared = 0;
+	if(super->ref_blk == 0) return 0;
+
+	int num_blk = ref_blk_count();
+	ref_tab = block_buf_alloc(num_blk);
+	assert(ref_tab);
+	memset(ref_tab, 0, num_blk * blk_size);
+
+	// fs_check() loads it before checking its chain
+	uint16_t curr = super->ref_blk;
+	for(int i = 0; i < num_blk && curr != 0 && curr < super->amt_blk_data;
+	    i++, curr = fat_get(curr))
+	{
+		if(block_read(super->data_blk_index + curr,
+			      (uint8_t*)ref_tab + i*blk_size) == -1)
+			return -1;
+	}
+	for(int i = 0; i < ref_entry_count(); i++)
+		if(ref_tab[i]) ref_shared++;
+	return 0;
+}
+
+// give the image a reference table, in a chain of data blocks of its own
+static int ref_create(void)
+{
+	int num_blk = ref_blk_count();
+	uint16_t first;
+
+	if(chain_alloc(num_blk, &first) == -1)
+	{
+		perror("not enough free blocks for reference counts\n");
+		return -1;
+	}
+	super->ref_blk = first;
+	ref_tab = block_buf_alloc(num_blk);
+	assert(ref_tab);
+	memset(ref_tab, 0, num_blk * blk_size);
+	return 0;
+}
+
+// write the reference table back to its chain
+int ref_flush(void)
+{
+	if(ref_tab == NULL) return 0;
+	uint16_t curr = super->ref_blk;
+	for(int i = 0; curr != FAT_EOC; i++, curr = fat_get(curr))
+	{
+		if(block_write(super->data_blk_index + curr,
+			       (uint8_t*)ref_tab + i*blk_size) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+// count the links to every FAT entry again, after fs_check() repaired the FAT
+void ref_rebuild(void)
+{
+	if(ref_tab == NULL) return;
+
+	int num_entries = ref_entry_count();
+	memset(ref_tab, 0, num_entries*sizeof(uint16_t));
+	ref_shared = 0;
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++)
+	{
+		uint16_t first = root_dir[i].first_data_blk_index;
+		if(root_dir[i].fileName[0] != '\0' && first != FAT_EOC)
+			ref_tab[first]++;
+	}
+	for(int i = 1; i < num_entries; i++)
+	{
+		uint16_t next = fat_get(i);
+		if(next != 0 && next != FAT_EOC && next < num_entries)
+			ref_tab[next]++;
+	}
+	// the first link is not counted
+	for(int i = 0; i < num_entries; i++)
+	{
+		if(ref_tab[i]) ref_tab[i]--;
+		if(ref_tab[i]) ref_shared++;
+	}
+}
+
+static void ref_get(uint16_t i)
+{
+	if(ref_tab[i]++ == 0) ref_shared++;
+}
+
+static void ref_put(uint16_t i)
+{
+	if(--ref_tab[i] == 0) ref_shared--;
+}
+
+/* Give file @root_index blocks of its own for its first @upto + 1 blocks:
+ each shared one is copied to a new block linked to the same successor, which
+ gains a link. Holes get a hole entry of their own. @bounce_buf holds a block
+ for the copies. Return -1, changing nothing, if the disk cannot hold the
+ copies. */
+int chain_unshare(int root_index, size_t upto, void *bounce_buf)
+{
+	if(__atomic_load_n(&ref_shared, __ATOMIC_RELAXED) == 0) return 0;
+
+	int status = 0;
+	uint16_t prev = FAT_EOC;
+	uint16_t curr = root_dir[root_index].first_data_blk_index;
+
+	pthread_mutex_lock(&ref_lock);
+	// every block from the first shared one on gets copied
+	size_t blk = 0, copies = 0;
+	for(; curr != FAT_EOC && blk <= upto; blk++, curr = fat_get(curr))
+	{
+		if(copies || ref_tab[curr])
+			copies += !IS_HOLE(curr);
+	}
+	if(copies > (size_t)alloc_free_count())
+	{
+		pthread_mutex_unlock(&ref_lock);
+		return -1;
+	}
+
+	curr = root_dir[root_index].first_data_blk_index;
+	for(blk = 0; curr != FAT_EOC && blk <= upto; blk++)
+	{
+		if(ref_tab[curr])
+		{
+			int index = IS_HOLE(curr) ? get_hole_index() : -1;
+			if(index == -1)
+			{
+				index = alloc_block(prev);
+				if(index == -1)
+				{
+					status = -1;
+					break;
+				}
+				// a zeroed data block stands in for a hole, as in fill_gap()
+				if(IS_HOLE(curr))
+				{
+					memset(bounce_buf, 0, blk_size);
+					csum_update(index, bounce_buf);
+				}
+				else
+				{
+					block_read(super->data_blk_index + curr, bounce_buf);
+					if(csum_tab) csum_tab[index] = csum_tab[curr];
+				}
+				block_write(super->data_blk_index + index, bounce_buf);
+				STATS_ADD(cow_copies, 1);
+			}
+
+			uint16_t next = fat_get(curr);
+			fat_set(index, next);
+			if(next != FAT_EOC)
+				ref_get(next);
+			ref_put(curr);
+			if(prev == FAT_EOC)
+				root_dir[root_index].first_data_blk_index = index;
+			else
+				fat_set(prev, index);
+			curr = index;
+			extents_drop(root_index);
+		}
+		prev = curr;
+		curr = fat_get(curr);
+		STATS_ADD(fat_walk_steps, 1);
+	}
+	pthread_mutex_unlock(&ref_lock);
+	return status;
+}
+
+/* Drop the link to the chain starting at @first: free its blocks up to the
+ first one still linked from elsewhere */
+void chain_release(uint16_t first)
+{
+	uint16_t curr = first, next;
+
+	pthread_mutex_lock(&ref_lock);
+	while(curr != FAT_EOC)
+	{
+		if(ref_tab && ref_tab[curr])
+		{
+			ref_put(curr);
+			break;
+		}
+		next = fat_get(curr);
+		fat_set(curr, 0);
+		curr = next;
+		STATS_ADD(fat_walk_steps, 1);
+	}
+	pthread_mutex_unlock(&ref_lock);
+}
+
+// whether file @root_index shares blocks with another file
+int chain_shared(int root_index)
+{
+	if(ref_shared == 0) return 0;
+	for(uint16_t curr = root_dir[root_index].first_data_blk_index;
+	    curr != FAT_EOC; curr = fat_get(curr))
+	{
+		if(ref_tab[curr]) return 1;
+	}
+	return 0;
+}
+
+int fs_copy(const char *src, const char *dst)
+{
+	STATS_OP(FS_OP_COPY);
+	META_CHANGE();
+
+	if(super == NULL || !name_valid(src) || !name_valid(dst)) return -1;
+
+	int src_index = get_index(CURR_FILE, src);
+	if(src_index == -1 || get_index(CURR_FILE, dst) != -1) return -1;
+	int dst_index = get_index(ROOT, dst);
+	if(dst_index == -1) return -1;
+
+	uint16_t first = root_dir[src_index].first_data_blk_index;
+	if(first != FAT_EOC && ref_tab == NULL && ref_create() == -1)
+		return -1;
+
+	root_dir[dst_index].size = root_dir[src_index].size;
+	strcpy((char*)root_dir[dst_index].fileName, dst);
+	root_dir[dst_index].first_data_blk_index = first;
+	if(first != FAT_EOC)
+	{
+		pthread_mutex_lock(&ref_lock);
+		ref_get(first);
+		pthread_mutex_unlock(&ref_lock);
+	}
+	return 0;
+}
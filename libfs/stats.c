@@ -0,0 +1,131 @@
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+#include "stats.h"
+
+static const char *op_names[FS_OP_COUNT] = {
+	[FS_OP_MOUNT] = "mount",
+	[FS_OP_UMOUNT] = "umount",
+	[FS_OP_INFO] = "info",
+	[FS_OP_CREATE] = "create",
+	[FS_OP_DELETE] = "delete",
+	[FS_OP_LS] = "ls",
+	[FS_OP_OPEN] = "open",
+	[FS_OP_CLOSE] = "close",
+	[FS_OP_STAT] = "stat",
+	[FS_OP_LSEEK] = "lseek",
+	[FS_OP_WRITE] = "write",
+	[FS_OP_READ] = "read",
+	[FS_OP_TRUNCATE] = "truncate",
+	[FS_OP_FALLOCATE] = "fallocate",
+	[FS_OP_STAT_ALLOC] = "stat_alloc",
+	[FS_OP_FORMAT] = "format",
+	[FS_OP_CHECK] = "check",
+	[FS_OP_FRAG] = "frag",
+	[FS_OP_DEFRAG] = "defrag",
+	[FS_OP_CREATE_MANY] = "create_many",
+	[FS_OP_DELETE_MANY] = "delete_many",
+	[FS_OP_LIST] = "list",
+	[FS_OP_SYNC] = "sync",
+	[FS_OP_COPY] = "copy",
+	[FS_OP_DUMP] = "dump",
+	[FS_OP_RESTORE] = "restore",
+};
+
+uint64_t fs_stats_bucket_ns(int bucket)
+{
+	if (bucket < 4)
+		return bucket < 0 ? 0 : bucket;
+	return (uint64_t)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+uint64_t fs_stats_percentile(const struct fs_op_stats *op, double pct)
+{
+	if (op == NULL || op->calls == 0)
+		return 0;
+
+	uint64_t target = (uint64_t)(op->calls * pct / 100.0);
+	uint64_t seen = 0;
+	for (int i = 0; i < FS_STATS_BUCKETS; i++) {
+		seen += op->hist[i];
+		if (seen > target || seen == op->calls)
+			return fs_stats_bucket_ns(i + 1);
+	}
+	return fs_stats_bucket_ns(FS_STATS_BUCKETS);
+}
+
+const char *fs_stats_op_name(enum fs_op op)
+{
+	if ((unsigned int)op >= FS_OP_COUNT)
+		return NULL;
+	return op_names[op];
+}
+
+#ifdef FS_STATS
+
+struct fs_stats fs_stats_data;
+
+/* Log-linear buckets: values under 4 get one each, then every power of two
+ is split in 4 by the two bits that follow the leading one */
+static int bucket_of(uint64_t ns)
+{
+	if (ns < 4)
+		return ns;
+
+	int msb = 63 - __builtin_clzll(ns);
+	int bucket = (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+	return bucket < FS_STATS_BUCKETS ? bucket : FS_STATS_BUCKETS - 1;
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record(struct fs_op_stats *op, uint64_t ns)
+{
+	__atomic_fetch_add(&op->calls, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&op->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&op->hist[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+}
+
+void op_scope_end(struct op_scope *scope)
+{
+	stats_record(&fs_stats_data.ops[scope->op], stats_now() - scope->start);
+	block_trace_origin(scope->prev_origin);
+}
+
+int fs_stats(struct fs_stats *stats)
+{
+	if (stats == NULL)
+		return -1;
+	memcpy(stats, &fs_stats_data, sizeof(*stats));
+	return 0;
+}
+
+void fs_stats_reset(void)
+{
+	memset(&fs_stats_data, 0, sizeof(fs_stats_data));
+}
+
+#else
+
+void op_scope_end(struct op_scope *scope)
+{
+	block_trace_origin(scope->prev_origin);
+}
+
+int fs_stats(struct fs_stats *stats)
+{
+	(void)stats;
+	return -1;
+}
+
+void fs_stats_reset(void)
+{
+}
+
+#endif /* FS_STATS */
@@ -0,0 +1,93 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+/*
+ * Instrumentation hooks behind fs_stats(). Without FS_STATS the counters
+ * expand to nothing, so an uninstrumented build pays nothing for them.
+ * Counters are bumped with relaxed atomics: the fsck worker threads read
+ * blocks concurrently.
+ *
+ * STATS_OP() also tags the block I/O of the call with its operation for the
+ * block tracer (see block_trace_start()), which works in both builds.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "disk.h"
+#include "fs.h"
+
+/* Scope of a public call, closed when the enclosing function returns */
+struct op_scope {
+	int prev_origin;
+#ifdef FS_STATS
+	enum fs_op op;
+	uint64_t start;
+#endif
+};
+
+void op_scope_end(struct op_scope *scope);
+
+#ifdef FS_STATS
+
+extern struct fs_stats fs_stats_data;
+
+uint64_t stats_now(void);
+void stats_record(struct fs_op_stats *op, uint64_t ns);
+
+#define STATS_ADD(field, n) \
+	__atomic_fetch_add(&fs_stats_data.field, (n), __ATOMIC_RELAXED)
+
+/* Count a call of @op and time it until the function returns */
+#define STATS_OP(op) \
+	struct op_scope _op_scope __attribute__((cleanup(op_scope_end))) \
+		= { block_trace_origin(op), (op), stats_now() }
+
+/* Bytes transferred by the operation being timed */
+#define STATS_BYTES(n) STATS_ADD(ops[_op_scope.op].bytes, (n))
+
+/* Count one call of @field (a struct fs_op_stats) that began at @start, a
+ STATS_START() value */
+#define STATS_START() stats_now()
+#define STATS_TIME(field, start) \
+	stats_record(&fs_stats_data.field, stats_now() - (start))
+
+#else
+
+#define STATS_ADD(field, n) do { } while (0)
+#define STATS_OP(op) \
+	struct op_scope _op_scope __attribute__((cleanup(op_scope_end))) \
+		= { block_trace_origin(op) }
+#define STATS_BYTES(n) do { } while (0)
+#define STATS_START() 0
+#define STATS_TIME(field, start) do { (void)(start); } while (0)
+
+#endif /* FS_STATS */
+
+/* Heap allocations of libfs go through these, so that heap_allocs counts all
+ of them */
+static inline void *stats_malloc(size_t size)
+{
+	STATS_ADD(heap_allocs, 1);
+	return malloc(size);
+}
+
+static inline void *stats_calloc(size_t nmemb, size_t size)
+{
+	STATS_ADD(heap_allocs, 1);
+	return calloc(nmemb, size);
+}
+
+static inline void *stats_realloc(void *ptr, size_t size)
+{
+	STATS_ADD(heap_allocs, 1);
+	return realloc(ptr, size);
+}
+
+static inline int stats_memalign(void **memptr, size_t alignment, size_t size)
+{
+	STATS_ADD(heap_allocs, 1);
+	return posix_memalign(memptr, alignment, size);
+}
+
+#endif /* _STATS_H */
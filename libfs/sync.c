@@ -0,0 +1,156 @@
+#define _GNU_SOURCE /* for PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+#include "stats.h"
+
+/*
+ * Write back with group commit: fs_sync() callers take a ticket, and a write
+ * back covers every ticket taken before it started. A caller that finds one
+ * in progress waits for it; if it came too late to be covered, the first
+ * waiter to wake up starts the next write back for all the others, so any
+ * number of concurrent callers costs at most two rounds of flushes.
+ *
+ * With %FS_DURABLE_PERIODIC, a thread started at mount calls fs_sync() every
+ * sync_interval_ms until fs_umount().
+ *
+ * The calls that change the metadata hold meta_lock shared (META_CHANGE()),
+ * a write back holds it exclusive, so that it saves the FAT, the root
+ * directory and the superblock summary as they were at one moment. Writers
+ * get preference, a stream of fs_write() calls cannot hold a write back off.
+ */
+pthread_rwlock_t meta_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+void meta_unlock(int *held)
+{
+	(void)held;
+	pthread_rwlock_unlock(&meta_lock);
+}
+
+static struct {
+	pthread_mutex_t lock;
+	/* signalled when a write back completes */
+	pthread_cond_t done;
+	/* tickets handed out, and the last one covered by a completed write
+	 back */
+	uint64_t requested, completed;
+	/* result of that write back */
+	int status;
+	int running;
+	/* periodic flusher */
+	pthread_cond_t wake;
+	pthread_t thread;
+	int started;
+	int stop;
+} sc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+int fs_sync(void)
+{
+	STATS_OP(FS_OP_SYNC);
+
+	// check if we can write back super block to disk
+	if(super == NULL || block_disk_count() == -1) return -1;
+
+	pthread_mutex_lock(&sc.lock);
+	uint64_t ticket = ++sc.requested;
+	while(sc.running && sc.completed < ticket)
+		pthread_cond_wait(&sc.done, &sc.lock);
+	if(sc.completed >= ticket)
+	{
+		int status = sc.status;
+		pthread_mutex_unlock(&sc.lock);
+		STATS_ADD(sync_shared, 1);
+		return status;
+	}
+	// everyone waiting so far is covered by this write back
+	uint64_t covered = sc.requested;
+	sc.running = 1;
+	pthread_mutex_unlock(&sc.lock);
+
+	pthread_rwlock_wrlock(&meta_lock);
+	int status = sync_meta();
+	pthread_rwlock_unlock(&meta_lock);
+
+	pthread_mutex_lock(&sc.lock);
+	sc.running = 0;
+	sc.completed = covered;
+	sc.status = status;
+	pthread_cond_broadcast(&sc.done);
+	pthread_mutex_unlock(&sc.lock);
+	return status;
+}
+
+static void *sync_worker(void *arg)
+{
+	(void)arg;
+	unsigned int ms = mount_opts.sync_interval_ms;
+	if(ms == 0) ms = 1000;
+
+	pthread_mutex_lock(&sc.lock);
+	while(!sc.stop)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += ms / 1000;
+		deadline.tv_nsec += (ms % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while(!sc.stop &&
+		      pthread_cond_timedwait(&sc.wake, &sc.lock, &deadline) != ETIMEDOUT);
+		if(sc.stop) break;
+
+		pthread_mutex_unlock(&sc.lock);
+		// a failed write back is retried on the next period
+		fs_sync();
+		pthread_mutex_lock(&sc.lock);
+	}
+	pthread_mutex_unlock(&sc.lock);
+	return NULL;
+}
+
+// start the periodic flusher if the mount asks for one, see fs_mount_opts()
+int sync_start(void)
+{
+	if(mount_opts.durability != FS_DURABLE_PERIODIC || sc.started) return 0;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sc.wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	sc.stop = 0;
+	if(pthread_create(&sc.thread, NULL, sync_worker, NULL) != 0)
+	{
+		pthread_cond_destroy(&sc.wake);
+		return -1;
+	}
+	sc.started = 1;
+	return 0;
+}
+
+// stop the periodic flusher, before the last write back of fs_umount()
+void sync_exit(void)
+{
+	if(!sc.started) return;
+
+	pthread_mutex_lock(&sc.lock);
+	sc.stop = 1;
+	pthread_cond_signal(&sc.wake);
+	pthread_mutex_unlock(&sc.lock);
+
+	pthread_join(sc.thread, NULL);
+	pthread_cond_destroy(&sc.wake);
+	sc.started = 0;
+}